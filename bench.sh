@@ -0,0 +1,94 @@
+#!/bin/bash
+# Loopback benchmark. Runs a receiver/sender pair for every combination of
+# CHUNKS x WINDOWS x LOSSES and writes one CSV row per run, to stdout and to
+# $OUT, so results can be diffed between commits.
+#
+# Settings come from the environment (defaults in brackets):
+#   CHUNKS         chunk sizes [512 1400 8964]
+#   WINDOWS        window sizes [16 64 256]
+#   LOSSES         loss rates emulated at the receiver [0 0.01 0.05]
+#   MODE           gbn or sr [gbn]
+#   SIZE_MB        size of the input file [16]
+#   DATA           input contents: random (incompressible) or text (numbered
+#                  lines, about 2:1 with -z) [random]
+#   SENDER_ARGS    extra sender options, e.g. "-c reno -G" or "-z 4" []
+#   RECEIVER_ARGS  extra receiver options, e.g. "-G" []
+#   PORT           UDP port [9100]
+#   TIMEOUT        seconds before a run is abandoned [120]
+#   OUT            CSV file [bench.csv]
+#
+# Columns: goodput is MB/s (10^6 bytes) of file data sent (with -R, only
+# what followed the resume offset) and wire the MB/s of datagrams (headers,
+# retransmits and compressed payloads as sent), so with -z goodput above
+# wire is the compression's gain. pps counts every
+# datagram the sender sent (parity included), retx_ratio is resent / sent,
+# recovered counts packets the receiver rebuilt from -F parity, and the CPU
+# times are user + system time of each process. ok is 1 when the sender succeeded
+# and the received file matches.
+
+CHUNKS=${CHUNKS:-"512 1400 8964"}
+WINDOWS=${WINDOWS:-"16 64 256"}
+LOSSES=${LOSSES:-"0 0.01 0.05"}
+MODE=${MODE:-gbn}
+SIZE_MB=${SIZE_MB:-16}
+DATA=${DATA:-random}
+PORT=${PORT:-9100}
+TIMEOUT=${TIMEOUT:-120}
+OUT=${OUT:-bench.csv}
+
+cd "$(dirname "$0")" || exit 1
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+if [ "$DATA" = text ]; then
+    seq 1 $((SIZE_MB * 200000)) | head -c $((SIZE_MB * 1000000)) > "$dir/in.bin"
+else
+    head -c $((SIZE_MB * 1000000)) /dev/urandom > "$dir/in.bin"
+fi
+
+# Value of a "name: value" summary line
+stat() {
+    sed -n "s/^$1: //p" "$2" | tail -n 1
+}
+
+echo "chunk_size,window_size,loss_rate,mode,bytes,time_ms,goodput_mbps,wire_mbps,pps,retx_ratio,recovered,sender_cpu_ms,receiver_cpu_ms,ok" | tee "$OUT"
+for chunk in $CHUNKS; do
+    for window in $WINDOWS; do
+        for loss in $LOSSES; do
+            rm -f "$dir/out.bin"
+            ./receiver -m "$MODE" -l 0 -o "$dir/out.bin" $RECEIVER_ARGS "$PORT" "$loss" > "$dir/r.txt" 2>&1 &
+            rpid=$!
+            sleep 0.2
+            timeout "$TIMEOUT" ./sender -m "$MODE" -f "$dir/in.bin" $SENDER_ARGS 127.0.0.1 "$PORT" "$chunk" "$window" \
+                > "$dir/s.txt" 2>&1
+            src=$?
+            # The receiver exits on its own once the tear-down is done
+            for i in $(seq 50); do
+                kill -0 $rpid 2>/dev/null || break
+                sleep 0.1
+            done
+            kill $rpid 2>/dev/null
+            wait $rpid 2>/dev/null
+
+            ok=0
+            if [ $src -eq 0 ] && cmp -s "$dir/in.bin" "$dir/out.bin"; then
+                ok=1
+            fi
+            awk -v chunk="$chunk" -v window="$window" -v loss="$loss" -v mode="$MODE" -v ok="$ok" \
+                -v bytes="$(stat "bytes sent" "$dir/s.txt")" \
+                -v wire="$(stat "wire bytes sent" "$dir/s.txt")" \
+                -v usec="$(stat "transfer time usec" "$dir/s.txt")" \
+                -v sent="$(stat "packets sent" "$dir/s.txt")" \
+                -v resent="$(stat "packets resent" "$dir/s.txt")" \
+                -v scpu="$(stat "cpu time usec" "$dir/s.txt")" \
+                -v rcpu="$(stat "cpu time usec" "$dir/r.txt")" \
+                -v recovered="$(stat "packets recovered" "$dir/r.txt")" \
+                'BEGIN {
+                    if (usec == 0) usec = 1
+                    if (sent == 0) sent = 1
+                    printf "%s,%s,%s,%s,%d,%.1f,%.2f,%.2f,%.0f,%.4f,%d,%.1f,%.1f,%d\n",
+                        chunk, window, loss, mode, bytes, usec / 1000, bytes / usec, wire / usec,
+                        sent * 1000000 / usec, resent / sent, recovered, scpu / 1000, rcpu / 1000, ok
+                }' | tee -a "$OUT"
+        done
+    done
+done
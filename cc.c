@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <string.h>
+#include "cc.h"
+#include "timer.h"
+
+// Vegas thresholds, in packets queued at the bottleneck
+#define DELAY_ALPHA 2.0
+#define DELAY_BETA 4.0
+// Most packets one ACK may add to the window in slow start (RFC 3465's L)
+#define ABC_LIMIT 2
+
+
+// Fixed window: always window_size, the original go-back-N behaviour
+static void fixed_init(struct cc *cc)
+{
+    cc->cwnd = cc->max_window;
+    cc->ssthresh = cc->max_window;
+}
+
+static void fixed_on_ack(struct cc *cc, int32_t acked, long rtt_usec)
+{
+}
+
+static void fixed_on_loss(struct cc *cc)
+{
+}
+
+// Reno-style AIMD: slow start doubles the window every round trip up to
+// ssthresh, congestion avoidance then adds one packet per round trip. Loss
+// halves the window; a timeout restarts slow start from one packet.
+static void reno_init(struct cc *cc)
+{
+    cc->cwnd = 1;
+    cc->ssthresh = cc->max_window;
+}
+
+// Counts packets rather than ACKs, so delayed ACKs that cover several
+// packets grow the window as fast as one ACK each would. In slow start a
+// single ACK adds at most ABC_LIMIT, so a cumulative jump over a repaired
+// hole doesn't release a burst the size of the hole.
+static void reno_on_ack(struct cc *cc, int32_t acked, long rtt_usec)
+{
+    int32_t grow = acked < ABC_LIMIT ? acked : ABC_LIMIT;
+    for (int32_t i = 0; i < acked; ++i) {
+        if (cc->cwnd < cc->ssthresh) {
+            if (grow > 0) {
+                cc->cwnd += 1;
+                grow--;
+            }
+        } else {
+            cc->cwnd += 1 / cc->cwnd;
+        }
+    }
+}
+
+static void reno_on_loss(struct cc *cc)
+{
+    cc->ssthresh = cc->cwnd / 2;
+    if (cc->ssthresh < 2) {
+        cc->ssthresh = 2;
+    }
+    cc->cwnd = cc->ssthresh;
+}
+
+static void reno_on_timeout(struct cc *cc)
+{
+    cc->ssthresh = cc->cwnd / 2;
+    if (cc->ssthresh < 2) {
+        cc->ssthresh = 2;
+    }
+    cc->cwnd = 1;
+}
+
+// Delay-based (Vegas-style): compares the throughput expected at the lowest
+// RTT seen with the throughput at the current RTT. The difference estimates
+// how many packets sit in the bottleneck queue; keep it between alpha and
+// beta. Loss is handled like Reno.
+static void delay_on_ack(struct cc *cc, int32_t acked, long rtt_usec)
+{
+    if (rtt_usec > 0) {
+        cc->last_rtt = rtt_usec;
+        if (cc->base_rtt == 0 || rtt_usec < cc->base_rtt) {
+            cc->base_rtt = rtt_usec;
+        }
+    }
+    if (cc->base_rtt == 0 || cc->last_rtt == 0) {
+        reno_on_ack(cc, acked, rtt_usec);
+        return;
+    }
+    double queued = cc->cwnd * (1.0 - (double) cc->base_rtt / cc->last_rtt);
+    for (int32_t i = 0; i < acked; ++i) {
+        if (cc->cwnd < cc->ssthresh && queued < DELAY_ALPHA) {
+            cc->cwnd += 1;
+        } else if (queued < DELAY_ALPHA) {
+            cc->cwnd += 1 / cc->cwnd;
+        } else if (queued > DELAY_BETA) {
+            cc->cwnd -= 1 / cc->cwnd;
+            cc->ssthresh = cc->cwnd;
+        }
+    }
+}
+
+static const struct cc_ops cc_algorithms[] = {
+    { "fixed", fixed_init, fixed_on_ack, fixed_on_loss, fixed_on_loss },
+    { "reno", reno_init, reno_on_ack, reno_on_loss, reno_on_timeout },
+    { "delay", reno_init, delay_on_ack, reno_on_loss, reno_on_timeout },
+};
+
+// Appends one line of time_usec,event,cwnd,ssthresh,inflight to the cwnd log
+static void cc_log(struct cc *cc, const char *event, int32_t inflight)
+{
+    if (cc->log == NULL) {
+        return;
+    }
+    fprintf(cc->log, "%" PRIu64 ",%s,%.2f,%.2f,%d\n", now_usec() - cc->log_start, event,
+            cc->cwnd, cc->ssthresh, inflight);
+}
+
+// Picks the algorithm by name (fixed, reno or delay). If log is not NULL,
+// every window change is written to it as CSV.
+int cc_init(struct cc *cc, const char *name, int32_t max_window, FILE *log)
+{
+    memset(cc, 0, sizeof(*cc));
+    for (size_t i = 0; i < sizeof(cc_algorithms) / sizeof(cc_algorithms[0]); ++i) {
+        if (strcmp(cc_algorithms[i].name, name) == 0) {
+            cc->ops = &cc_algorithms[i];
+        }
+    }
+    if (cc->ops == NULL) {
+        fprintf(stderr, "[cc_init]: unknown congestion control '%s' (expected fixed, reno or delay)\n", name);
+        return -1;
+    }
+    cc->max_window = max_window;
+    cc->log = log;
+    cc->log_start = now_usec();
+    cc->ops->init(cc);
+    if (log != NULL) {
+        fprintf(log, "time_usec,event,cwnd,ssthresh,inflight\n");
+        cc_log(cc, "init", 0);
+    }
+    return 0;
+}
+
+// Number of packets the sender may have in flight right now
+int32_t cc_window(struct cc *cc)
+{
+    if (cc->cwnd < 1) {
+        cc->cwnd = 1;
+    } else if (cc->cwnd > cc->max_window) {
+        cc->cwnd = cc->max_window;
+    }
+    return (int32_t) cc->cwnd;
+}
+
+void cc_on_ack(struct cc *cc, int32_t acked, long rtt_usec, int32_t inflight)
+{
+    cc->ops->on_ack(cc, acked, rtt_usec);
+    cc_window(cc);
+    cc_log(cc, "ack", inflight);
+}
+
+void cc_on_loss(struct cc *cc, int32_t inflight)
+{
+    cc->ops->on_loss(cc);
+    cc_window(cc);
+    cc_log(cc, "loss", inflight);
+}
+
+void cc_on_timeout(struct cc *cc, int32_t inflight)
+{
+    cc->ops->on_timeout(cc);
+    cc_window(cc);
+    cc_log(cc, "timeout", inflight);
+}
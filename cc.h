@@ -0,0 +1,39 @@
+#include <stdio.h>
+#include <inttypes.h>
+
+#pragma once
+
+
+struct cc;
+
+// A congestion control algorithm. Windows are counted in packets.
+struct cc_ops {
+    const char *name;
+    void (*init)(struct cc *cc);
+    // 'acked' new packets were cumulatively acknowledged; rtt_usec is an RTT
+    // sample taken from this ACK, or -1 if there was none (Karn's rule)
+    void (*on_ack)(struct cc *cc, int32_t acked, long rtt_usec);
+    // Loss detected from duplicate ACKs or SACK holes
+    void (*on_loss)(struct cc *cc);
+    // The retransmission timer expired
+    void (*on_timeout)(struct cc *cc);
+};
+
+// Congestion window state. The effective window never exceeds max_window,
+// which is the window_size given on the command line.
+struct cc {
+    const struct cc_ops *ops;
+    double cwnd;
+    double ssthresh;
+    int32_t max_window;
+    long base_rtt;
+    long last_rtt;
+    FILE *log;
+    uint64_t log_start;
+};
+
+int cc_init(struct cc *cc, const char *name, int32_t max_window, FILE *log);
+int32_t cc_window(struct cc *cc);
+void cc_on_ack(struct cc *cc, int32_t acked, long rtt_usec, int32_t inflight);
+void cc_on_loss(struct cc *cc, int32_t inflight);
+void cc_on_timeout(struct cc *cc, int32_t inflight);
@@ -0,0 +1,167 @@
+#!/bin/bash
+# Loopback regression checks, run by `make check`. Each check runs a
+# receiver/sender pair (or a few in a row) and passes if the senders
+# succeed, the receivers exit cleanly and the output matches the input.
+# Prints one line per check and exits non-zero if any failed.
+#
+# Settings come from the environment (defaults in brackets):
+#   PORT     UDP port [9200]
+#   TIMEOUT  seconds before a run is abandoned [60]
+
+PORT=${PORT:-9200}
+TIMEOUT=${TIMEOUT:-60}
+
+cd "$(dirname "$0")" || exit 1
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+head -c 4000000 /dev/urandom > "$dir/in.bin"
+head -c 1000000 /dev/urandom > "$dir/small.bin"
+head -c 24000000 /dev/urandom > "$dir/big.bin"
+seq 1 600000 > "$dir/text.bin"
+head -c 1 /dev/urandom > "$dir/one.bin"
+: > "$dir/empty.bin"
+failed=0
+
+# Datagrams of protocol version 1 (a data packet with a 4-byte payload)
+# from another port, until killed
+send_v1() {
+    while true; do
+        printf '\x10\x01\x00\x04\x00\x00\x00\x00abcd' > "/dev/udp/127.0.0.1/$PORT"
+        sleep 0.01
+    done
+}
+
+# Receiver options, sender options and the input file in $dir (in.bin if
+# not given), into whatever $dir/out.bin already holds; $dir/r.txt and
+# $dir/s.txt hold the receiver's and sender's output afterwards
+transfer() {
+    local in="$dir/${3:-in.bin}"
+    timeout "$TIMEOUT" ./receiver -l 0 -o "$dir/out.bin" $1 "$PORT" > "$dir/r.txt" 2>&1 &
+    rpid=$!
+    sleep 0.2
+    timeout "$TIMEOUT" ./sender -f "$in" $2 127.0.0.1 "$PORT" 1400 64 > "$dir/s.txt" 2>&1
+    src=$?
+    wait $rpid
+    rrc=$?
+    if [ $src -eq 0 ] && [ $rrc -eq 0 ] && cmp -s "$in" "$dir/out.bin"; then
+        return 0
+    fi
+    echo "  sender exit $src, receiver exit $rrc" >&2
+    return 1
+}
+
+# Like transfer, into a fresh output file
+run() {
+    rm -f "$dir/out.bin" "$dir/out.bin.ckpt"
+    transfer "$@"
+}
+
+run_case() {
+    if "$@"; then
+        echo "ok   $1"
+    else
+        echo "FAIL $1"
+        failed=1
+    fi
+}
+
+plain() {
+    run "" ""
+}
+
+one_byte() {
+    run "" "" one.bin
+}
+
+# A sender with nothing to send goes straight to tear-down, which still
+# makes an empty output file and counts as a transfer
+empty() {
+    run "" "" empty.bin
+}
+
+# Selective repeat over a lossy link, so the SACK bitmap gets used
+selective_repeat() {
+    run "-m sr -I loss=0.01,seed=1" "-m sr" small.bin
+}
+
+# Parity groups over a lossy link; some packets have to be rebuilt
+parity() {
+    run "-I loss=0.01,seed=2" "-F 8" small.bin
+    [ $? -eq 0 ] && grep -q "^packets recovered: [1-9]" "$dir/r.txt"
+}
+
+# Three stripes, one transfer, spread over two receiver workers
+stripes() {
+    run "-t 2" "-s 3"
+}
+
+# Compressible input, compressed and decompressed on worker threads
+compress() {
+    run "-z 2" "-z 2" text.bin
+}
+
+# Producer and writer stages on threads of their own
+pipeline() {
+    run "-w" "-w"
+}
+
+uring() {
+    run "-U" "-U"
+}
+
+gro() {
+    run "-G" "-G"
+}
+
+# Loss, duplication, reordering and delay on the data, and loss on the ACKs.
+# The receiver lingers in case the tear-down ACK is lost.
+impaired() {
+    run "-l 3 -I loss=0.01,dup=0.01,reorder=0.01,delay=1,jitter=1,seed=3" "-I loss=0.01,seed=4" small.bin
+}
+
+# A paced -R transfer that dies along with its receiver after its first
+# checkpoint, a second run that resumes from it, and a third that finds
+# nothing left to send
+resume() {
+    rm -f "$dir/out.bin" "$dir/out.bin.ckpt"
+    ./receiver -l 0 -o "$dir/out.bin" "$PORT" > "$dir/r.txt" 2>&1 &
+    rpid=$!
+    sleep 0.2
+    ./sender -f "$dir/big.bin" -R -p 100 127.0.0.1 "$PORT" 1400 64 > "$dir/s.txt" 2>&1 &
+    spid=$!
+    sleep 1.2
+    kill -9 $spid $rpid
+    wait $spid $rpid 2>/dev/null
+    transfer "" "-R" big.bin || return 1
+    grep -q "^resume_from = [1-9]" "$dir/s.txt" || return 1
+    grep -q "^resume_from = 24000000$" "$dir/s.txt" && return 1
+    transfer "" "-R" big.bin || return 1
+    grep -q "^resume_from = 24000000$" "$dir/s.txt"
+}
+
+# An old-version peer sending to the port before and during a transfer is
+# dropped and counted; the transfer still completes
+stray_v1() {
+    send_v1 &
+    spid=$!
+    run "" ""
+    ret=$?
+    kill $spid
+    wait $spid 2>/dev/null
+    [ $ret -eq 0 ] && grep -q "^malformed packets dropped: [1-9]" "$dir/r.txt"
+}
+
+run_case plain
+run_case empty
+run_case one_byte
+run_case selective_repeat
+run_case parity
+run_case stripes
+run_case compress
+run_case pipeline
+run_case uring
+run_case gro
+run_case impaired
+run_case resume
+run_case stray_v1
+exit $failed
@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "checkpoint.h"
+
+
+// Reads the checkpoint at 'path'. Returns -1 if there is none or it isn't
+// one this version wrote; a transfer without a usable checkpoint starts
+// from the beginning.
+int checkpoint_load(const char *path, struct checkpoint *ck)
+{
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        return -1;
+    }
+    char magic[32];
+    int version;
+    int ret = fscanf(in, "%31s %d %" SCNx64 " %" SCNu64 " %" SCNu32 " %" SCNu64, magic, &version,
+            &ck->key, &ck->total, &ck->chunk_size, &ck->offset);
+    fclose(in);
+    if (ret != 6 || strcmp(magic, CHECKPOINT_MAGIC) != 0 || version != CHECKPOINT_VERSION
+            || ck->offset > ck->total) {
+        fprintf(stderr, "[checkpoint_load]: ignoring bad checkpoint %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// Syncs the directory holding 'path', which makes a rename into it durable
+static int sync_dir(const char *path)
+{
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", path);
+    char *slash = strrchr(dir, '/');
+    if (slash == NULL) {
+        snprintf(dir, sizeof(dir), ".");
+    } else {
+        slash[slash == dir ? 1 : 0] = '\0';
+    }
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
+        perror("[checkpoint_save]: open directory");
+        return -1;
+    }
+    int ret = fsync(fd);
+    if (ret == -1) {
+        perror("[checkpoint_save]: fsync directory");
+    }
+    close(fd);
+    return ret;
+}
+
+// Replaces the checkpoint at 'path'. The new one is written to a file of
+// its own, synced and renamed over the old, and then the directory is
+// synced so the rename itself survives, so a crash at any point leaves one
+// or the other whole. Sessions on different workers may save the same
+// checkpoint at once, hence the unique temporary name.
+int checkpoint_save(const char *path, const struct checkpoint *ck)
+{
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    int fd = mkstemp(tmp);
+    if (fd == -1) {
+        perror("[checkpoint_save]: mkstemp");
+        return -1;
+    }
+    char line[128];
+    int len = snprintf(line, sizeof(line), "%s %d %016" PRIx64 " %" PRIu64 " %" PRIu32 " %" PRIu64 "\n",
+            CHECKPOINT_MAGIC, CHECKPOINT_VERSION, ck->key, ck->total, ck->chunk_size, ck->offset);
+    if (write(fd, line, len) != len || fdatasync(fd) == -1) {
+        perror("[checkpoint_save]: write");
+        close(fd);
+        unlink(tmp);
+        return -1;
+    }
+    if (close(fd) == -1 || rename(tmp, path) == -1) {
+        perror("[checkpoint_save]: rename");
+        unlink(tmp);
+        return -1;
+    }
+    return sync_dir(path);
+}
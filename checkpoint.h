@@ -0,0 +1,27 @@
+#include <inttypes.h>
+
+#pragma once
+
+// A resumable transfer's checkpoint is a file next to its output, named
+// after it with this appended
+#define CHECKPOINT_SUFFIX ".ckpt"
+#define CHECKPOINT_MAGIC "gbn-checkpoint"
+#define CHECKPOINT_VERSION 1
+
+// Bytes of new in-order data between checkpoints. Each one syncs the output
+// to disk, and at most this much has to be sent again after a crash.
+#define CHECKPOINT_BYTES (8 * 1024 * 1024)
+
+
+// How much of a transfer is safely in its output file: the bytes before
+// 'offset' are on disk. The transfer is the one the sender's resume request
+// names (struct resume_t).
+struct checkpoint {
+    uint64_t key;
+    uint64_t total;
+    uint32_t chunk_size;
+    uint64_t offset;
+};
+
+int checkpoint_load(const char *path, struct checkpoint *ck);
+int checkpoint_save(const char *path, const struct checkpoint *ck);
@@ -0,0 +1,199 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include "event.h"
+#include "timer.h"
+
+#define MAX_EVENTS 16
+
+
+// Creates the epoll instance and the timerfd backing all timers
+int event_init(struct event_loop *loop)
+{
+    if (loop == NULL) {
+        fprintf(stderr, "[event_init]: loop was NULL\n");
+        return -1;
+    }
+    memset(loop, 0, sizeof(*loop));
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd == -1) {
+        perror("[event_init]: epoll_create1");
+        return -1;
+    }
+    loop->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (loop->timerfd == -1) {
+        perror("[event_init]: timerfd_create");
+        close(loop->epfd);
+        return -1;
+    }
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->timerfd, &ev) == -1) {
+        perror("[event_init]: epoll_ctl");
+        close(loop->timerfd);
+        close(loop->epfd);
+        return -1;
+    }
+    return 0;
+}
+
+// Watches fd for 'events' (EPOLLIN, EPOLLOUT, ...), calling cb when ready
+int event_add(struct event_loop *loop, int fd, uint32_t events, event_cb cb, void *ctx)
+{
+    if (loop->nhandlers == MAX_HANDLERS) {
+        fprintf(stderr, "[event_add]: too many handlers\n");
+        return -1;
+    }
+    struct event_handler *h = &loop->handlers[loop->nhandlers];
+    h->fd = fd;
+    h->cb = cb;
+    h->ctx = ctx;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = h;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("[event_add]: epoll_ctl");
+        return -1;
+    }
+    loop->nhandlers++;
+    return 0;
+}
+
+// Changes the set of events watched on a registered fd
+int event_mod(struct event_loop *loop, int fd, uint32_t events)
+{
+    for (int i = 0; i < loop->nhandlers; ++i) {
+        if (loop->handlers[i].fd == fd) {
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = events;
+            ev.data.ptr = &loop->handlers[i];
+            if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, fd, &ev) == -1) {
+                perror("[event_mod]: epoll_ctl");
+                return -1;
+            }
+            return 0;
+        }
+    }
+    fprintf(stderr, "[event_mod]: fd %d not registered\n", fd);
+    return -1;
+}
+
+// Registers a timer with the loop. It starts disarmed.
+int event_add_timer(struct event_loop *loop, struct event_timer *timer, timer_cb cb, void *ctx)
+{
+    if (loop->ntimers == MAX_TIMERS) {
+        fprintf(stderr, "[event_add_timer]: too many timers\n");
+        return -1;
+    }
+    timer->deadline = 0;
+    timer->armed = false;
+    timer->cb = cb;
+    timer->ctx = ctx;
+    loop->timers[loop->ntimers++] = timer;
+    return 0;
+}
+
+// Points the timerfd at the earliest armed deadline. Skips the syscall when
+// that deadline has not changed.
+static int rearm_timerfd(struct event_loop *loop)
+{
+    uint64_t earliest = 0;
+    for (int i = 0; i < loop->ntimers; ++i) {
+        struct event_timer *t = loop->timers[i];
+        if (t->armed && (earliest == 0 || t->deadline < earliest)) {
+            earliest = t->deadline;
+        }
+    }
+    if (earliest == loop->timerfd_deadline) {
+        return 0;
+    }
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (earliest != 0) {
+        its.it_value.tv_sec = earliest / 1000000ULL;
+        its.it_value.tv_nsec = (earliest % 1000000ULL) * 1000;
+    }
+    if (timerfd_settime(loop->timerfd, TFD_TIMER_ABSTIME, &its, NULL) == -1) {
+        perror("[event_arm]: timerfd_settime");
+        return -1;
+    }
+    loop->timerfd_deadline = earliest;
+    return 0;
+}
+
+// Arms (or re-arms) a timer to fire at the absolute time 'deadline'
+int event_arm(struct event_loop *loop, struct event_timer *timer, uint64_t deadline)
+{
+    timer->deadline = (deadline == 0) ? 1 : deadline;
+    timer->armed = true;
+    return rearm_timerfd(loop);
+}
+
+int event_disarm(struct event_loop *loop, struct event_timer *timer)
+{
+    timer->armed = false;
+    return rearm_timerfd(loop);
+}
+
+// Runs expired timers. A callback may re-arm its own or any other timer.
+static void fire_timers(struct event_loop *loop)
+{
+    uint64_t expirations;
+    while (read(loop->timerfd, &expirations, sizeof(expirations)) > 0) {
+        ;
+    }
+    loop->timerfd_deadline = 0;
+    uint64_t now = now_usec();
+    for (int i = 0; i < loop->ntimers && loop->running; ++i) {
+        struct event_timer *t = loop->timers[i];
+        if (t->armed && t->deadline <= now) {
+            t->armed = false;
+            t->cb(loop, t->ctx);
+        }
+    }
+    rearm_timerfd(loop);
+}
+
+// Dispatches events until event_stop() is called. Returns -1 if epoll fails.
+int event_run(struct event_loop *loop)
+{
+    struct epoll_event events[MAX_EVENTS];
+    loop->running = true;
+    while (loop->running) {
+        int n = epoll_wait(loop->epfd, events, MAX_EVENTS, -1);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("[event_run]: epoll_wait");
+            return -1;
+        }
+        for (int i = 0; i < n && loop->running; ++i) {
+            struct event_handler *h = events[i].data.ptr;
+            if (h == NULL) {
+                fire_timers(loop);
+            } else {
+                h->cb(loop, h->ctx, events[i].events);
+            }
+        }
+    }
+    return 0;
+}
+
+void event_stop(struct event_loop *loop)
+{
+    loop->running = false;
+}
+
+void event_destroy(struct event_loop *loop)
+{
+    close(loop->timerfd);
+    close(loop->epfd);
+}
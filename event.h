@@ -0,0 +1,51 @@
+#include <inttypes.h>
+#include <stdbool.h>
+
+#pragma once
+
+#define MAX_HANDLERS 16
+#define MAX_TIMERS 16
+
+
+struct event_loop;
+
+typedef void (*event_cb)(struct event_loop *loop, void *ctx, uint32_t events);
+typedef void (*timer_cb)(struct event_loop *loop, void *ctx);
+
+// A file descriptor watched by the loop
+struct event_handler {
+    int fd;
+    event_cb cb;
+    void *ctx;
+};
+
+// One-shot deadline on the monotonic clock (microseconds, see now_usec()).
+// All timers of a loop share a single timerfd armed to the earliest one.
+struct event_timer {
+    uint64_t deadline;
+    bool armed;
+    timer_cb cb;
+    void *ctx;
+};
+
+// Single-threaded epoll loop with a timerfd for deadlines
+struct event_loop {
+    int epfd;
+    int timerfd;
+    uint64_t timerfd_deadline;
+    bool running;
+    struct event_handler handlers[MAX_HANDLERS];
+    int nhandlers;
+    struct event_timer *timers[MAX_TIMERS];
+    int ntimers;
+};
+
+int event_init(struct event_loop *loop);
+int event_add(struct event_loop *loop, int fd, uint32_t events, event_cb cb, void *ctx);
+int event_mod(struct event_loop *loop, int fd, uint32_t events);
+int event_add_timer(struct event_loop *loop, struct event_timer *timer, timer_cb cb, void *ctx);
+int event_arm(struct event_loop *loop, struct event_timer *timer, uint64_t deadline);
+int event_disarm(struct event_loop *loop, struct event_timer *timer);
+int event_run(struct event_loop *loop);
+void event_stop(struct event_loop *loop);
+void event_destroy(struct event_loop *loop);
@@ -0,0 +1,157 @@
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "fec.h"
+
+// XOR parity over groups of packets. Encoding and decoding are the same
+// operation: XOR every packet of a group into one buffer, on both ends, and
+// the receiver's buffer plus the parity is the one packet it is missing.
+
+
+// dst ^= src. Four 16-byte SSE2 vectors per iteration where available (all
+// of x86-64), then 8-byte words, then bytes.
+void fec_xor(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 64 <= len; i += 64) {
+        __m128i a0 = _mm_loadu_si128((const __m128i *) (dst + i));
+        __m128i a1 = _mm_loadu_si128((const __m128i *) (dst + i + 16));
+        __m128i a2 = _mm_loadu_si128((const __m128i *) (dst + i + 32));
+        __m128i a3 = _mm_loadu_si128((const __m128i *) (dst + i + 48));
+        __m128i b0 = _mm_loadu_si128((const __m128i *) (src + i));
+        __m128i b1 = _mm_loadu_si128((const __m128i *) (src + i + 16));
+        __m128i b2 = _mm_loadu_si128((const __m128i *) (src + i + 32));
+        __m128i b3 = _mm_loadu_si128((const __m128i *) (src + i + 48));
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_xor_si128(a0, b0));
+        _mm_storeu_si128((__m128i *) (dst + i + 16), _mm_xor_si128(a1, b1));
+        _mm_storeu_si128((__m128i *) (dst + i + 32), _mm_xor_si128(a2, b2));
+        _mm_storeu_si128((__m128i *) (dst + i + 48), _mm_xor_si128(a3, b3));
+    }
+#endif
+    for (; i + 8 <= len; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, dst + i, sizeof(a));
+        memcpy(&b, src + i, sizeof(b));
+        a ^= b;
+        memcpy(dst + i, &a, sizeof(a));
+    }
+    for (; i < len; ++i) {
+        dst[i] ^= src[i];
+    }
+}
+
+// Starts an empty group at packet 'first'
+void fec_reset(struct fec_group *g, int64_t first)
+{
+    g->first = first;
+    g->count = 0;
+    g->have = 0;
+    g->nhave = 0;
+    g->maxlen = 0;
+    g->lenx = 0;
+    g->typex = 0;
+    g->parity = false;
+}
+
+// XORs len bytes into the payload, zeroing what lies beyond maxlen first
+static void xor_payload(struct fec_group *g, const uint8_t *src, int len)
+{
+    if (len > g->maxlen) {
+        memset(g->data + FEC_HDRSIZE + g->maxlen, 0, len - g->maxlen);
+        g->maxlen = len;
+    }
+    fec_xor(g->data + FEC_HDRSIZE, src, len);
+}
+
+// Adds packet seq to the group. Returns false if it is already in or
+// doesn't belong to it.
+bool fec_add(struct fec_group *g, int64_t seq, int type, const char *data, int len)
+{
+    int64_t i = seq - g->first;
+    if (i < 0 || i >= FEC_MAX_GROUP || (g->have & ((uint64_t) 1 << i))) {
+        return false;
+    }
+    g->have |= (uint64_t) 1 << i;
+    g->nhave++;
+    g->lenx ^= len;
+    g->typex ^= type;
+    xor_payload(g, (const uint8_t *) data, len);
+    return true;
+}
+
+// Sender: finishes the parity of the packets added so far, for groups of
+// k. The parity packet's payload is then the first (returned) bytes of
+// g->data.
+int fec_encode(struct fec_group *g, int k)
+{
+    g->count = g->nhave;
+    g->data[0] = k >> 8;
+    g->data[1] = k;
+    g->data[2] = g->count >> 8;
+    g->data[3] = g->count;
+    g->data[4] = g->lenx >> 8;
+    g->data[5] = g->lenx;
+    g->data[6] = g->typex;
+    g->data[7] = 0;
+    return FEC_HDRSIZE + g->maxlen;
+}
+
+// Reads the group size and packet count of a parity packet. Returns -1 if
+// it is malformed.
+int fec_parse(const char *payload, int len, int *k, int *count)
+{
+    const uint8_t *p = (const uint8_t *) payload;
+    if (len < FEC_HDRSIZE) {
+        return -1;
+    }
+    *k = (p[0] << 8) | p[1];
+    *count = (p[2] << 8) | p[3];
+    if (*k < 1 || *k > FEC_MAX_GROUP || *count < 1 || *count > *k) {
+        return -1;
+    }
+    return 0;
+}
+
+// Receiver: adds the group's parity packet. Returns false if it already
+// has one.
+bool fec_add_parity(struct fec_group *g, const char *payload, int len)
+{
+    const uint8_t *p = (const uint8_t *) payload;
+    if (g->parity) {
+        return false;
+    }
+    g->parity = true;
+    g->count = (p[2] << 8) | p[3];
+    g->lenx ^= (p[4] << 8) | p[5];
+    g->typex ^= p[6];
+    xor_payload(g, p + FEC_HDRSIZE, len - FEC_HDRSIZE);
+    return true;
+}
+
+// Receiver: rebuilds the group's missing packet into pkt once the parity
+// and all other packets are in, and adds it. Returns false if that isn't
+// the case yet (or any more), or the result makes no sense.
+bool fec_recover(struct fec_group *g, struct packet_t *pkt)
+{
+    if (!g->parity || g->nhave != g->count - 1) {
+        return false;
+    }
+    int i = 0;
+    while (g->have & ((uint64_t) 1 << i)) {
+        i++;
+    }
+    if (i >= g->count || g->lenx > g->maxlen || (g->typex != 1 && g->typex != 16)) {
+        return false;
+    }
+    pkt->type = g->typex;
+    pkt->flags = 0;
+    pkt->seq_no = g->first + i;
+    pkt->len = g->lenx;
+    memcpy(pkt->data, g->data + FEC_HDRSIZE, pkt->len);
+    g->have |= (uint64_t) 1 << i;
+    g->nhave++;
+    return true;
+}
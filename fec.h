@@ -0,0 +1,48 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include "packet.h"
+
+#pragma once
+
+// Parity packets have type FEC_TYPE and the seq_no of the first packet of
+// their group, but take no sequence number of their own and are never
+// ACKed. Groups are the packets [n * k, (n + 1) * k) for the sender's group
+// size k. The payload starts with an FEC_HDRSIZE header in network order:
+//   bytes 0-1  group size k
+//   bytes 2-3  packets in this group (fewer than k only for the last one)
+//   bytes 4-5  XOR of the packets' payload lengths
+//   byte 6     XOR of their types
+//   byte 7     zero
+// followed by the XOR of their payloads, each padded with zeros to the
+// longest. Payloads are the data as delivered, before compression.
+#define FEC_TYPE 32
+#define FEC_HDRSIZE 8
+
+// A group has to fit in the receiver's reorder window
+#define FEC_MAX_GROUP SACK_BITS
+
+
+// Running XOR of one group of packets: at the sender the parity being
+// built, at the receiver that of the packets received so far plus, once it
+// arrives, the parity packet's. Bit i of 'have' says packet first + i is
+// in. Only the first maxlen payload bytes are valid.
+struct fec_group {
+    int64_t first;
+    int count;
+    uint64_t have;
+    int nhave;
+    int maxlen;
+    int lenx;
+    int typex;
+    bool parity;
+    uint8_t data[FEC_HDRSIZE + MAXBUFSIZE];
+};
+
+void fec_xor(uint8_t *dst, const uint8_t *src, size_t len);
+void fec_reset(struct fec_group *g, int64_t first);
+bool fec_add(struct fec_group *g, int64_t seq, int type, const char *data, int len);
+int fec_encode(struct fec_group *g, int k);
+int fec_parse(const char *payload, int len, int *k, int *count);
+bool fec_add_parity(struct fec_group *g, const char *payload, int len);
+bool fec_recover(struct fec_group *g, struct packet_t *pkt);
@@ -0,0 +1,290 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "impair.h"
+
+
+void impair_defaults(struct impair_config *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->ge_loss = 1.0;
+    cfg->limit = IMPAIR_LIMIT;
+    cfg->seed = IMPAIR_SEED;
+}
+
+static int parse_prob(const char *key, const char *val, double *out)
+{
+    char *end;
+    *out = strtod(val, &end);
+    if (end == val || *out < 0.0 || *out > 1.0) {
+        fprintf(stderr, "[impair_parse]: %s must be between 0 and 1\n", key);
+        return -1;
+    }
+    return 0;
+}
+
+static int parse_msec(const char *key, const char *val, uint64_t *out)
+{
+    char *end;
+    double ms = strtod(val, &end);
+    if (end == val || ms < 0.0) {
+        fprintf(stderr, "[impair_parse]: %s must be a non-negative number of milliseconds\n", key);
+        return -1;
+    }
+    *out = (uint64_t) (ms * 1000.0);
+    return 0;
+}
+
+// Parses a comma-separated list of key=value settings:
+//   loss=P           uniform loss probability
+//   ge=P:R[:L]       Gilbert-Elliott burst loss (L, the loss while bad, defaults to 1)
+//   delay=MS         fixed one-way delay
+//   jitter=MS        uniform extra delay in [0, MS)
+//   reorder=P        packets that skip the delay, overtaking the ones held
+//   dup=P            duplication probability
+//   rate=MBIT        bandwidth cap in Mbit/s
+//   limit=N          most datagrams held at once (default IMPAIR_LIMIT)
+//   seed=N           RNG seed (default IMPAIR_SEED)
+int impair_parse(const char *spec, struct impair_config *cfg)
+{
+    char *copy = strdup(spec);
+    if (copy == NULL) {
+        fprintf(stderr, "[impair_parse]: out of memory\n");
+        return -1;
+    }
+    int ret = 0;
+    char *save;
+    for (char *tok = strtok_r(copy, ",", &save); tok != NULL && ret == 0; tok = strtok_r(NULL, ",", &save)) {
+        char *val = strchr(tok, '=');
+        if (val == NULL) {
+            fprintf(stderr, "[impair_parse]: expected key=value, got '%s'\n", tok);
+            ret = -1;
+            break;
+        }
+        *val++ = '\0';
+        if (strcmp(tok, "loss") == 0) {
+            ret = parse_prob(tok, val, &cfg->loss);
+        } else if (strcmp(tok, "ge") == 0) {
+            int n = sscanf(val, "%lf:%lf:%lf", &cfg->ge_p, &cfg->ge_r, &cfg->ge_loss);
+            if (n < 2 || cfg->ge_p < 0.0 || cfg->ge_p > 1.0 || cfg->ge_r < 0.0 || cfg->ge_r > 1.0
+                    || cfg->ge_loss < 0.0 || cfg->ge_loss > 1.0) {
+                fprintf(stderr, "[impair_parse]: ge takes P:R[:L], each between 0 and 1\n");
+                ret = -1;
+            }
+        } else if (strcmp(tok, "delay") == 0) {
+            ret = parse_msec(tok, val, &cfg->delay_usec);
+        } else if (strcmp(tok, "jitter") == 0) {
+            ret = parse_msec(tok, val, &cfg->jitter_usec);
+        } else if (strcmp(tok, "reorder") == 0) {
+            ret = parse_prob(tok, val, &cfg->reorder);
+        } else if (strcmp(tok, "dup") == 0) {
+            ret = parse_prob(tok, val, &cfg->dup);
+        } else if (strcmp(tok, "rate") == 0) {
+            cfg->rate_mbit = strtod(val, NULL);
+            if (cfg->rate_mbit <= 0.0) {
+                fprintf(stderr, "[impair_parse]: rate must be a positive number of Mbit/s\n");
+                ret = -1;
+            }
+        } else if (strcmp(tok, "limit") == 0) {
+            cfg->limit = (int) strtol(val, NULL, 10);
+            if (cfg->limit < 1) {
+                fprintf(stderr, "[impair_parse]: limit must be at least 1\n");
+                ret = -1;
+            }
+        } else if (strcmp(tok, "seed") == 0) {
+            cfg->seed = strtoull(val, NULL, 10);
+        } else {
+            fprintf(stderr, "[impair_parse]: unknown setting '%s'\n", tok);
+            ret = -1;
+        }
+    }
+    free(copy);
+    return ret;
+}
+
+// splitmix64: small, fast and good enough to drive the emulator, with
+// independent streams for each socket from one seed
+static uint64_t next_rand(struct impair *im)
+{
+    uint64_t z = (im->rng += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static double uniform(struct impair *im)
+{
+    return (next_rand(im) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Sets up the emulator for items of item_size bytes. 'stream' picks an
+// independent RNG sequence (e.g. the worker or stripe number) for the same
+// seed. With nothing configured the emulator is inactive and costs nothing.
+int impair_init(struct impair *im, const struct impair_config *cfg, size_t item_size, uint64_t stream)
+{
+    memset(im, 0, sizeof(*im));
+    im->cfg = *cfg;
+    im->item_size = item_size;
+    im->rng = cfg->seed ^ (stream * 0xd1b54a32d192ed03ULL);
+    bool queued = cfg->delay_usec > 0 || cfg->jitter_usec > 0 || cfg->rate_mbit > 0.0 || cfg->dup > 0.0;
+    im->active = queued || cfg->loss > 0.0 || cfg->ge_p > 0.0;
+    if (!queued) {
+        return 0;
+    }
+    im->items = malloc((size_t) cfg->limit * item_size);
+    im->heap = malloc(cfg->limit * sizeof(struct impair_entry));
+    im->free_slots = malloc(cfg->limit * sizeof(int));
+    if (im->items == NULL || im->heap == NULL || im->free_slots == NULL) {
+        fprintf(stderr, "[impair_init]: couldn't allocate queue\n");
+        impair_destroy(im);
+        return -1;
+    }
+    for (int i = 0; i < cfg->limit; ++i) {
+        im->free_slots[i] = cfg->limit - 1 - i;
+    }
+    im->nfree = cfg->limit;
+    return 0;
+}
+
+void impair_destroy(struct impair *im)
+{
+    free(im->items);
+    free(im->heap);
+    free(im->free_slots);
+    im->items = NULL;
+    im->heap = NULL;
+    im->free_slots = NULL;
+}
+
+static bool entry_before(struct impair_entry *a, struct impair_entry *b)
+{
+    return a->due < b->due || (a->due == b->due && a->seq < b->seq);
+}
+
+static void heap_push(struct impair *im, struct impair_entry e)
+{
+    int i = im->nheld++;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!entry_before(&e, &im->heap[parent])) {
+            break;
+        }
+        im->heap[i] = im->heap[parent];
+        i = parent;
+    }
+    im->heap[i] = e;
+}
+
+static struct impair_entry heap_pop(struct impair *im)
+{
+    struct impair_entry top = im->heap[0];
+    struct impair_entry last = im->heap[--im->nheld];
+    int i = 0;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= im->nheld) {
+            break;
+        }
+        if (child + 1 < im->nheld && entry_before(&im->heap[child + 1], &im->heap[child])) {
+            child++;
+        }
+        if (!entry_before(&im->heap[child], &last)) {
+            break;
+        }
+        im->heap[i] = im->heap[child];
+        i = child;
+    }
+    if (im->nheld > 0) {
+        im->heap[i] = last;
+    }
+    return top;
+}
+
+static bool lost(struct impair *im)
+{
+    if (im->cfg.ge_p > 0.0) {
+        if (im->bad) {
+            im->bad = uniform(im) >= im->cfg.ge_r;
+        } else {
+            im->bad = uniform(im) < im->cfg.ge_p;
+        }
+        return uniform(im) < (im->bad ? im->cfg.ge_loss : im->cfg.loss);
+    }
+    return im->cfg.loss > 0.0 && uniform(im) < im->cfg.loss;
+}
+
+// Works out when a copy of the datagram reaches the far end and holds it
+// until then. Returns false when it should be delivered right away instead;
+// a duplicate is always held so it follows the original. A full queue drops.
+static bool hold(struct impair *im, const void *item, size_t wire_len, uint64_t now, bool dup)
+{
+    if (im->items == NULL) {
+        return false;
+    }
+
+    // The bandwidth cap serializes datagrams onto the link one after
+    // another; reordered ones skip the delay and overtake those held
+    uint64_t due = now;
+    if (im->cfg.rate_mbit > 0.0) {
+        if (im->link_free < now) {
+            im->link_free = now;
+        }
+        im->link_free += (uint64_t) (wire_len * 8 / im->cfg.rate_mbit);
+        due = im->link_free;
+    }
+    if (im->cfg.reorder == 0.0 || uniform(im) >= im->cfg.reorder) {
+        due += im->cfg.delay_usec;
+        if (im->cfg.jitter_usec > 0) {
+            due += next_rand(im) % im->cfg.jitter_usec;
+        }
+    }
+    if (due <= now && !dup) {
+        return false;
+    }
+    if (im->nfree == 0) {
+        im->overflowed++;
+        return true;
+    }
+    int slot = im->free_slots[--im->nfree];
+    memcpy(im->items + (size_t) slot * im->item_size, item, im->item_size);
+    struct impair_entry e = {due, im->seq++, slot};
+    heap_push(im, e);
+    return true;
+}
+
+// Runs one arriving datagram of wire_len bytes through the emulated link.
+// Returns true when the caller should deliver it now; otherwise it was lost
+// or is held for impair_pop. A duplicate, if any, is always held.
+bool impair_admit(struct impair *im, const void *item, size_t wire_len, uint64_t now)
+{
+    if (!im->active) {
+        return true;
+    }
+    if (lost(im)) {
+        im->dropped++;
+        return false;
+    }
+    if (im->cfg.dup > 0.0 && uniform(im) < im->cfg.dup) {
+        im->duplicated++;
+        hold(im, item, wire_len, now, true);
+    }
+    return !hold(im, item, wire_len, now, false);
+}
+
+// Release time of the next held datagram, or 0 when none is held
+uint64_t impair_next_due(struct impair *im)
+{
+    return im->nheld > 0 ? im->heap[0].due : 0;
+}
+
+// Copies out the next held datagram if it is due by now
+bool impair_pop(struct impair *im, void *item, uint64_t now)
+{
+    if (im->nheld == 0 || im->heap[0].due > now) {
+        return false;
+    }
+    struct impair_entry e = heap_pop(im);
+    memcpy(item, im->items + (size_t) e.slot * im->item_size, im->item_size);
+    im->free_slots[im->nfree++] = e.slot;
+    return true;
+}
@@ -0,0 +1,65 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+#pragma once
+
+#define IMPAIR_LIMIT 1000
+#define IMPAIR_SEED 12345
+
+
+// What the emulated link does to arriving datagrams. Loss is uniform unless
+// ge_p is set, in which case it follows a Gilbert-Elliott model: the link
+// turns bad with probability ge_p and good again with ge_r per packet,
+// losing 'loss' of packets while good and ge_loss while bad.
+struct impair_config {
+    double loss;
+    double ge_p;
+    double ge_r;
+    double ge_loss;
+    uint64_t delay_usec;
+    uint64_t jitter_usec;
+    double reorder;
+    double dup;
+    double rate_mbit;
+    int limit;
+    uint64_t seed;
+};
+
+// One held datagram, ordered by release time (then arrival order)
+struct impair_entry {
+    uint64_t due;
+    uint64_t seq;
+    int slot;
+};
+
+// The emulator for one direction of one socket. Datagrams that are delayed
+// are copied into a fixed set of slots and kept in a min-heap on release
+// time; a full queue drops, like a router's.
+struct impair {
+    struct impair_config cfg;
+    bool active;
+    uint64_t rng;
+    bool bad;
+    uint64_t link_free;
+    uint64_t seq;
+
+    size_t item_size;
+    uint8_t *items;
+    struct impair_entry *heap;
+    int nheld;
+    int *free_slots;
+    int nfree;
+
+    unsigned long dropped;
+    unsigned long duplicated;
+    unsigned long overflowed;
+};
+
+void impair_defaults(struct impair_config *cfg);
+int impair_parse(const char *spec, struct impair_config *cfg);
+int impair_init(struct impair *im, const struct impair_config *cfg, size_t item_size, uint64_t stream);
+void impair_destroy(struct impair *im);
+bool impair_admit(struct impair *im, const void *item, size_t wire_len, uint64_t now);
+uint64_t impair_next_due(struct impair *im);
+bool impair_pop(struct impair *im, void *item, uint64_t now);
@@ -0,0 +1,195 @@
+#include <stdint.h>
+#include <string.h>
+#include "lz.h"
+
+// A small LZ4 block-format codec: greedy matching on a hash of the next four
+// bytes, no entropy coding. Output decodes with any LZ4 block decoder.
+//
+// A block is a series of sequences, each a token (literal count in the high
+// nibble, match length - 4 in the low one), extra length bytes for counts of
+// 15 and more (255 until the last), the literals, and a 2-byte little-endian
+// match offset. The last sequence is literals only.
+
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t hash4(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Writes the part of a length that didn't fit in its token nibble
+static uint8_t *put_length(uint8_t *op, size_t n)
+{
+    while (n >= 255) {
+        *op++ = 255;
+        n -= 255;
+    }
+    *op++ = (uint8_t) n;
+    return op;
+}
+
+// Emits one sequence; mlen is 0 for the final, literals-only one. Returns
+// the new output position, or NULL if it doesn't fit before oend.
+static uint8_t *put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit, size_t litlen,
+        size_t offset, size_t mlen)
+{
+    // Token, literal length bytes, literals, offset and match length bytes
+    size_t worst = 1 + litlen / 255 + 1 + litlen + 2 + mlen / 255 + 1;
+    if (worst > (size_t) (oend - op)) {
+        return NULL;
+    }
+    uint8_t *token = op++;
+    *token = (uint8_t) ((litlen < 15 ? litlen : 15) << 4);
+    if (litlen >= 15) {
+        op = put_length(op, litlen - 15);
+    }
+    memcpy(op, lit, litlen);
+    op += litlen;
+    if (mlen == 0) {
+        return op;
+    }
+    *op++ = (uint8_t) offset;
+    *op++ = (uint8_t) (offset >> 8);
+    mlen -= LZ_MIN_MATCH;
+    *token |= (uint8_t) (mlen < 15 ? mlen : 15);
+    if (mlen >= 15) {
+        op = put_length(op, mlen - 15);
+    }
+    return op;
+}
+
+// Compresses len bytes (at most LZ_MAX_BLOCK) of src into dst. Returns the
+// compressed size, or 0 if it would take more than cap bytes; callers pass
+// a cap below len to only keep blocks that shrink. Incompressible input is
+// skipped over in growing steps, so it costs little.
+int lz_compress(const char *src, int len, char *dst, int cap)
+{
+    if (len < 0 || len > LZ_MAX_BLOCK) {
+        return 0;
+    }
+    const uint8_t *in = (const uint8_t *) src;
+    const uint8_t *ip = in;
+    const uint8_t *anchor = in;
+    const uint8_t *end = in + len;
+    uint8_t *op = (uint8_t *) dst;
+    uint8_t *oend = op + cap;
+    uint16_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    if (len > LZ_MFLIMIT) {
+        const uint8_t *mflimit = end - LZ_MFLIMIT;
+        const uint8_t *matchlimit = end - LZ_LAST_LITERALS;
+        unsigned misses = 0;
+        ip++;
+        while (ip < mflimit) {
+            uint32_t seq = read32(ip);
+            uint32_t h = hash4(seq);
+            const uint8_t *ref = in + table[h];
+            table[h] = (uint16_t) (ip - in);
+            if (ref >= ip || read32(ref) != seq) {
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+
+            // Grow the match backwards into the pending literals, then
+            // forwards as far as the bytes agree
+            while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t *m = ip + LZ_MIN_MATCH;
+            const uint8_t *r = ref + LZ_MIN_MATCH;
+            while (m < matchlimit && *m == *r) {
+                m++;
+                r++;
+            }
+            op = put_sequence(op, oend, anchor, (size_t) (ip - anchor), (size_t) (ip - ref), (size_t) (m - ip));
+            if (op == NULL) {
+                return 0;
+            }
+            ip = m;
+            anchor = ip;
+        }
+    }
+    op = put_sequence(op, oend, anchor, (size_t) (end - anchor), 0, 0);
+    if (op == NULL) {
+        return 0;
+    }
+    return (int) (op - (uint8_t *) dst);
+}
+
+// Reads the part of a length that didn't fit in its token nibble. Returns
+// -1 if the input ends first.
+static int get_length(const uint8_t **ip, const uint8_t *iend, size_t *n)
+{
+    uint8_t b;
+    do {
+        if (*ip >= iend) {
+            return -1;
+        }
+        b = *(*ip)++;
+        *n += b;
+    } while (b == 255);
+    return 0;
+}
+
+// Decompresses a block of len bytes into dst, which has room for cap bytes.
+// Returns the decompressed size, or -1 if the block is malformed or doesn't
+// fit; nothing is read or written out of bounds either way.
+int lz_decompress(const char *src, int len, char *dst, int cap)
+{
+    const uint8_t *ip = (const uint8_t *) src;
+    const uint8_t *iend = ip + len;
+    uint8_t *ostart = (uint8_t *) dst;
+    uint8_t *op = ostart;
+    uint8_t *oend = op + cap;
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t lit = token >> 4;
+        if (lit == 15 && get_length(&ip, iend, &lit) == -1) {
+            return -1;
+        }
+        if (lit > (size_t) (iend - ip) || lit > (size_t) (oend - op)) {
+            return -1;
+        }
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) {
+            break;
+        }
+
+        if (iend - ip < 2) {
+            return -1;
+        }
+        size_t offset = ip[0] | (size_t) ip[1] << 8;
+        ip += 2;
+        size_t mlen = token & 15;
+        if (mlen == 15 && get_length(&ip, iend, &mlen) == -1) {
+            return -1;
+        }
+        mlen += LZ_MIN_MATCH;
+        if (offset == 0 || offset > (size_t) (op - ostart) || mlen > (size_t) (oend - op)) {
+            return -1;
+        }
+
+        // Matches may overlap their own output (runs); copy those bytewise
+        const uint8_t *ref = op - offset;
+        if (offset >= mlen) {
+            memcpy(op, ref, mlen);
+        } else {
+            for (size_t i = 0; i < mlen; ++i) {
+                op[i] = ref[i];
+            }
+        }
+        op += mlen;
+    }
+    return (int) (op - ostart);
+}
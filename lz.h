@@ -0,0 +1,18 @@
+#include <stddef.h>
+
+#pragma once
+
+#define LZ_HASH_BITS 12
+#define LZ_MIN_MATCH 4
+
+// A match may not start in the last LZ_MFLIMIT bytes, and the last
+// LZ_LAST_LITERALS bytes are always literals (LZ4 block format rules)
+#define LZ_MFLIMIT 12
+#define LZ_LAST_LITERALS 5
+
+// The largest block lz_compress takes; match offsets are 16 bits
+#define LZ_MAX_BLOCK 65535
+
+
+int lz_compress(const char *src, int len, char *dst, int cap);
+int lz_decompress(const char *src, int len, char *dst, int cap);
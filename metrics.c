@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include "metrics.h"
+#include "timer.h"
+
+
+static int hist_index(uint64_t value)
+{
+    if (value < 2 * HIST_SUB) {
+        return (int) value;
+    }
+    int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int) ((value >> shift) - HIST_SUB);
+}
+
+// Midpoint of the values that land in bucket i
+static uint64_t hist_value(int i)
+{
+    if (i < 2 * HIST_SUB) {
+        return i;
+    }
+    int shift = i / HIST_SUB - 1;
+    uint64_t low = (uint64_t) (HIST_SUB + i % HIST_SUB) << shift;
+    return low + (((uint64_t) 1 << shift) >> 1);
+}
+
+void hist_record(struct histogram *h, uint64_t value)
+{
+    atomic_fetch_add_explicit(&h->counts[hist_index(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->total, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, value, memory_order_relaxed);
+    unsigned long seen = atomic_load_explicit(&h->min, memory_order_relaxed);
+    while (value < seen && !atomic_compare_exchange_weak_explicit(&h->min, &seen, value,
+            memory_order_relaxed, memory_order_relaxed)) {
+        ;
+    }
+    seen = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (value > seen && !atomic_compare_exchange_weak_explicit(&h->max, &seen, value,
+            memory_order_relaxed, memory_order_relaxed)) {
+        ;
+    }
+}
+
+// Value below which pct percent of the recorded values fall, to within the
+// bucket resolution; 0 for an empty histogram
+uint64_t hist_percentile(struct histogram *h, double pct)
+{
+    unsigned long total = atomic_load_explicit(&h->total, memory_order_relaxed);
+    if (total == 0) {
+        return 0;
+    }
+    unsigned long rank = (unsigned long) (pct / 100.0 * total + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    unsigned long seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        seen += atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+        if (seen >= rank) {
+            uint64_t value = hist_value(i);
+            uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+            return value < max ? value : max;
+        }
+    }
+    return atomic_load_explicit(&h->max, memory_order_relaxed);
+}
+
+static void hist_init(struct histogram *h)
+{
+    for (int i = 0; i < HIST_BUCKETS; ++i) {
+        atomic_init(&h->counts[i], 0);
+    }
+    atomic_init(&h->total, 0);
+    atomic_init(&h->sum, 0);
+    atomic_init(&h->min, ULONG_MAX);
+    atomic_init(&h->max, 0);
+}
+
+void metrics_init(struct metrics *m, const char *role)
+{
+    memset(m, 0, sizeof(*m));
+    m->role = role;
+    m->start = now_usec();
+    atomic_init(&m->packets_sent, 0);
+    atomic_init(&m->wire_bytes_sent, 0);
+    atomic_init(&m->packets_retransmitted, 0);
+    atomic_init(&m->parity_sent, 0);
+    atomic_init(&m->timeouts, 0);
+    atomic_init(&m->fast_retransmits, 0);
+    atomic_init(&m->acks_received, 0);
+    atomic_init(&m->packets_received, 0);
+    atomic_init(&m->duplicates, 0);
+    atomic_init(&m->malformed, 0);
+    atomic_init(&m->packets_recovered, 0);
+    atomic_init(&m->bytes_delivered, 0);
+    atomic_init(&m->acks_sent, 0);
+    atomic_init(&m->stop, false);
+    hist_init(&m->rtt_usec);
+    hist_init(&m->window);
+}
+
+void metrics_add(atomic_ulong *counter, unsigned long n)
+{
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+unsigned long metrics_get(atomic_ulong *counter)
+{
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static void write_hist(FILE *out, const char *name, struct histogram *h)
+{
+    unsigned long total = metrics_get(&h->total);
+    unsigned long min = metrics_get(&h->min);
+    fprintf(out, "  \"%s\": {\"count\": %lu, \"min\": %lu, \"mean\": %.1f, "
+            "\"p50\": %" PRIu64 ", \"p90\": %" PRIu64 ", \"p99\": %" PRIu64 ", \"p999\": %" PRIu64
+            ", \"max\": %lu}",
+            name, total, total > 0 ? min : 0, total > 0 ? (double) metrics_get(&h->sum) / total : 0.0,
+            hist_percentile(h, 50.0), hist_percentile(h, 90.0), hist_percentile(h, 99.0),
+            hist_percentile(h, 99.9), metrics_get(&h->max));
+}
+
+// Writes a snapshot of everything as one JSON object. Counters are read one
+// at a time while the transfer runs, so they may be off by a few packets
+// from each other.
+void metrics_write_json(struct metrics *m, FILE *out)
+{
+    fprintf(out, "{\n");
+    fprintf(out, "  \"role\": \"%s\",\n", m->role);
+    fprintf(out, "  \"elapsed_usec\": %" PRIu64 ",\n", now_usec() - m->start);
+    fprintf(out, "  \"packets_sent\": %lu,\n", metrics_get(&m->packets_sent));
+    fprintf(out, "  \"wire_bytes_sent\": %lu,\n", metrics_get(&m->wire_bytes_sent));
+    fprintf(out, "  \"packets_retransmitted\": %lu,\n", metrics_get(&m->packets_retransmitted));
+    fprintf(out, "  \"parity_sent\": %lu,\n", metrics_get(&m->parity_sent));
+    fprintf(out, "  \"timeouts\": %lu,\n", metrics_get(&m->timeouts));
+    fprintf(out, "  \"fast_retransmits\": %lu,\n", metrics_get(&m->fast_retransmits));
+    fprintf(out, "  \"acks_received\": %lu,\n", metrics_get(&m->acks_received));
+    fprintf(out, "  \"packets_received\": %lu,\n", metrics_get(&m->packets_received));
+    fprintf(out, "  \"duplicates\": %lu,\n", metrics_get(&m->duplicates));
+    fprintf(out, "  \"malformed\": %lu,\n", metrics_get(&m->malformed));
+    fprintf(out, "  \"packets_recovered\": %lu,\n", metrics_get(&m->packets_recovered));
+    fprintf(out, "  \"bytes_delivered\": %lu,\n", metrics_get(&m->bytes_delivered));
+    fprintf(out, "  \"acks_sent\": %lu,\n", metrics_get(&m->acks_sent));
+    write_hist(out, "rtt_usec", &m->rtt_usec);
+    fprintf(out, ",\n");
+    write_hist(out, "window", &m->window);
+    fprintf(out, "\n}\n");
+    fflush(out);
+}
+
+// Replaces the -M file with a fresh snapshot. Readers never see a partial
+// one, since the new file is renamed over the old.
+static void dump_file(struct metrics *m)
+{
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", m->path);
+    FILE *out = fopen(tmp, "w");
+    if (out == NULL) {
+        perror("[metrics]: fopen");
+        return;
+    }
+    metrics_write_json(m, out);
+    if (fclose(out) != 0 || rename(tmp, m->path) == -1) {
+        perror("[metrics]: write");
+    }
+}
+
+// Dumps every period_sec to the -M file, and on SIGUSR1 to the file or, if
+// there is none, to stderr
+static void *run_metrics(void *arg)
+{
+    struct metrics *m = arg;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    struct timespec period = {m->path != NULL ? m->period_sec : 3600, 0};
+    while (!atomic_load(&m->stop)) {
+        int sig = sigtimedwait(&set, NULL, &period);
+        if (atomic_load(&m->stop)) {
+            break;
+        }
+        if (sig == -1 && errno != EAGAIN) {
+            continue;
+        }
+        if (m->path != NULL) {
+            dump_file(m);
+        } else if (sig == SIGUSR1) {
+            metrics_write_json(m, stderr);
+        }
+    }
+    return NULL;
+}
+
+// Starts the dump thread. SIGUSR1 is blocked here and in every thread
+// created afterwards, so call this before starting the workers; only the
+// dump thread ever takes the signal.
+int metrics_start(struct metrics *m, const char *path, unsigned int period_sec)
+{
+    m->path = path;
+    m->period_sec = period_sec > 0 ? period_sec : METRICS_PERIOD_SEC;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    int err = pthread_sigmask(SIG_BLOCK, &set, NULL);
+    if (err == 0) {
+        err = pthread_create(&m->thread, NULL, run_metrics, m);
+    }
+    if (err != 0) {
+        fprintf(stderr, "[metrics_start]: %s\n", strerror(err));
+        return -1;
+    }
+    m->running = true;
+    return 0;
+}
+
+// Stops the dump thread and writes the final snapshot to the -M file
+void metrics_stop(struct metrics *m)
+{
+    if (!m->running) {
+        return;
+    }
+    atomic_store(&m->stop, true);
+    pthread_kill(m->thread, SIGUSR1);
+    pthread_join(m->thread, NULL);
+    m->running = false;
+    if (m->path != NULL) {
+        dump_file(m);
+    }
+}
@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#pragma once
+
+// Histograms are exact below 2 * HIST_SUB and keep HIST_SUB buckets per
+// power of two above that (about 3% relative error), up to 2^64
+#define HIST_SUB_BITS 5
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+#define METRICS_PERIOD_SEC 1
+
+
+// HDR-style log-linear histogram. Recording is lock-free, so any thread can
+// record while another one dumps.
+struct histogram {
+    atomic_ulong counts[HIST_BUCKETS];
+    atomic_ulong total;
+    atomic_ulong sum;
+    atomic_ulong min;
+    atomic_ulong max;
+};
+
+// Statistics of one process, shared by all its worker or stripe threads.
+// Counters only ever grow and are updated with relaxed atomics.
+struct metrics {
+    const char *role;
+    uint64_t start;
+
+    // Sender
+    atomic_ulong packets_sent;
+    atomic_ulong wire_bytes_sent;
+    atomic_ulong packets_retransmitted;
+    atomic_ulong parity_sent;
+    atomic_ulong timeouts;
+    atomic_ulong fast_retransmits;
+    atomic_ulong acks_received;
+    struct histogram rtt_usec;
+    struct histogram window;
+
+    // Receiver
+    atomic_ulong packets_received;
+    atomic_ulong duplicates;
+    atomic_ulong malformed;
+    atomic_ulong packets_recovered;
+    atomic_ulong bytes_delivered;
+    atomic_ulong acks_sent;
+
+    // Periodic dumps (-M) and dumps on SIGUSR1, from a thread of their own
+    const char *path;
+    unsigned int period_sec;
+    pthread_t thread;
+    bool running;
+    atomic_bool stop;
+};
+
+void hist_record(struct histogram *h, uint64_t value);
+uint64_t hist_percentile(struct histogram *h, double pct);
+void metrics_init(struct metrics *m, const char *role);
+void metrics_add(atomic_ulong *counter, unsigned long n);
+unsigned long metrics_get(atomic_ulong *counter);
+void metrics_write_json(struct metrics *m, FILE *out);
+int metrics_start(struct metrics *m, const char *path, unsigned int period_sec);
+void metrics_stop(struct metrics *m);
@@ -7,16 +7,27 @@
 #include <string.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <netinet/udp.h>
+#include <time.h>
+#include <linux/net_tstamp.h>
 #include "net.h"
 
 
 // Gets the addr and port for a given server_ip and server_port
 int get_addr_sock(struct sockaddr *addr, int *sock, char *serverip, char *server_port)
+{
+    return get_addr_socks(addr, sock, 1, serverip, server_port);
+}
+
+// Like get_addr_sock, but opens nsocks sockets. On the server side (serverip
+// NULL) every socket binds the same port with SO_REUSEPORT, so the kernel
+// spreads peers across them by address hash.
+int get_addr_socks(struct sockaddr *addr, int *socks, int nsocks, char *serverip, char *server_port)
 {
     if (addr == NULL) {
         fprintf(stderr, "[get_addr_port]: addr was NULL\n");
         return -1;
-    } else if (sock == NULL) {
+    } else if (socks == NULL) {
         fprintf(stderr, "[get_addr_port]: port was NULL\n");
         return -1;
     }
@@ -40,34 +51,94 @@ int get_addr_sock(struct sockaddr *addr, int *sock, char *serverip, char *server
     // Loop through to find socket to bind to
     struct addrinfo *p;
     for (p = server_info; p != NULL; p = p->ai_next) {
-        if ((*sock = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
-            perror("[get_addr_port]: sender: socket");
-            continue;
-        }
+        int i;
+        for (i = 0; i < nsocks; ++i) {
+            if ((socks[i] = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
+                perror("[get_addr_port]: sender: socket");
+                break;
+            }
 
-        // Bind to socket, but only if it's server that's calling
-        if (serverip == NULL) {
-            if (bind(*sock, p->ai_addr, p->ai_addrlen) == -1) {
-                close(*sock);
-                perror("[get_addr_port]: bind");
-                continue;
+            // Bind to socket, but only if it's server that's calling
+            if (serverip == NULL) {
+                int one = 1;
+                if (nsocks > 1 && setsockopt(socks[i], SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1) {
+                    perror("[get_addr_port]: SO_REUSEPORT");
+                    close(socks[i]);
+                    break;
+                }
+                if (bind(socks[i], p->ai_addr, p->ai_addrlen) == -1) {
+                    close(socks[i]);
+                    perror("[get_addr_port]: bind");
+                    break;
+                }
             }
         }
-        break;
+        if (i == nsocks) {
+            break;
+        }
+        while (--i >= 0) {
+            close(socks[i]);
+        }
     }
 
     // Did we bind to a socket?
     if (p == NULL) {
         fprintf(stderr, "[get_addr_port]: sender could not get socket\n");
+        freeaddrinfo(server_info);
         return -1;
     }
-    
+
     *addr = *(p->ai_addr);
 
     freeaddrinfo(server_info);
     return 0;
 }
 
+// Puts socket 'sock' into non-blocking mode for use with the event loop
+int set_nonblocking(int sock)
+{
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1) {
+        perror("[set_nonblocking]: fcntl");
+        return -1;
+    }
+    return 0;
+}
+
+// Whether the kernel can segment sends on this socket (UDP_SEGMENT, Linux
+// 4.18+). The route may still refuse at send time; see send_chunks_gso.
+bool gso_supported(int sock)
+{
+    int val;
+    socklen_t len = sizeof(val);
+    return getsockopt(sock, SOL_UDP, UDP_SEGMENT, &val, &len) == 0;
+}
+
+// Lets the kernel hand this socket coalesced runs of datagrams (UDP_GRO,
+// Linux 5.0+); read them with recv_packets_gro
+int enable_gro(int sock)
+{
+    int one = 1;
+    if (setsockopt(sock, SOL_UDP, UDP_GRO, &one, sizeof(one)) == -1) {
+        perror("[enable_gro]: setsockopt UDP_GRO");
+        return -1;
+    }
+    return 0;
+}
+
+// Lets sends on this socket carry a departure time (SO_TXTIME, Linux 4.19+)
+// on the monotonic clock; see send_chunks_at. Only the fq qdisc (and etf)
+// honour it: elsewhere the datagrams leave at once.
+int enable_txtime(int sock)
+{
+    struct sock_txtime cfg = {CLOCK_MONOTONIC, 0};
+    if (setsockopt(sock, SOL_SOCKET, SO_TXTIME, &cfg, sizeof(cfg)) == -1) {
+        perror("[enable_txtime]: setsockopt SO_TXTIME");
+        return -1;
+    }
+    return 0;
+}
+
 // Handy function to get the correct struct for IPV4 or IPV6 calls
 void *get_addr_struct(struct sockaddr *client_addr)
 {
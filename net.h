@@ -1,6 +1,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <inttypes.h>
+#include <stdbool.h>
 
 #pragma once
 
@@ -15,4 +16,9 @@ enum conn_type {
 
 int create_socket(char *port, int num_conn, enum conn_type ct);
 int get_addr_sock(struct sockaddr *p, int *sock, char *serverip, char *server_port);
+int get_addr_socks(struct sockaddr *addr, int *socks, int nsocks, char *serverip, char *server_port);
+int set_nonblocking(int sock);
+bool gso_supported(int sock);
+int enable_gro(int sock);
+int enable_txtime(int sock);
 void *get_addr_struct(struct sockaddr *client_addr);
@@ -0,0 +1,168 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pace.h"
+
+
+// Parses the -p argument: a rate in Mbit/s, or "auto" to follow the
+// bandwidth estimate
+int pace_parse(const char *spec, double *rate_mbit, bool *automatic)
+{
+    if (strcmp(spec, "auto") == 0) {
+        *rate_mbit = 0.0;
+        *automatic = true;
+        return 0;
+    }
+    char *end;
+    double mbit = strtod(spec, &end);
+    if (end == spec || *end != '\0' || mbit <= 0.0) {
+        fprintf(stderr, "[pace_parse]: pacing rate must be 'auto' or a positive number of Mbit/s\n");
+        return -1;
+    }
+    *rate_mbit = mbit;
+    *automatic = false;
+    return 0;
+}
+
+static void set_rate(struct pacer *p, double rate)
+{
+    p->rate = rate;
+    p->depth = rate * PACE_BURST_USEC;
+    if (p->depth < p->pkt_bytes) {
+        p->depth = p->pkt_bytes;
+    }
+    if (p->tokens > p->depth) {
+        p->tokens = p->depth;
+    }
+}
+
+// pkt_bytes is the largest packet on the wire (header included)
+void pacer_init(struct pacer *p, double rate_mbit, bool automatic, int32_t pkt_bytes)
+{
+    memset(p, 0, sizeof(*p));
+    p->pkt_bytes = pkt_bytes;
+    p->automatic = automatic;
+    set_rate(p, rate_mbit / 8.0);
+    p->tokens = p->depth;
+}
+
+// Whether sends are (or will be, once there is an estimate) paced
+bool pacer_active(const struct pacer *p)
+{
+    return p->rate > 0.0 || p->automatic;
+}
+
+static double wire_bytes(const struct chunk_t *c)
+{
+    return (double) (HEADERSIZE + c->len);
+}
+
+static void refill(struct pacer *p, uint64_t now)
+{
+    if (now > p->last) {
+        p->tokens += p->rate * (double) (now - p->last);
+        if (p->tokens > p->depth) {
+            p->tokens = p->depth;
+        }
+    }
+    p->last = now;
+}
+
+// How many of the n chunks may be sent now
+int pacer_allow(struct pacer *p, const struct chunk_t *chunks, int n, uint64_t now)
+{
+    if (p->rate == 0.0) {
+        return n;
+    }
+    int k = 0;
+    if (p->txtime) {
+        double t = p->departure > (double) now ? p->departure : (double) now;
+        while (k < n && t <= (double) (now + PACE_LEAD_USEC)) {
+            t += wire_bytes(&chunks[k++]) / p->rate;
+        }
+        return k;
+    }
+    refill(p, now);
+    double tokens = p->tokens;
+    while (k < n && tokens > 0.0) {
+        tokens -= wire_bytes(&chunks[k++]);
+    }
+    return k;
+}
+
+// Fills in the departure time of each of the n chunks, in nanoseconds on
+// the monotonic clock, for send_chunks_at
+void pacer_stamp(const struct pacer *p, const struct chunk_t *chunks, int n, uint64_t now, uint64_t *txtime)
+{
+    double t = p->departure > (double) now ? p->departure : (double) now;
+    for (int i = 0; i < n; ++i) {
+        txtime[i] = (uint64_t) (t * 1000.0);
+        t += wire_bytes(&chunks[i]) / p->rate;
+    }
+}
+
+// The first n chunks were sent
+void pacer_charge(struct pacer *p, const struct chunk_t *chunks, int n, uint64_t now)
+{
+    if (p->rate == 0.0) {
+        return;
+    }
+    double bytes = 0.0;
+    for (int i = 0; i < n; ++i) {
+        bytes += wire_bytes(&chunks[i]);
+    }
+    if (p->txtime) {
+        double t = p->departure > (double) now ? p->departure : (double) now;
+        p->departure = t + bytes / p->rate;
+    } else {
+        p->tokens -= bytes;
+    }
+}
+
+// When the next packet may go, once pacer_allow has said none can
+uint64_t pacer_next(const struct pacer *p)
+{
+    if (p->txtime) {
+        return (uint64_t) p->departure - PACE_LEAD_USEC;
+    }
+    return p->last + (uint64_t) (-p->tokens / p->rate) + 1;
+}
+
+// An ACK reported 'bytes' newly delivered. Every sample interval the
+// delivery rate over it goes into the window of samples, and the pacing rate
+// follows the highest of them.
+void pacer_on_ack(struct pacer *p, double bytes, uint64_t now, long srtt_usec)
+{
+    if (!p->automatic) {
+        return;
+    }
+    if (p->interval_start == 0) {
+        p->interval_start = now;
+        p->delivered = 0.0;
+        return;
+    }
+    p->delivered += bytes;
+    uint64_t span = now - p->interval_start;
+    if (span < PACE_SAMPLE_USEC || span < (uint64_t) srtt_usec) {
+        return;
+    }
+    p->bw[p->nsamples++ % PACE_BW_SAMPLES] = p->delivered / (double) span;
+    p->interval_start = now;
+    p->delivered = 0.0;
+
+    int n = p->nsamples < PACE_BW_SAMPLES ? p->nsamples : PACE_BW_SAMPLES;
+    double max = 0.0;
+    for (int i = 0; i < n; ++i) {
+        if (p->bw[i] > max) {
+            max = p->bw[i];
+        }
+    }
+    if (max == 0.0) {
+        return;
+    }
+    if (p->rate == 0.0) {
+        p->last = now;
+        p->tokens = 0.0;
+    }
+    set_rate(p, PACE_GAIN * max);
+}
@@ -0,0 +1,55 @@
+#include <stdbool.h>
+#include <inttypes.h>
+#include "packet.h"
+
+#pragma once
+
+// Bucket depth: how long a burst at the pacing rate may be (at least one
+// packet goes regardless)
+#define PACE_BURST_USEC 100
+
+// With SO_TXTIME, how far ahead of its departure time a packet is handed to
+// the kernel
+#define PACE_LEAD_USEC 2000
+
+// Bandwidth estimation: delivery rate samples span at least this long (and
+// at least one smoothed RTT); the estimate is the highest of the last
+// PACE_BW_SAMPLES, and the pacing rate is PACE_GAIN times it
+#define PACE_SAMPLE_USEC 1000
+#define PACE_BW_SAMPLES 10
+#define PACE_GAIN 1.25
+
+
+// Token bucket spacing out the sends of one socket. The rate is either fixed
+// or follows an estimate of the bottleneck bandwidth taken from the rate at
+// which ACKs report data delivered. Rates are in bytes per microsecond; a
+// rate of 0 (pacing off, or no estimate yet) lets everything through.
+//
+// Tokens may dip below zero by one packet, so packets larger than the bucket
+// still go. With txtime set the bucket is not used: each packet is stamped
+// with a departure time for the kernel (fq) to release it at.
+struct pacer {
+    double rate;
+    double depth;
+    double tokens;
+    uint64_t last;
+    int32_t pkt_bytes;
+
+    bool txtime;
+    double departure;
+
+    bool automatic;
+    uint64_t interval_start;
+    double delivered;
+    double bw[PACE_BW_SAMPLES];
+    int nsamples;
+};
+
+int pace_parse(const char *spec, double *rate_mbit, bool *automatic);
+void pacer_init(struct pacer *p, double rate_mbit, bool automatic, int32_t pkt_bytes);
+bool pacer_active(const struct pacer *p);
+int pacer_allow(struct pacer *p, const struct chunk_t *chunks, int n, uint64_t now);
+void pacer_stamp(const struct pacer *p, const struct chunk_t *chunks, int n, uint64_t now, uint64_t *txtime);
+void pacer_charge(struct pacer *p, const struct chunk_t *chunks, int n, uint64_t now);
+uint64_t pacer_next(const struct pacer *p);
+void pacer_on_ack(struct pacer *p, double bytes, uint64_t now, long srtt_usec);
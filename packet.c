@@ -3,23 +3,35 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/udp.h>
 #include <netdb.h>
 #include <errno.h>
 #include <stdbool.h>
 #include "packet.h"
+#include "pool.h"
+#include "uring.h"
 
 
-bool is_lost(double loss_rate)
+
+// Parses "gbn" or "sr" from the command line
+int parse_mode(const char *str, enum arq_mode *mode)
 {
-    double rv = drand48();
-    return (rv < loss_rate);
+    if (strcmp(str, "gbn") == 0) {
+        *mode = MODE_GBN;
+    } else if (strcmp(str, "sr") == 0) {
+        *mode = MODE_SR;
+    } else {
+        fprintf(stderr, "[parse_mode]: unknown mode '%s' (expected gbn or sr)\n", str);
+        return -1;
+    }
+    return 0;
 }
 
 // Prints packet information
 void print_packet(struct packet_t pkt)
 {
     printf("type   = %d\n", pkt.type);
-    printf("seq_no = %d\n", pkt.seq_no);
+    printf("seq_no = %" PRId64 "\n", pkt.seq_no);
     printf("len    = %d\n", pkt.len);
     printf("data   = ");
     for (int i = 0; i < pkt.len; ++i) {
@@ -32,17 +44,19 @@ void print_packet(struct packet_t pkt)
 void print_ack(struct ack_t ack)
 {
     printf("type   = %d\n", ack.type);
-    printf("ack_no = %d\n", ack.ack_no);
+    printf("ack_no = %" PRId64 "\n", ack.ack_no);
+    printf("sack   = %016" PRIx64 "\n", ack.sack);
 }
 
 // Create a packet with data starting at 'buf'. buf or packet cannot be NULL
-int make_packet(struct packet_t *packet, int type, int seq_no, int len, char *buf)
+int make_packet(struct packet_t *packet, int type, int64_t seq_no, int len, char *buf)
 {
     if (packet == NULL) {
         fprintf(stderr, "[make_packet]: packet was NULL\n");
         return -1;
     }
 
+    packet->flags = 0;
     if (len == 0) {
         packet->type = 4;
         packet->len = len;
@@ -62,8 +76,30 @@ int make_packet(struct packet_t *packet, int type, int seq_no, int len, char *bu
     return 0;
 }
 
+// Describe a data packet whose payload stays at 'buf'. Nothing is copied, so
+// buf must stay valid until the chunk is no longer needed for retransmission
+int make_chunk(struct chunk_t *chunk, int64_t seq_no, int len, const char *buf)
+{
+    if (chunk == NULL) {
+        fprintf(stderr, "[make_chunk]: chunk was NULL\n");
+        return -1;
+    } else if (len < 1 || len > MAXBUFSIZE) {
+        fprintf(stderr, "[make_chunk]: bad chunk length %d\n", len);
+        return -1;
+    } else if (buf == NULL) {
+        fprintf(stderr, "[make_chunk]: buf was NULL\n");
+        return -1;
+    }
+    chunk->type = 1;
+    chunk->flags = 0;
+    chunk->seq_no = seq_no;
+    chunk->len = len;
+    chunk->data = buf;
+    return 0;
+}
+
 // Makes an ACK packet
-int make_ack(struct ack_t *ack, int type, int ack_no)
+int make_ack(struct ack_t *ack, int type, int64_t ack_no)
 {
     if (ack == NULL) {
         fprintf(stderr, "[make_ack]: ack was NULL\n");
@@ -71,11 +107,76 @@ int make_ack(struct ack_t *ack, int type, int ack_no)
     }
     ack->type = type;
     ack->ack_no = ack_no;
+    ack->sack = 0;
+    return 0;
+}
+
+// Sequence numbers travel as their low 32 bits. Returns the full number
+// closest to ref with the low 32 bits of wire, which is exact as long as
+// the two are less than 2^31 packets apart; windows are far smaller.
+int64_t seq_unwrap(int64_t ref, int64_t wire)
+{
+    return ref + (int32_t) ((uint32_t) wire - (uint32_t) ref);
+}
+
+// Takes n frames from the pool for a batch. Returns -1 if the pool failed
+static int get_frames(struct frame_pool *pool, uint8_t **frames, int n)
+{
+    for (int i = 0; i < n; ++i) {
+        frames[i] = pool_get(pool);
+        if (frames[i] == NULL) {
+            for (int j = 0; j < i; ++j) {
+                pool_put(pool, frames[j]);
+            }
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void put_frames(struct frame_pool *pool, uint8_t **frames, int n)
+{
+    for (int i = n - 1; i >= 0; --i) {
+        pool_put(pool, frames[i]);
+    }
+}
+
+// ACKs on the wire (see struct ack_t). ack_no is sent as its low 32 bits,
+// so the receiver of an ACK has to seq_unwrap() it.
+static void serialize_ack(uint8_t *buf, struct ack_t *ack)
+{
+    uint8_t *ptr = buf;
+    ptr[0] = PROTO_VERSION << 4;
+    ptr[1] = ack->type;
+    ptr[2] = 0;
+    ptr[3] = 0;
+    ptr = serialize_int(ptr + 4, (int) ack->ack_no);
+    ptr = serialize_int(ptr, (int) (ack->sack >> 32));
+    ptr = serialize_int(ptr, (int) ack->sack);
+}
+
+// Fails with EPROTO, quietly, for anything but a whole ACK of our protocol
+// version; the callers skip those like any stray datagram
+static int deserialize_ack(uint8_t *buf, size_t len, struct ack_t *ack)
+{
+    if (len < ACKSIZE || buf[0] >> 4 != PROTO_VERSION) {
+        errno = EPROTO;
+        return -1;
+    }
+    uint8_t *tmp = buf + 4;
+    int ack_no, hi, lo;
+    ack->type = buf[1];
+    tmp = deserialize_int(tmp, &ack_no);
+    tmp = deserialize_int(tmp, &hi);
+    tmp = deserialize_int(tmp, &lo);
+    ack->ack_no = (uint32_t) ack_no;
+    ack->sack = ((uint64_t) (uint32_t) hi << 32) | (uint32_t) lo;
     return 0;
 }
 
+
 // Sends ACK packet
-int send_ack(struct ack_t *ack, int sock, struct sockaddr *addr)
+int send_ack(struct ack_t *ack, int sock, struct sockaddr *addr, struct frame_pool *pool)
 {
     if (ack == NULL) {
         fprintf(stderr, "[send_ack]: ack was NULL\n");
@@ -84,12 +185,15 @@ int send_ack(struct ack_t *ack, int sock, struct sockaddr *addr)
         fprintf(stderr, "[send_ack]: addr was NULL\n");
         return -1;
     }
-    int32_t buflen = 2 * sizeof(int);
-    uint8_t *buf = malloc(buflen);
-    uint8_t *ptr = buf;
-    ptr = serialize_int(ptr, ack->type);
-    ptr = serialize_int(ptr, ack->ack_no);
+    int32_t buflen = ACKSIZE;
+    uint8_t *buf = pool_get(pool);
+    if (buf == NULL) {
+        fprintf(stderr, "[send_ack]: couldn't get frame\n");
+        return -1;
+    }
+    serialize_ack(buf, ack);
     ssize_t send_len = sendto(sock, buf, buflen, 0, addr, sizeof(*addr));
+    pool_put(pool, buf);
     if (send_len == -1) {
         perror("[send_ack]: sendto");
         return -1;
@@ -98,7 +202,7 @@ int send_ack(struct ack_t *ack, int sock, struct sockaddr *addr)
 }
 
 // Send the packet by first serializing it and then sending it over the network
-int send_packet(struct packet_t *packet, int sock, struct sockaddr *addr)
+int send_packet(struct packet_t *packet, int sock, struct sockaddr *addr, struct frame_pool *pool)
 {
     if (packet == NULL) {
         fprintf(stderr, "[send_packet]: packet was NULL\n");
@@ -107,30 +211,248 @@ int send_packet(struct packet_t *packet, int sock, struct sockaddr *addr)
         fprintf(stderr, "[send_packet]: addr was NULL\n");
         return -1;
     }
-    size_t packet_len = 3 * sizeof(int) + packet->len;
-    uint8_t *buf = malloc(packet_len * sizeof(uint8_t));
-    if (serialize(buf, packet) == -1) {
-        fprintf(stderr, "[send_packet]: couldn't serialize packet\n");
-        free(buf);
+    size_t packet_len = HEADERSIZE + packet->len;
+    uint8_t *buf = pool_get(pool);
+    if (buf == NULL) {
+        fprintf(stderr, "[send_packet]: couldn't get frame\n");
         return -1;
     }
-    if (buf == NULL) {
+    if (serialize(buf, packet) == -1) {
         fprintf(stderr, "[send_packet]: couldn't serialize packet\n");
-        free(buf);
+        pool_put(pool, buf);
         return -1;
     }
     size_t addrlen = sizeof(*addr);
     ssize_t send_len = sendto(sock, buf, packet_len, 0, addr, addrlen);
+    pool_put(pool, buf);
     if (send_len == -1) {
-        free(buf);
         perror("[send_packet]: sendto");
         return -1;
     }
-    free(buf);
     return 0;
 }
 
-int recv_packet(struct packet_t *packet, int sock, struct sockaddr *addr, socklen_t *addrlen, double loss_rate)
+// Sends up to n packets with as few sendmmsg calls as possible. Returns the
+// number of packets handed to the kernel, or -1 on error.
+int send_packets(struct packet_t *pkts, int n, int sock, struct sockaddr *addr, struct frame_pool *pool)
+{
+    if (pkts == NULL) {
+        fprintf(stderr, "[send_packets]: pkts was NULL\n");
+        return -1;
+    } else if (addr == NULL) {
+        fprintf(stderr, "[send_packets]: addr was NULL\n");
+        return -1;
+    }
+    uint8_t *frames[MAXBATCH];
+    struct mmsghdr msgs[MAXBATCH];
+    struct iovec iovs[MAXBATCH];
+    int sent = 0;
+    while (sent < n) {
+        // Serialize the next burst into the frame buffer
+        int burst = (n - sent < MAXBATCH) ? n - sent : MAXBATCH;
+        if (get_frames(pool, frames, burst) == -1) {
+            fprintf(stderr, "[send_packets]: couldn't get frames\n");
+            return -1;
+        }
+        memset(msgs, 0, burst * sizeof(struct mmsghdr));
+        for (int i = 0; i < burst; ++i) {
+            uint8_t *frame = frames[i];
+            if (serialize(frame, &pkts[sent + i]) == -1) {
+                fprintf(stderr, "[send_packets]: couldn't serialize packet\n");
+                put_frames(pool, frames, burst);
+                return -1;
+            }
+            iovs[i].iov_base = frame;
+            iovs[i].iov_len = HEADERSIZE + pkts[sent + i].len;
+            msgs[i].msg_hdr.msg_name = addr;
+            msgs[i].msg_hdr.msg_namelen = sizeof(*addr);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        // sendmmsg may stop short of the whole burst, so keep pushing the rest
+        int done = 0;
+        while (done < burst) {
+            int ret = sendmmsg(sock, msgs + done, burst - done, 0);
+            if (ret == -1) {
+                perror("[send_packets]: sendmmsg");
+                put_frames(pool, frames, burst);
+                return -1;
+            }
+            done += ret;
+        }
+        put_frames(pool, frames, burst);
+        sent += burst;
+    }
+    return sent;
+}
+
+// Sends a chunk without copying its payload: only the header is serialized
+// and sendmsg gathers it together with the payload in place
+int send_chunk(struct chunk_t *chunk, int sock, struct sockaddr *addr)
+{
+    if (send_chunks(chunk, 1, sock, addr) != 1) {
+        return -1;
+    }
+    return 0;
+}
+
+// Batched zero-copy send. Each message is a two-element iovec of the
+// serialized header and the chunk payload. Returns the number of chunks
+// handed to the kernel, or -1 on error. On a non-blocking socket that fills
+// up, returns the count sent so far (possibly 0) with errno set to EAGAIN.
+int send_chunks(struct chunk_t *chunks, int n, int sock, struct sockaddr *addr)
+{
+    return send_chunks_at(chunks, n, sock, addr, NULL);
+}
+
+// Like send_chunks, but when txtime is not NULL chunk i carries txtime[i]
+// (nanoseconds on the monotonic clock) as its departure time. The socket
+// needs enable_txtime.
+int send_chunks_at(struct chunk_t *chunks, int n, int sock, struct sockaddr *addr, const uint64_t *txtime)
+{
+    if (chunks == NULL) {
+        fprintf(stderr, "[send_chunks]: chunks was NULL\n");
+        return -1;
+    } else if (addr == NULL) {
+        fprintf(stderr, "[send_chunks]: addr was NULL\n");
+        return -1;
+    }
+    uint8_t hdrs[MAXBATCH][HEADERSIZE];
+    struct mmsghdr msgs[MAXBATCH];
+    struct iovec iovs[MAXBATCH][2];
+    _Alignas(struct cmsghdr) char ctrl[MAXBATCH][CMSG_SPACE(sizeof(uint64_t))];
+    int sent = 0;
+    while (sent < n) {
+        int burst = (n - sent < MAXBATCH) ? n - sent : MAXBATCH;
+        memset(msgs, 0, burst * sizeof(struct mmsghdr));
+        for (int i = 0; i < burst; ++i) {
+            struct chunk_t *c = &chunks[sent + i];
+            serialize_header(hdrs[i], c->type, c->flags, c->seq_no, c->len);
+            iovs[i][0].iov_base = hdrs[i];
+            iovs[i][0].iov_len = HEADERSIZE;
+            iovs[i][1].iov_base = (void *) c->data;
+            iovs[i][1].iov_len = c->len;
+            msgs[i].msg_hdr.msg_name = addr;
+            msgs[i].msg_hdr.msg_namelen = sizeof(*addr);
+            msgs[i].msg_hdr.msg_iov = iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 2;
+            if (txtime != NULL) {
+                struct msghdr *msg = &msgs[i].msg_hdr;
+                msg->msg_control = ctrl[i];
+                msg->msg_controllen = sizeof(ctrl[i]);
+                struct cmsghdr *cm = CMSG_FIRSTHDR(msg);
+                cm->cmsg_level = SOL_SOCKET;
+                cm->cmsg_type = SCM_TXTIME;
+                cm->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+                memcpy(CMSG_DATA(cm), &txtime[sent + i], sizeof(uint64_t));
+            }
+        }
+
+        int done = 0;
+        while (done < burst) {
+            int ret = sendmmsg(sock, msgs + done, burst - done, 0);
+            if (ret == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return sent + done;
+                }
+                perror("[send_chunks]: sendmmsg");
+                return -1;
+            }
+            done += ret;
+        }
+        sent += burst;
+    }
+    return sent;
+}
+
+// Like send_chunks, but each run of equal-sized chunks goes out as one
+// UDP_SEGMENT (GSO) message that the kernel splits into datagrams, so one
+// sendmmsg carries up to MAXBATCH packets in a handful of messages. A
+// shorter chunk may only end a run. Returns the number of chunks handed to
+// the kernel, or -1 on error. EIO or EINVAL mean the route can't segment
+// these sizes; send_chunks still works there.
+int send_chunks_gso(struct chunk_t *chunks, int n, int sock, struct sockaddr *addr)
+{
+    if (chunks == NULL) {
+        fprintf(stderr, "[send_chunks_gso]: chunks was NULL\n");
+        return -1;
+    } else if (addr == NULL) {
+        fprintf(stderr, "[send_chunks_gso]: addr was NULL\n");
+        return -1;
+    }
+    uint8_t hdrs[MAXBATCH][HEADERSIZE];
+    struct iovec iovs[2 * MAXBATCH];
+    struct mmsghdr msgs[MAXBATCH];
+    int counts[MAXBATCH];
+    _Alignas(struct cmsghdr) char ctrl[MAXBATCH][CMSG_SPACE(sizeof(uint16_t))];
+    int sent = 0;
+    while (sent < n) {
+        int burst = (n - sent < MAXBATCH) ? n - sent : MAXBATCH;
+        int nmsgs = 0;
+        memset(msgs, 0, burst * sizeof(struct mmsghdr));
+        for (int i = 0; i < burst; ) {
+            int start = i;
+            size_t segsize = HEADERSIZE + chunks[sent + i].len;
+            size_t bytes = 0;
+            while (i < burst && i - start < GSO_MAX_SEGS) {
+                struct chunk_t *c = &chunks[sent + i];
+                size_t len = HEADERSIZE + c->len;
+                if (len > segsize || bytes + len > GSO_MAX_BYTES) {
+                    break;
+                }
+                serialize_header(hdrs[i], c->type, c->flags, c->seq_no, c->len);
+                iovs[2 * i].iov_base = hdrs[i];
+                iovs[2 * i].iov_len = HEADERSIZE;
+                iovs[2 * i + 1].iov_base = (void *) c->data;
+                iovs[2 * i + 1].iov_len = c->len;
+                bytes += len;
+                i++;
+                if (len < segsize) {
+                    break;
+                }
+            }
+            struct msghdr *msg = &msgs[nmsgs].msg_hdr;
+            msg->msg_name = addr;
+            msg->msg_namelen = sizeof(*addr);
+            msg->msg_iov = &iovs[2 * start];
+            msg->msg_iovlen = 2 * (i - start);
+            if (i - start > 1) {
+                msg->msg_control = ctrl[nmsgs];
+                msg->msg_controllen = sizeof(ctrl[nmsgs]);
+                struct cmsghdr *cm = CMSG_FIRSTHDR(msg);
+                cm->cmsg_level = SOL_UDP;
+                cm->cmsg_type = UDP_SEGMENT;
+                cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                uint16_t gso_size = (uint16_t) segsize;
+                memcpy(CMSG_DATA(cm), &gso_size, sizeof(gso_size));
+            }
+            counts[nmsgs++] = i - start;
+        }
+
+        int done = 0;
+        while (done < nmsgs) {
+            int ret = sendmmsg(sock, msgs + done, nmsgs - done, 0);
+            if (ret == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return sent;
+                }
+                if (errno != EIO && errno != EINVAL) {
+                    perror("[send_chunks_gso]: sendmmsg");
+                }
+                return -1;
+            }
+            for (int k = done; k < done + ret; ++k) {
+                sent += counts[k];
+            }
+            done += ret;
+        }
+    }
+    return sent;
+}
+
+int recv_packet(struct packet_t *packet, int sock, struct sockaddr *addr, socklen_t *addrlen,
+        struct frame_pool *pool)
 {
     if (packet == NULL) {
         fprintf(stderr, "[recv_packet]: packet was NULL\n");
@@ -143,30 +465,177 @@ int recv_packet(struct packet_t *packet, int sock, struct sockaddr *addr, sockle
         return -1;
     }
     // We know a packet cannot be larger than this
-    size_t maxlen = 3 * sizeof(int) + MAXBUFSIZE;
-    uint8_t *buf = malloc(maxlen * sizeof(uint8_t));
-    
-    // Loop until we can actually receive something (due to loss_rate)
-    while (is_lost(loss_rate)) {
-        ssize_t recv_len = recvfrom(sock, buf, maxlen, 0, addr, addrlen);
-        if (recv_len == -1) {
-            return -1;
-        }
+    size_t maxlen = FRAMESIZE;
+    uint8_t *buf = pool_get(pool);
+    if (buf == NULL) {
+        fprintf(stderr, "[recv_packet]: couldn't get frame\n");
+        return -1;
     }
+
     ssize_t recv_len = recvfrom(sock, buf, maxlen, 0, addr, addrlen);
     if (recv_len == -1) {
+        pool_put(pool, buf);
         return -1;
     }
-    if (deserialize(buf, packet) == -1) {
+    // A truncated datagram would pick up the frame's stale bytes as payload
+    if (recv_len < HEADERSIZE || deserialize_len(buf) > recv_len - HEADERSIZE
+            || deserialize(buf, packet) == -1) {
         fprintf(stderr, "[recv_packet]: couldn't deserialize packet\n");
-        free(buf);
+        pool_put(pool, buf);
+        errno = EBADMSG;
         return -1;
     }
-    free(buf);
+    pool_put(pool, buf);
     return 0;
 }
 
-int recv_ack(struct ack_t *ack, int sock, struct sockaddr *addr)
+// Whether a received datagram of len bytes is a well-formed packet, and if
+// so deserializes it into pkt. A truncated one would otherwise pick up the
+// frame's stale bytes as payload.
+static bool parse_datagram(uint8_t *buf, size_t len, struct packet_t *pkt)
+{
+    return len >= HEADERSIZE && (size_t) deserialize_len(buf) <= len - HEADERSIZE
+        && deserialize(buf, pkt) == 0;
+}
+
+// Blocks until at least one packet arrives, then drains up to n packets that
+// are already queued on the socket with a single recvmmsg. Returns the
+// number of packets stored in pkts (at least one) or -1 on error; addrs[i]
+// is the sender of pkts[i]. Malformed datagrams are skipped and counted in
+// *dropped. On a non-blocking socket with nothing (valid) queued, returns
+// -1 with errno EAGAIN.
+int recv_packets(struct packet_t *pkts, struct sockaddr *addrs, int n, int sock,
+        struct frame_pool *pool, int *dropped)
+{
+    if (pkts == NULL) {
+        fprintf(stderr, "[recv_packets]: pkts was NULL\n");
+        return -1;
+    } else if (addrs == NULL) {
+        fprintf(stderr, "[recv_packets]: addrs was NULL\n");
+        return -1;
+    }
+    if (n > MAXBATCH) {
+        n = MAXBATCH;
+    }
+    uint8_t *frames[MAXBATCH];
+    if (get_frames(pool, frames, n) == -1) {
+        fprintf(stderr, "[recv_packets]: couldn't get frames\n");
+        return -1;
+    }
+    struct mmsghdr msgs[MAXBATCH];
+    struct iovec iovs[MAXBATCH];
+    struct sockaddr from[MAXBATCH];
+
+    // Good packets are compacted to the front of pkts
+    *dropped = 0;
+    int kept = 0;
+    while (kept == 0) {
+        memset(msgs, 0, n * sizeof(struct mmsghdr));
+        for (int i = 0; i < n; ++i) {
+            iovs[i].iov_base = frames[i];
+            iovs[i].iov_len = FRAMESIZE;
+            msgs[i].msg_hdr.msg_name = &from[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        int got = recvmmsg(sock, msgs, n, MSG_WAITFORONE, NULL);
+        if (got == -1) {
+            put_frames(pool, frames, n);
+            return -1;
+        }
+        for (int i = 0; i < got; ++i) {
+            if (!parse_datagram(frames[i], msgs[i].msg_len, &pkts[kept])) {
+                (*dropped)++;
+                continue;
+            }
+            addrs[kept] = from[i];
+            kept++;
+        }
+    }
+    put_frames(pool, frames, n);
+    return kept;
+}
+
+// Like recv_packets, for a socket with UDP_GRO enabled: the kernel may hand
+// back a run of datagrams from one sender coalesced into a single buffer,
+// with the segment size in a control message. Each segment starts with its
+// own header. pool must hold frames of GRO_BUFSIZE bytes; since GRO
+// coalesces at most GSO_MAX_SEGS datagrams, n / GSO_MAX_SEGS buffers are
+// read at once so the packets fit when n is at least GSO_MAX_SEGS. Segments
+// that still don't fit are counted in dropped with the malformed ones.
+int recv_packets_gro(struct packet_t *pkts, struct sockaddr *addrs, int n, int sock,
+        struct frame_pool *pool, int *dropped)
+{
+    if (pkts == NULL) {
+        fprintf(stderr, "[recv_packets_gro]: pkts was NULL\n");
+        return -1;
+    } else if (addrs == NULL) {
+        fprintf(stderr, "[recv_packets_gro]: addrs was NULL\n");
+        return -1;
+    }
+    int nmsgs = n / GSO_MAX_SEGS;
+    if (nmsgs < 1) {
+        nmsgs = 1;
+    } else if (nmsgs > MAXBATCH) {
+        nmsgs = MAXBATCH;
+    }
+    uint8_t *frames[MAXBATCH];
+    if (get_frames(pool, frames, nmsgs) == -1) {
+        fprintf(stderr, "[recv_packets_gro]: couldn't get frames\n");
+        return -1;
+    }
+    struct mmsghdr msgs[MAXBATCH];
+    struct iovec iovs[MAXBATCH];
+    struct sockaddr from[MAXBATCH];
+    _Alignas(struct cmsghdr) char ctrl[MAXBATCH][CMSG_SPACE(sizeof(int))];
+
+    *dropped = 0;
+    int kept = 0;
+    while (kept == 0) {
+        memset(msgs, 0, nmsgs * sizeof(struct mmsghdr));
+        for (int i = 0; i < nmsgs; ++i) {
+            iovs[i].iov_base = frames[i];
+            iovs[i].iov_len = GRO_BUFSIZE;
+            msgs[i].msg_hdr.msg_name = &from[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_control = ctrl[i];
+            msgs[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
+        }
+        int got = recvmmsg(sock, msgs, nmsgs, MSG_WAITFORONE, NULL);
+        if (got == -1) {
+            put_frames(pool, frames, nmsgs);
+            return -1;
+        }
+        for (int i = 0; i < got; ++i) {
+            size_t total = msgs[i].msg_len;
+            size_t segsize = total;
+            struct cmsghdr *cm;
+            for (cm = CMSG_FIRSTHDR(&msgs[i].msg_hdr); cm != NULL; cm = CMSG_NXTHDR(&msgs[i].msg_hdr, cm)) {
+                if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+                    int gso_size;
+                    memcpy(&gso_size, CMSG_DATA(cm), sizeof(gso_size));
+                    segsize = gso_size;
+                }
+            }
+            for (size_t off = 0; off < total; off += segsize) {
+                size_t len = total - off < segsize ? total - off : segsize;
+                if (kept == n || !parse_datagram(frames[i] + off, len, &pkts[kept])) {
+                    (*dropped)++;
+                    continue;
+                }
+                addrs[kept] = from[i];
+                kept++;
+            }
+        }
+    }
+    put_frames(pool, frames, nmsgs);
+    return kept;
+}
+
+int recv_ack(struct ack_t *ack, int sock, struct sockaddr *addr, struct frame_pool *pool)
 {
     if (ack == NULL) {
         fprintf(stderr, "[recv_ack]: packet was NULL\n");
@@ -176,19 +645,21 @@ int recv_ack(struct ack_t *ack, int sock, struct sockaddr *addr)
         return -1;
     }
     // We know a packet cannot be larger than this
-    size_t maxlen = (socklen_t) (2 * sizeof(int));
-    uint8_t *buf = malloc(maxlen * sizeof(uint8_t));
+    size_t maxlen = ACKSIZE;
+    uint8_t *buf = pool_get(pool);
+    if (buf == NULL) {
+        fprintf(stderr, "[recv_ack]: couldn't get frame\n");
+        return -1;
+    }
     socklen_t addrlen = sizeof(*addr);
     ssize_t recv_len = recvfrom(sock, buf, maxlen, 0, addr, &addrlen);
     if (recv_len == -1) {
-        free(buf);
+        pool_put(pool, buf);
         return -1;
     }
-    uint8_t *tmp = buf;
-    tmp = deserialize_int(tmp, &ack->type);
-    tmp = deserialize_int(tmp, &ack->ack_no);
-    free(buf);
-    return 0;
+    int ret = deserialize_ack(buf, recv_len, ack);
+    pool_put(pool, buf);
+    return ret;
 }
 
 // Serialize packet into a single buffer of bytes. Assumes the serialbuf is long enough
@@ -201,11 +672,19 @@ int serialize(uint8_t *serialbuf, struct packet_t *packet)
         fprintf(stderr, "[serialize]: serialbuf was NULL\n");
         return -1;
     }
-    uint8_t *tmp = serialbuf;
-    tmp = serialize_int(tmp, packet->type);
-    tmp = serialize_int(tmp, packet->seq_no);
-    tmp = serialize_int(tmp, packet->len);
-    strncpy((char *)tmp, packet->data, packet->len);
+    serialize_header(serialbuf, packet->type, packet->flags, packet->seq_no, packet->len);
+    memcpy(serialbuf + HEADERSIZE, packet->data, packet->len);
+    return 0;
+}
+
+// Serialize just the packet header. Assumes serialbuf holds HEADERSIZE bytes
+int serialize_header(uint8_t *serialbuf, int type, int flags, int64_t seq_no, int len)
+{
+    serialbuf[0] = (PROTO_VERSION << 4) | (flags & 0x0f);
+    serialbuf[1] = type;
+    serialbuf[2] = len >> 8;
+    serialbuf[3] = len;
+    serialize_int(serialbuf + 4, (int) seq_no);
     return 0;
 }
 
@@ -220,7 +699,9 @@ uint8_t *serialize_int(uint8_t *serialbuf, int val)
     return serialbuf + 4;
 }
 
-// Deserializes a packet from the network.
+// Deserializes a packet from the network. Returns -1 for anything but our
+// protocol version, quietly: stray or old-version datagrams are the
+// caller's to drop and count, not an error.
 int deserialize(uint8_t *serialbuf, struct packet_t *packet)
 {
     if (packet == NULL) {
@@ -230,17 +711,252 @@ int deserialize(uint8_t *serialbuf, struct packet_t *packet)
         fprintf(stderr, "[deserialize]: serialbuf was NULL\n");
         return -1;
     }
-    uint8_t *tmp = serialbuf;
-    tmp = deserialize_int(tmp, &packet->type);
-    tmp = deserialize_int(tmp, &packet->seq_no);
-    tmp = deserialize_int(tmp, &packet->len);
-    strcpy(packet->data, (char *)tmp);
+    if (serialbuf[0] >> 4 != PROTO_VERSION) {
+        return -1;
+    }
+    int seq_no;
+    packet->flags = serialbuf[0] & 0x0f;
+    packet->type = serialbuf[1];
+    packet->len = deserialize_len(serialbuf);
+    deserialize_int(serialbuf + 4, &seq_no);
+
+    // Only the low 32 bits so far; the receiving session unwraps them
+    packet->seq_no = (uint32_t) seq_no;
+    if (packet->len > MAXBUFSIZE) {
+        fprintf(stderr, "[deserialize]: bad packet length %d\n", packet->len);
+        return -1;
+    }
+    memcpy(packet->data, serialbuf + HEADERSIZE, packet->len);
     return 0;
 }
 
+// Payload length from a serialized header
+int deserialize_len(const uint8_t *serialbuf)
+{
+    return (serialbuf[2] << 8) | serialbuf[3];
+}
+
 // Deserializes an integer from the network. Assumes both pointers are not NULL
 uint8_t *deserialize_int(uint8_t *serialbuf, int *val)
 {
     *val = (serialbuf[0] << 24) | (serialbuf[1] << 16) | (serialbuf[2] << 8) | serialbuf[3];
     return serialbuf + 4;
 }
+
+// Serialize a stripe header into STRIPESIZE bytes, 64-bit fields as two
+// network-order ints
+void serialize_stripe(uint8_t *serialbuf, const struct stripe_t *stripe)
+{
+    uint8_t *tmp = serialbuf;
+    tmp = serialize_int(tmp, (int) (stripe->transfer_id >> 32));
+    tmp = serialize_int(tmp, (int) stripe->transfer_id);
+    tmp = serialize_int(tmp, (int) (stripe->offset >> 32));
+    tmp = serialize_int(tmp, (int) stripe->offset);
+    tmp = serialize_int(tmp, (int) (stripe->total >> 32));
+    tmp = serialize_int(tmp, (int) stripe->total);
+    tmp = serialize_int(tmp, (int) stripe->index);
+    tmp = serialize_int(tmp, (int) stripe->count);
+}
+
+static uint64_t deserialize_u64(uint8_t **tmp)
+{
+    int hi, lo;
+    *tmp = deserialize_int(*tmp, &hi);
+    *tmp = deserialize_int(*tmp, &lo);
+    return ((uint64_t) (uint32_t) hi << 32) | (uint32_t) lo;
+}
+
+int deserialize_stripe(const uint8_t *serialbuf, int len, struct stripe_t *stripe)
+{
+    if (len < STRIPESIZE) {
+        fprintf(stderr, "[deserialize_stripe]: stripe header too short (%d bytes)\n", len);
+        return -1;
+    }
+    uint8_t *tmp = (uint8_t *) serialbuf;
+    int index, count;
+    stripe->transfer_id = deserialize_u64(&tmp);
+    stripe->offset = deserialize_u64(&tmp);
+    stripe->total = deserialize_u64(&tmp);
+    tmp = deserialize_int(tmp, &index);
+    tmp = deserialize_int(tmp, &count);
+    stripe->index = (uint32_t) index;
+    stripe->count = (uint32_t) count;
+    if (stripe->count == 0 || stripe->index >= stripe->count || stripe->offset > stripe->total) {
+        fprintf(stderr, "[deserialize_stripe]: bad stripe %u/%u\n", stripe->index, stripe->count);
+        return -1;
+    }
+    return 0;
+}
+
+// Serialize a resume request into RESUMESIZE bytes, 64-bit fields as two
+// network-order ints
+void serialize_resume(uint8_t *serialbuf, const struct resume_t *resume)
+{
+    uint8_t *tmp = serialbuf;
+    tmp = serialize_int(tmp, (int) (resume->key >> 32));
+    tmp = serialize_int(tmp, (int) resume->key);
+    tmp = serialize_int(tmp, (int) (resume->total >> 32));
+    tmp = serialize_int(tmp, (int) resume->total);
+    tmp = serialize_int(tmp, (int) resume->chunk_size);
+}
+
+int deserialize_resume(const uint8_t *serialbuf, int len, struct resume_t *resume)
+{
+    if (len < RESUMESIZE) {
+        fprintf(stderr, "[deserialize_resume]: resume request too short (%d bytes)\n", len);
+        return -1;
+    }
+    uint8_t *tmp = (uint8_t *) serialbuf;
+    int chunk_size;
+    resume->key = deserialize_u64(&tmp);
+    resume->total = deserialize_u64(&tmp);
+    tmp = deserialize_int(tmp, &chunk_size);
+    if (chunk_size < 1 || chunk_size > MAXBUFSIZE) {
+        fprintf(stderr, "[deserialize_resume]: bad chunk size %d\n", chunk_size);
+        return -1;
+    }
+    resume->chunk_size = (uint32_t) chunk_size;
+    return 0;
+}
+
+// io_uring backend. The socket calls above each cost a syscall; these queue
+// submissions and read completions through the shared rings instead.
+
+// Queues one sendmsg per chunk (header and payload iovecs, as in
+// send_chunks) and submits them with a single io_uring_enter. Returns the
+// number queued, which is less than n when every send slot is in flight;
+// as with a full socket, 0 sets errno to EAGAIN.
+int send_chunks_uring(struct uring *ring, struct chunk_t *chunks, int n, int sock, struct sockaddr *addr)
+{
+    if (chunks == NULL) {
+        fprintf(stderr, "[send_chunks_uring]: chunks was NULL\n");
+        return -1;
+    } else if (addr == NULL) {
+        fprintf(stderr, "[send_chunks_uring]: addr was NULL\n");
+        return -1;
+    }
+    int queued = 0;
+    struct uring_send *send;
+    while (queued < n && (send = uring_get_send(ring)) != NULL) {
+        struct chunk_t *c = &chunks[queued];
+        serialize_header(send->hdr, c->type, c->flags, c->seq_no, c->len);
+        send->addr = *addr;
+        send->iov[0].iov_base = send->hdr;
+        send->iov[0].iov_len = HEADERSIZE;
+        send->iov[1].iov_base = (void *) c->data;
+        send->iov[1].iov_len = c->len;
+        memset(&send->msg, 0, sizeof(send->msg));
+        send->msg.msg_name = &send->addr;
+        send->msg.msg_namelen = sizeof(send->addr);
+        send->msg.msg_iov = send->iov;
+        send->msg.msg_iovlen = 2;
+        if (uring_queue_send(ring, send, sock) == -1) {
+            break;
+        }
+        queued++;
+    }
+    if (uring_submit(ring) == -1) {
+        return -1;
+    }
+    if (queued == 0) {
+        errno = EAGAIN;
+    }
+    return queued;
+}
+
+// Queues an ACK. It goes out with the next uring_submit, so a batch of ACKs
+// costs one syscall.
+int send_ack_uring(struct uring *ring, struct ack_t *ack, int sock, struct sockaddr *addr)
+{
+    if (ack == NULL) {
+        fprintf(stderr, "[send_ack_uring]: ack was NULL\n");
+        return -1;
+    } else if (addr == NULL) {
+        fprintf(stderr, "[send_ack_uring]: addr was NULL\n");
+        return -1;
+    }
+    struct uring_send *send = uring_get_send(ring);
+    if (send == NULL) {
+        // Every slot is in flight: push them out and make room
+        if (uring_submit(ring) == -1) {
+            return -1;
+        }
+        errno = EAGAIN;
+        return -1;
+    }
+    serialize_ack(send->hdr, ack);
+    send->addr = *addr;
+    send->iov[0].iov_base = send->hdr;
+    send->iov[0].iov_len = ACKSIZE;
+    memset(&send->msg, 0, sizeof(send->msg));
+    send->msg.msg_name = &send->addr;
+    send->msg.msg_namelen = sizeof(send->addr);
+    send->msg.msg_iov = send->iov;
+    send->msg.msg_iovlen = 1;
+    return uring_queue_send(ring, send, sock);
+}
+
+// Like recv_packets, reading whatever the multishot receive has completed.
+// Returns -1 with errno set to EAGAIN when nothing (valid) was waiting.
+int recv_packets_uring(struct uring *ring, struct packet_t *pkts, struct sockaddr *addrs, int n,
+        int *dropped)
+{
+    if (pkts == NULL) {
+        fprintf(stderr, "[recv_packets_uring]: pkts was NULL\n");
+        return -1;
+    } else if (addrs == NULL) {
+        fprintf(stderr, "[recv_packets_uring]: addrs was NULL\n");
+        return -1;
+    }
+    *dropped = 0;
+    int kept = 0;
+    while (kept < n) {
+        uint8_t *data;
+        size_t len;
+        int bid;
+        int ret = uring_next_recv(ring, &data, &len, &addrs[kept], &bid);
+        if (ret == -1) {
+            return -1;
+        } else if (ret == 0) {
+            break;
+        }
+        if (!parse_datagram(data, len, &pkts[kept])) {
+            (*dropped)++;
+        } else {
+            kept++;
+        }
+        uring_put_buf(ring, bid);
+    }
+    if (kept == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return kept;
+}
+
+// Like recv_ack, from the multishot receive
+int recv_ack_uring(struct uring *ring, struct ack_t *ack)
+{
+    if (ack == NULL) {
+        fprintf(stderr, "[recv_ack_uring]: ack was NULL\n");
+        return -1;
+    }
+    for (;;) {
+        uint8_t *data;
+        size_t len;
+        int bid;
+        int ret = uring_next_recv(ring, &data, &len, NULL, &bid);
+        if (ret == -1) {
+            return -1;
+        } else if (ret == 0) {
+            errno = EAGAIN;
+            return -1;
+        }
+        // Anything that isn't an ACK of our version is skipped
+        int bad = deserialize_ack(data, len, ack);
+        uring_put_buf(ring, bid);
+        if (bad == 0) {
+            return 0;
+        }
+    }
+}
@@ -2,36 +2,139 @@
 #include <inttypes.h>
 #include <netdb.h>
 #include <stdbool.h>
+#include "pool.h"
 
 #pragma once
 
-#define MAXBUFSIZE 512
+// Wire format version, carried in the high nibble of every packet's first
+// byte. Version 1 was the original header of three 32-bit ints.
+#define PROTO_VERSION 2
 
+// Largest payload: a 9000-byte jumbo frame less the IPv4, UDP and our own
+// headers. Chunks this large need a path MTU to match (or IP fragmentation).
+#define MAXBUFSIZE 8964
+#define MAXBATCH 64
+#define HEADERSIZE 8
+#define FRAMESIZE (HEADERSIZE + MAXBUFSIZE)
+#define ACKSIZE 16
+#define SACK_BITS 64
+// Largest selective repeat window: the gap plus the packets held past it
+#define SR_MAX_WINDOW (SACK_BITS + 1)
+#define STRIPESIZE (4 * 8)
+#define RESUMESIZE (2 * 8 + 4)
 
-// Layout of the message being sent
+// Resume handshake (-R): the request a sender sends before its data, and
+// the ACK that answers it
+#define RESUME_TYPE 64
+#define RESUME_ACK_TYPE 128
+
+// UDP segmentation offload limits: segments per GSO send (the kernel's
+// UDP_MAX_SEGMENTS, also the most GRO coalesces) and bytes per datagram
+#define GSO_MAX_SEGS 64
+#define GSO_MAX_BYTES 65507
+#define GRO_BUFSIZE 65536
+
+// Header flags. A compressed data packet's payload is an LZ4 block that
+// decompresses to the packet's original data.
+#define FLAG_COMPRESSED 0x1
+
+
+struct uring;
+
+// Layout of the message being sent. On the wire the header is HEADERSIZE
+// bytes in network order:
+//   byte 0     version (high nibble) and flags (low nibble, FLAG_*)
+//   byte 1     type
+//   bytes 2-3  payload length
+//   bytes 4-7  low 32 bits of seq_no
+// Sequence numbers are 64-bit everywhere else; see seq_unwrap().
 struct packet_t {
     int type;
-    int seq_no;
+    int flags;
+    int64_t seq_no;
     int len;
     char data[MAXBUFSIZE];
 };
 
-// Layout of ACKs
+// Data packet whose payload is left in the caller's buffer. Sending one
+// only serializes the header; the payload goes to the kernel directly.
+struct chunk_t {
+    int type;
+    int flags;
+    int64_t seq_no;
+    int len;
+    const char *data;
+};
+
+// Layout of ACKs. ack_no is cumulative (last in-order packet). In selective
+// repeat mode, bit i of sack says packet ack_no + 2 + i was also received.
+// A resume ACK carries the byte offset to resume from in place of sack.
+// On the wire: version and type as in a packet header, two zero bytes, the
+// low 32 bits of ack_no and the 64-bit sack, ACKSIZE bytes in all.
 struct ack_t {
     int type;
-    int ack_no;
+    int64_t ack_no;
+    uint64_t sack;
+};
+
+// Payload of the first packet (type 16, seq_no 0) of each stripe of a
+// striped transfer: which transfer it belongs to and where its bytes go
+struct stripe_t {
+    uint64_t transfer_id;
+    uint64_t offset;
+    uint64_t total;
+    uint32_t index;
+    uint32_t count;
+};
+
+// Payload of a resume request (type RESUME_TYPE): which data the sender
+// has, as a key that stays the same across runs, its length and the chunk
+// size it is cut into
+struct resume_t {
+    uint64_t key;
+    uint64_t total;
+    uint32_t chunk_size;
+};
+
+// Retransmission strategy, picked on the command line of both ends
+enum arq_mode {
+    MODE_GBN,
+    MODE_SR
 };
 
-bool is_lost(double loss_rate);
+int parse_mode(const char *str, enum arq_mode *mode);
 void print_packet(struct packet_t pkt);
 void print_ack(struct ack_t ack);
-int make_packet(struct packet_t *packet, int type, int seq_no, int len, char *buf);
-int make_ack(struct ack_t *ack, int type, int ack_no);
-int send_ack(struct ack_t *ack, int sock, struct sockaddr *addr);
-int send_packet(struct packet_t *packet, int sock, struct sockaddr *addr);
-int recv_packet(struct packet_t *packet, int sock, struct sockaddr *addr, socklen_t *addrlen, double loss_rate);
-int recv_ack(struct ack_t *ack, int sock, struct sockaddr *addr);
+int make_packet(struct packet_t *packet, int type, int64_t seq_no, int len, char *buf);
+int make_chunk(struct chunk_t *chunk, int64_t seq_no, int len, const char *buf);
+int make_ack(struct ack_t *ack, int type, int64_t ack_no);
+int64_t seq_unwrap(int64_t ref, int64_t wire);
+int send_ack(struct ack_t *ack, int sock, struct sockaddr *addr, struct frame_pool *pool);
+int send_packet(struct packet_t *packet, int sock, struct sockaddr *addr, struct frame_pool *pool);
+int send_packets(struct packet_t *pkts, int n, int sock, struct sockaddr *addr, struct frame_pool *pool);
+int send_chunk(struct chunk_t *chunk, int sock, struct sockaddr *addr);
+int send_chunks(struct chunk_t *chunks, int n, int sock, struct sockaddr *addr);
+int send_chunks_at(struct chunk_t *chunks, int n, int sock, struct sockaddr *addr, const uint64_t *txtime);
+int send_chunks_gso(struct chunk_t *chunks, int n, int sock, struct sockaddr *addr);
+int recv_packet(struct packet_t *packet, int sock, struct sockaddr *addr, socklen_t *addrlen,
+        struct frame_pool *pool);
+int recv_packets(struct packet_t *pkts, struct sockaddr *addrs, int n, int sock,
+        struct frame_pool *pool, int *dropped);
+int recv_packets_gro(struct packet_t *pkts, struct sockaddr *addrs, int n, int sock,
+        struct frame_pool *pool, int *dropped);
+int recv_ack(struct ack_t *ack, int sock, struct sockaddr *addr, struct frame_pool *pool);
 uint8_t *serialize_int(uint8_t *serialbuf, int val);
+int serialize_header(uint8_t *serialbuf, int type, int flags, int64_t seq_no, int len);
 int serialize(uint8_t *serialbuf, struct packet_t *packet);
 int deserialize(uint8_t *serialbuf, struct packet_t *packet);
 uint8_t *deserialize_int(uint8_t *serialbuf, int *val);
+int deserialize_len(const uint8_t *serialbuf);
+void serialize_stripe(uint8_t *serialbuf, const struct stripe_t *stripe);
+int deserialize_stripe(const uint8_t *serialbuf, int len, struct stripe_t *stripe);
+void serialize_resume(uint8_t *serialbuf, const struct resume_t *resume);
+int deserialize_resume(const uint8_t *serialbuf, int len, struct resume_t *resume);
+int send_chunks_uring(struct uring *ring, struct chunk_t *chunks, int n, int sock, struct sockaddr *addr);
+int send_ack_uring(struct uring *ring, struct ack_t *ack, int sock, struct sockaddr *addr);
+int recv_packets_uring(struct uring *ring, struct packet_t *pkts, struct sockaddr *addrs, int n,
+        int *dropped);
+int recv_ack_uring(struct uring *ring, struct ack_t *ack);
@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "pool.h"
+
+
+// Allocates nframes frames of frame_size bytes up front
+int pool_init(struct frame_pool *pool, int nframes, size_t frame_size)
+{
+    if (pool == NULL) {
+        fprintf(stderr, "[pool_init]: pool was NULL\n");
+        return -1;
+    } else if (nframes < 1 || frame_size == 0) {
+        fprintf(stderr, "[pool_init]: bad pool size\n");
+        return -1;
+    }
+    pool->mem = malloc(nframes * frame_size);
+    pool->free_list = malloc(nframes * sizeof(uint8_t *));
+    if (pool->mem == NULL || pool->free_list == NULL) {
+        fprintf(stderr, "[pool_init]: couldn't allocate %d frames\n", nframes);
+        free(pool->mem);
+        free(pool->free_list);
+        return -1;
+    }
+    pool->frame_size = frame_size;
+    pool->nframes = nframes;
+    for (int i = 0; i < nframes; ++i) {
+        pool->free_list[i] = pool->mem + (nframes - 1 - i) * frame_size;
+    }
+    pool->nfree = nframes;
+    pool->heap_allocs = 0;
+    return 0;
+}
+
+// Takes a frame from the pool. An empty pool falls back to malloc, which is
+// counted so allocations in the steady state show up.
+uint8_t *pool_get(struct frame_pool *pool)
+{
+    if (pool == NULL) {
+        fprintf(stderr, "[pool_get]: pool was NULL\n");
+        return NULL;
+    }
+    if (pool->nfree > 0) {
+        return pool->free_list[--pool->nfree];
+    }
+    pool->heap_allocs++;
+    return malloc(pool->frame_size);
+}
+
+// Returns a frame taken with pool_get
+void pool_put(struct frame_pool *pool, uint8_t *frame)
+{
+    if (frame == NULL) {
+        return;
+    }
+    if (pool == NULL || frame < pool->mem || frame >= pool->mem + pool->nframes * pool->frame_size) {
+        free(frame);
+        return;
+    }
+    pool->free_list[pool->nfree++] = frame;
+}
+
+void pool_destroy(struct frame_pool *pool)
+{
+    if (pool == NULL) {
+        return;
+    }
+    free(pool->mem);
+    free(pool->free_list);
+    pool->mem = NULL;
+    pool->free_list = NULL;
+    pool->nframes = 0;
+    pool->nfree = 0;
+}
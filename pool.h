@@ -0,0 +1,22 @@
+#include <stddef.h>
+#include <inttypes.h>
+
+#pragma once
+
+
+// Fixed set of equally sized frames carved out of one allocation. Frames are
+// handed out and returned LIFO so the hot ones stay in cache. If the pool
+// runs dry, pool_get falls back to malloc and counts it in heap_allocs.
+struct frame_pool {
+    uint8_t *mem;
+    size_t frame_size;
+    int nframes;
+    uint8_t **free_list;
+    int nfree;
+    unsigned long heap_allocs;
+};
+
+int pool_init(struct frame_pool *pool, int nframes, size_t frame_size);
+uint8_t *pool_get(struct frame_pool *pool);
+void pool_put(struct frame_pool *pool, uint8_t *frame);
+void pool_destroy(struct frame_pool *pool);
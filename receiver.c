@@ -2,143 +2,1162 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
 #include <time.h>
 #include <limits.h>
 #include <netdb.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #include "net.h"
 #include "timer.h"
-#include "data.h"
 #include "packet.h"
+#include "event.h"
+#include "session.h"
+#include "uring.h"
+#include "impair.h"
+#include "metrics.h"
+#include "trace.h"
+#include "workq.h"
+#include "lz.h"
 
+#define LINGER_SEC 7
+#define SESSION_IDLE_SEC 60
+#define SESSION_BUCKETS 256
+#define FINISHED_PEERS 64
+#define MAX_WORKERS 64
+#define ACK_EVERY 2
+#define ACK_DELAY_USEC 500
 
-int main(int argc, char **argv)
+
+struct receiver;
+struct worker;
+
+// One share of a batch's compressed packets, w->inflate_idx[first] on, for
+// one decompression thread
+struct inflate_job {
+    struct worker *w;
+    int first;
+    int count;
+    char scratch[MAXBUFSIZE];
+};
+
+// A datagram held back by the impairment emulator
+struct held_packet {
+    struct sockaddr addr;
+    struct packet_t pkt;
+};
+
+// A peer whose session ended, remembered for SESSION_IDLE_SEC so that a
+// tear-down it retries late is not taken for a new, empty transfer
+struct finished_peer {
+    struct sockaddr peer;
+    uint64_t until;
+    bool failed;
+};
+
+// One SO_REUSEPORT socket and the sessions the kernel hashes onto it. Each
+// worker runs its own event loop on its own thread and shares nothing with
+// the others but the receiver below.
+struct worker {
+    struct receiver *r;
+    int id;
+    pthread_t thread;
+    struct event_loop loop;
+    struct event_timer reap_timer;
+    struct event_timer impair_timer;
+    struct event_timer ack_timer;
+    int sock;
+    struct frame_pool pool;
+    struct frame_pool gro_pool;
+    struct uring *ring;
+    struct packet_t *pkts;
+    struct sockaddr addrs[MAXBATCH];
+    struct impair impair;
+    struct held_packet held;
+    struct trace_ring *trace;
+
+    // Sessions hashed on the peer address, and the ones owed an ACK after
+    // the current batch
+    struct session *buckets[SESSION_BUCKETS];
+    struct session *touched[MAXBATCH];
+    int ntouched;
+    int nsessions;
+
+    // Sessions holding back an ACK until ack_timer fires
+    struct session *ack_pending;
+
+    // Peers whose sessions ended recently, oldest overwritten first
+    struct finished_peer finished[FINISHED_PEERS];
+    int next_finished;
+
+    // Decompression of the current batch: which packets are compressed, the
+    // shares handed out (one more than there are threads) and the shares
+    // still running
+    int inflate_idx[MAXBATCH];
+    struct inflate_job *jobs;
+    struct latch inflated;
+
+    // The sessions' output is written on this stage's thread (-w), or NULL
+    // to write it here. cpu and writer_cpu are where the two threads are
+    // pinned (-k), or -1.
+    struct sink_stage *writer;
+    int cpu;
+    int writer_cpu;
+};
+
+// Stripes of a striped transfer that have finished so far. The stripes
+// arrive from different ports and may land on different workers.
+struct transfer {
+    struct transfer *next;
+    uint64_t id;
+    uint32_t done;
+};
+
+// State shared by all workers
+struct receiver {
+    struct impair_config impair;
+    enum arq_mode mode;
+    const char *output_path;
+    bool gro;
+    bool uring;
+    bool pipelined;
+    uint64_t linger_usec;
+    int ack_every;
+    uint64_t ack_delay_usec;
+    int max_transfers;
+    int stop_fd;
+    atomic_int completed;
+    atomic_int failed;
+    atomic_int status;
+    pthread_mutex_t transfers_lock;
+    struct transfer *transfers;
+    struct worker workers[MAX_WORKERS];
+    int nworkers;
+    struct metrics metrics;
+    struct trace trace;
+
+    // Decompression threads shared by all workers (-z), or NULL to
+    // decompress on the worker itself
+    struct workq *inflaters;
+};
+
+
+// Stops every worker. The eventfd is never read, so it stays readable for
+// all of them.
+static void stop_all(struct receiver *r, int status)
 {
-    if (argc < 2) {
-        printf("Usage:\n");
-        printf("    %s port_no [loss_rate]\n", argv[0]);
-        exit(1);
+    if (status != 0) {
+        atomic_store(&r->status, status);
     }
+    uint64_t one = 1;
+    if (write(r->stop_fd, &one, sizeof(one)) == -1) {
+        perror("[receiver]: write stop eventfd");
+    }
+}
 
-    // Seed the RNG from is_lost()
-    srand48(12345);
+static unsigned int peer_hash(struct sockaddr *peer)
+{
+    struct sockaddr_in *in = (struct sockaddr_in *) peer;
+    uint32_t h = in->sin_addr.s_addr ^ ((uint32_t) in->sin_port * 2654435761u);
+    return (h ^ (h >> 16)) % SESSION_BUCKETS;
+}
 
-    // Parse/validate args
-    char *port = argv[1];
-    printf("port = %s\n", port);
-    long int x = strtol(argv[1], NULL, 10);
-    if (x < 0 || x > USHRT_MAX) {
-        fprintf(stderr, "[error]: port %ld is invalid\n", x);
-        exit(1);
+static struct session *find_session(struct worker *w, struct sockaddr *peer)
+{
+    for (struct session *ss = w->buckets[peer_hash(peer)]; ss != NULL; ss = ss->next) {
+        if (session_match(ss, peer)) {
+            return ss;
+        }
     }
-    double loss_rate = 0.0;
-    if (argc == 3) {
-        loss_rate = strtof(argv[2], NULL);
-        if (loss_rate < 0.0 || loss_rate > 1.0) {
-            fprintf(stderr, "[error]: loss_rate must be between 0 and 1\n");
-            exit(1);
+    return NULL;
+}
+
+// Output goes to -o path as given for a single transfer; when several
+// senders may be writing at once, the session picks a name of its own
+static struct session *new_session(struct worker *w, struct sockaddr *peer)
+{
+    struct receiver *r = w->r;
+    struct session *ss = session_create(peer, r->mode, r->output_path, r->max_transfers == 1);
+    if (ss == NULL) {
+        return NULL;
+    }
+    ss->writer = w->writer;
+    char name[64];
+    session_name(peer, name, sizeof(name));
+    unsigned int b = peer_hash(peer);
+    ss->next = w->buckets[b];
+    w->buckets[b] = ss;
+    w->nsessions++;
+    printf("worker %d: new session %s\n", w->id, name);
+    return ss;
+}
+
+static void remember_finished(struct worker *w, struct sockaddr *peer, bool failed)
+{
+    struct finished_peer *f = &w->finished[w->next_finished];
+    w->next_finished = (w->next_finished + 1) % FINISHED_PEERS;
+    f->peer = *peer;
+    f->until = now_usec() + SESSION_IDLE_SEC * 1000000ULL;
+    f->failed = failed;
+}
+
+static struct finished_peer *find_finished(struct worker *w, struct sockaddr *peer, uint64_t now)
+{
+    struct sockaddr_in *b = (struct sockaddr_in *) peer;
+    for (int i = 0; i < FINISHED_PEERS; ++i) {
+        struct sockaddr_in *a = (struct sockaddr_in *) &w->finished[i].peer;
+        if (w->finished[i].until > now && a->sin_port == b->sin_port
+                && a->sin_addr.s_addr == b->sin_addr.s_addr) {
+            return &w->finished[i];
         }
     }
+    return NULL;
+}
 
-    // Get a socket to connect to
-    int sock;
-    struct sockaddr their_addr;
-    if (get_addr_sock(&their_addr, &sock, NULL, port) == -1) {
-        fprintf(stderr, "[error]: unable to get socket\n");
-        exit(1);
+// Counts a finished stripe. Returns true when it was the last one of its
+// transfer.
+static bool stripe_done(struct receiver *r, const struct stripe_t *stripe)
+{
+    pthread_mutex_lock(&r->transfers_lock);
+    struct transfer **link = &r->transfers;
+    while (*link != NULL && (*link)->id != stripe->transfer_id) {
+        link = &(*link)->next;
+    }
+    struct transfer *t = *link;
+    if (t == NULL && (t = calloc(1, sizeof(struct transfer))) != NULL) {
+        t->id = stripe->transfer_id;
+        t->next = r->transfers;
+        r->transfers = t;
+        link = &r->transfers;
+    }
+    bool last = false;
+    if (t != NULL && ++t->done == stripe->count) {
+        *link = t->next;
+        free(t);
+        last = true;
+    }
+    pthread_mutex_unlock(&r->transfers_lock);
+    return last;
+}
+
+// Takes a session off the list waiting for the delayed-ACK timer
+static void unlink_pending(struct worker *w, struct session *ss)
+{
+    if (!ss->ack_pending) {
+        return;
+    }
+    if (ss->ack_prev != NULL) {
+        ss->ack_prev->ack_next = ss->ack_next;
+    } else {
+        w->ack_pending = ss->ack_next;
+    }
+    if (ss->ack_next != NULL) {
+        ss->ack_next->ack_prev = ss->ack_prev;
+    }
+    ss->ack_pending = false;
+}
+
+// Counts a finished transfer. Once -n have finished, the whole receiver
+// stops, with status 1 if any of them failed.
+static void transfer_done(struct receiver *r, bool ok)
+{
+    atomic_fetch_add(ok ? &r->completed : &r->failed, 1);
+    int failed = atomic_load(&r->failed);
+    if (r->max_transfers > 0 && atomic_load(&r->completed) + failed >= r->max_transfers) {
+        stop_all(r, failed > 0 ? 1 : 0);
     }
+}
 
-    // Len of connecting address
-    socklen_t addrlen = (socklen_t) sizeof(their_addr);
+// Unlinks and closes a session. Transfers that saw their tear-down (all of
+// their stripes', if striped) count towards -n, and so do sessions that
+// failed: their transfer is over too, but only for them. Either way the
+// peer is remembered for a while.
+static void end_session(struct worker *w, struct session **link, bool failed)
+{
+    struct receiver *r = w->r;
+    struct session *ss = *link;
+    *link = ss->next;
+    unlink_pending(w, ss);
+    w->nsessions--;
+    bool torn_down = ss->torn_down;
+    bool striped = ss->striped;
+    struct stripe_t stripe = ss->stripe;
+    struct sockaddr peer = ss->peer;
+    if (session_close(ss) == -1) {
+        failed = true;
+    }
+    if (torn_down || failed) {
+        remember_finished(w, &peer, failed);
+    }
+    if (failed) {
+        transfer_done(r, false);
+    } else if (torn_down && (!striped || stripe_done(r, &stripe))) {
+        transfer_done(r, true);
+    }
+}
 
-    // Last packet received
-    int packet_received = -1;
+// A session failed (a bad stripe header, output it can't write, data that
+// doesn't fit): drops it and its state and leaves the other sessions be.
+// Its sender gets no more ACKs and gives up on its own.
+static void fail_session(struct worker *w, struct session *ss)
+{
+    char name[64];
+    session_name(&ss->peer, name, sizeof(name));
+    fprintf(stderr, "[receiver]: session %s failed, dropping it\n", name);
+    for (int i = 0; i < w->ntouched; ++i) {
+        if (w->touched[i] == ss) {
+            w->touched[i] = w->touched[--w->ntouched];
+            break;
+        }
+    }
+    struct session **link = &w->buckets[peer_hash(&ss->peer)];
+    while (*link != ss) {
+        link = &(*link)->next;
+    }
+    end_session(w, link, true);
+}
 
-    // Buffer to store data in
-    char *buf = malloc((strlen(g_buffer) + 1) * sizeof(char));
-    char *bufstart = buf;
+// Sends an ACK, queued on the ring with io_uring (and submitted after the
+// batch), or straight away otherwise
+static int reply(struct worker *w, struct ack_t *ack, struct sockaddr *peer)
+{
+    metrics_add(&w->r->metrics.acks_sent, 1);
+    if (w->ring != NULL) {
+        if (send_ack_uring(w->ring, ack, w->sock, peer) == 0) {
+            return 0;
+        } else if (errno != EAGAIN) {
+            return -1;
+        }
+    }
+    return send_ack(ack, w->sock, peer, &w->pool);
+}
 
-    // Main loop of execution - runs until we get an error or tear-down msg
-    while (true) {
-        // Receive a packet
-        struct packet_t pkt;
-        if (recv_packet(&pkt, sock, &their_addr, &addrlen, loss_rate) == -1) {
+static int send_teardown_ack(struct worker *w, struct sockaddr *peer)
+{
+    struct ack_t ack;
+    if (make_ack(&ack, 8, 0) == -1) {
+        fprintf(stderr, "[receiver]: couldn't construct tear-down ACK\n");
+        return -1;
+    }
+    if (reply(w, &ack, peer) == -1) {
+        fprintf(stderr, "[receiver]: couldn't send tear-down ACK\n");
+        return -1;
+    }
+    TRACE(w->trace, TRACE_SEND_TEARDOWN_ACK, 0, 0);
+    return 0;
+}
+
+// Answers a tear-down message. After the first one the session lingers (for
+// LINGER_SEC unless -l says otherwise) in case the sender lost our ACK and
+// tries again; a tear-down from a peer whose session finished recently is
+// simply ACKed again, or ignored if it failed. From any other peer it is a
+// whole (empty) transfer. A session whose output can't be finished fails
+// instead, unacknowledged. Returns -1 only if the worker can't go on.
+static int handle_teardown(struct worker *w, struct session *ss, struct sockaddr *peer, uint64_t now)
+{
+    TRACE(w->trace, TRACE_RECV_TEARDOWN, 0, 0);
+    if (ss == NULL) {
+        struct finished_peer *f = find_finished(w, peer, now);
+        if (f != NULL) {
+            return f->failed ? 0 : send_teardown_ack(w, peer);
+        }
+        ss = new_session(w, peer);
+        if (ss == NULL) {
+            return -1;
+        }
+    }
+    unlink_pending(w, ss);
+    if (!ss->torn_down) {
+        if (session_teardown(ss) == -1) {
+            fail_session(w, ss);
+            return 0;
+        }
+        ss->expires = now + w->r->linger_usec;
+    }
+    return send_teardown_ack(w, peer);
+}
+
+// Answers a resume request with the offset the transfer resumes from.
+// Malformed requests are ignored, and a session that can't resume fails.
+// Returns -1 only if the worker can't go on.
+static int handle_resume(struct worker *w, struct session *ss, struct packet_t *pkt)
+{
+    TRACE(w->trace, TRACE_RECV_RESUME, 0, pkt->len);
+    struct resume_t req;
+    if (deserialize_resume((uint8_t *) pkt->data, pkt->len, &req) == -1) {
+        return 0;
+    }
+    bool first = !ss->resumable;
+    if (session_resume(ss, &req) == -1) {
+        fail_session(w, ss);
+        return 0;
+    }
+    if (first) {
+        char name[64];
+        session_name(&ss->peer, name, sizeof(name));
+        printf("session %s: transfer %016" PRIx64 " resumes at offset %" PRIu64 " of %" PRIu64 "\n",
+                name, req.key, ss->resume_offset, req.total);
+    }
+    struct ack_t ack;
+    make_ack(&ack, RESUME_ACK_TYPE, 0);
+    ack.sack = ss->resume_offset;
+    if (reply(w, &ack, &ss->peer) == -1) {
+        fprintf(stderr, "[receiver]: couldn't send resume ACK\n");
+        return -1;
+    }
+    TRACE(w->trace, TRACE_SEND_RESUME_ACK, (int64_t) ss->resume_offset, 0);
+    return 0;
+}
+
+static int send_data_ack(struct worker *w, struct session *ss)
+{
+    struct ack_t ack;
+    session_make_ack(ss, &ack);
+    unlink_pending(w, ss);
+    if (reply(w, &ack, &ss->peer) == -1) {
+        fprintf(stderr, "[receiver]: couldn't send ACK %" PRId64 "\n", ack.ack_no);
+        return -1;
+    }
+    TRACE(w->trace, TRACE_SEND_ACK, ack.ack_no + 1, 0);
+    return 0;
+}
+
+// The delayed-ACK timer: everything still held back goes out now
+static void on_ack_timer(struct event_loop *loop, void *ctx)
+{
+    struct worker *w = ctx;
+    while (w->ack_pending != NULL) {
+        if (send_data_ack(w, w->ack_pending) == -1) {
+            stop_all(w->r, 1);
+            return;
+        }
+    }
+    if (w->ring != NULL && uring_submit(w->ring) == -1) {
+        stop_all(w->r, 1);
+    }
+}
+
+// Decompresses a packet in place, by way of scratch. One that doesn't
+// decompress is left with len -1.
+static void inflate_packet(struct packet_t *pkt, char *scratch)
+{
+    memcpy(scratch, pkt->data, pkt->len);
+    pkt->len = lz_decompress(scratch, pkt->len, pkt->data, MAXBUFSIZE);
+    pkt->flags &= ~FLAG_COMPRESSED;
+}
+
+static void run_inflate(struct inflate_job *job)
+{
+    struct worker *w = job->w;
+    for (int i = job->first; i < job->first + job->count; ++i) {
+        inflate_packet(&w->pkts[w->inflate_idx[i]], job->scratch);
+    }
+}
+
+static void inflate_job(void *arg)
+{
+    struct inflate_job *job = arg;
+    run_inflate(job);
+    latch_done(&job->w->inflated);
+}
+
+// Decompresses the compressed data packets of a batch before they reach
+// their sessions. With -z they are split evenly between the decompression
+// threads and this one, which then waits for the rest.
+static void inflate_batch(struct worker *w, int n)
+{
+    struct receiver *r = w->r;
+    int count = 0;
+    for (int i = 0; i < n; ++i) {
+        if (w->pkts[i].type == 1 && (w->pkts[i].flags & FLAG_COMPRESSED)) {
+            w->inflate_idx[count++] = i;
+        }
+    }
+    if (count == 0) {
+        return;
+    }
+    int parts = 1;
+    if (r->inflaters != NULL) {
+        parts = r->inflaters->nthreads + 1 < count ? r->inflaters->nthreads + 1 : count;
+    }
+    latch_add(&w->inflated, parts - 1);
+    int first = 0;
+    for (int p = 0; p < parts; ++p) {
+        struct inflate_job *job = &w->jobs[p];
+        job->first = first;
+        job->count = count / parts + (p < count % parts ? 1 : 0);
+        first += job->count;
+        if (p < parts - 1) {
+            workq_submit(r->inflaters, inflate_job, job);
+        } else {
+            run_inflate(job);
+        }
+    }
+    latch_wait(&w->inflated);
+}
+
+// Routes a batch of n received packets to their sessions. A session in the
+// batch gets at most one cumulative ACK, and only once it has ack_every
+// in-order packets unacknowledged or something out of order arrived;
+// otherwise the ACK waits up to ack_delay_usec for more packets. Sessions
+// that only got packets held back for FEC owe no ACK at all.
+static void handle_batch(struct worker *w, int n)
+{
+    struct receiver *r = w->r;
+    uint64_t now = now_usec();
+    struct session *ss = NULL;
+    w->ntouched = 0;
+    inflate_batch(w, n);
+    for (int i = 0; i < n; ++i) {
+        struct packet_t *pkt = &w->pkts[i];
+        struct sockaddr *peer = &w->addrs[i];
+
+        // A packet that failed to decompress is dropped, like a corrupt one
+        if (pkt->len == -1) {
+            continue;
+        }
+
+        // Batches usually come from one sender, so try the last session first
+        if (ss == NULL || !session_match(ss, peer)) {
+            ss = find_session(w, peer);
+        }
+
+        // Check if this is the tear-down message. The session may have
+        // failed and be gone, so the next packet looks it up again.
+        if (pkt->type == 4) {
+            if (handle_teardown(w, ss, peer, now) == -1) {
+                stop_all(r, 1);
+                return;
+            }
+            ss = NULL;
+            continue;
+        }
+
+        if (ss == NULL) {
+            ss = new_session(w, peer);
+            if (ss == NULL) {
+                stop_all(r, 1);
+                return;
+            }
+        }
+
+        if (pkt->type == RESUME_TYPE) {
+            ss->expires = now + SESSION_IDLE_SEC * 1000000ULL;
+            if (handle_resume(w, ss, pkt) == -1) {
+                stop_all(r, 1);
+                return;
+            }
+            ss = NULL;
+            continue;
+        }
+
+        // Only the low 32 bits of seq_no travel; the full number is the one
+        // nearest the packet the session expects next
+        pkt->seq_no = seq_unwrap(ss->packet_received + 1, pkt->seq_no);
+
+        // Data arriving after tear-down is only reported, never ACKed
+        if (ss->torn_down) {
+            TRACE(w->trace, TRACE_RECV_LATE, pkt->seq_no, pkt->len);
+            continue;
+        }
+
+        if (!ss->touched) {
+            ss->touched = true;
+            w->touched[w->ntouched++] = ss;
+        }
+        metrics_add(&r->metrics.packets_received, 1);
+        bool parity = pkt->type == FEC_TYPE;
+        if (!parity && pkt->seq_no <= ss->packet_received) {
+            metrics_add(&r->metrics.duplicates, 1);
+        }
+        TRACE(w->trace, parity ? TRACE_RECV_PARITY : TRACE_RECV, pkt->seq_no, pkt->len);
+        uint64_t delivered = ss->bytes_received;
+        uint64_t recovered = ss->recovered;
+        if ((parity ? session_parity(ss, pkt) : session_data(ss, pkt)) == -1) {
+            metrics_add(&r->metrics.bytes_delivered, ss->bytes_received - delivered);
+            fail_session(w, ss);
+            ss = NULL;
+            continue;
+        }
+        metrics_add(&r->metrics.bytes_delivered, ss->bytes_received - delivered);
+        if (ss->recovered != recovered) {
+            metrics_add(&r->metrics.packets_recovered, ss->recovered - recovered);
+            TRACE(w->trace, TRACE_RECOVER, ss->last_recovered, 0);
+        }
+        ss->expires = now + SESSION_IDLE_SEC * 1000000ULL;
+    }
+
+    // Send ACKs, or leave them to the delayed-ACK timer
+    for (int i = 0; i < w->ntouched; ++i) {
+        ss = w->touched[i];
+        ss->touched = false;
+        if (ss->ack_now || ss->unacked >= r->ack_every) {
+            if (send_data_ack(w, ss) == -1) {
+                stop_all(r, 1);
+                return;
+            }
+        } else if (ss->need_ack && !ss->ack_pending) {
+            if (w->ack_pending == NULL && event_arm(&w->loop, &w->ack_timer, now + r->ack_delay_usec) == -1) {
+                stop_all(r, 1);
+                return;
+            }
+            ss->ack_pending = true;
+            ss->ack_prev = NULL;
+            ss->ack_next = w->ack_pending;
+            if (w->ack_pending != NULL) {
+                w->ack_pending->ack_prev = ss;
+            }
+            w->ack_pending = ss;
+        }
+    }
+}
+
+static void arm_impair(struct worker *w)
+{
+    uint64_t due = impair_next_due(&w->impair);
+    if (due != 0 && event_arm(&w->loop, &w->impair_timer, due) == -1) {
+        stop_all(w->r, 1);
+    }
+}
+
+// Runs a received batch through the impairment emulator (-I), keeping in
+// place the packets it lets through right away, and handles those
+static void impair_batch(struct worker *w, int n)
+{
+    if (!w->impair.active) {
+        handle_batch(w, n);
+        return;
+    }
+    uint64_t now = now_usec();
+    int kept = 0;
+    for (int i = 0; i < n; ++i) {
+        struct packet_t *pkt = &w->pkts[i];
+        w->held.addr = w->addrs[i];
+        w->held.pkt.type = pkt->type;
+        w->held.pkt.flags = pkt->flags;
+        w->held.pkt.seq_no = pkt->seq_no;
+        w->held.pkt.len = pkt->len;
+        memcpy(w->held.pkt.data, pkt->data, pkt->len);
+        if (!impair_admit(&w->impair, &w->held, HEADERSIZE + pkt->len, now)) {
+            continue;
+        }
+        if (kept != i) {
+            w->addrs[kept] = w->addrs[i];
+            w->pkts[kept].type = pkt->type;
+            w->pkts[kept].flags = pkt->flags;
+            w->pkts[kept].seq_no = pkt->seq_no;
+            w->pkts[kept].len = pkt->len;
+            memcpy(w->pkts[kept].data, pkt->data, pkt->len);
+        }
+        kept++;
+    }
+    arm_impair(w);
+    if (kept > 0) {
+        handle_batch(w, kept);
+    }
+}
+
+// Delivers the packets the impairment emulator held back until now
+static void on_impair(struct event_loop *loop, void *ctx)
+{
+    struct worker *w = ctx;
+    uint64_t now = now_usec();
+    int n = 0;
+    while (n < MAXBATCH && impair_pop(&w->impair, &w->held, now)) {
+        w->addrs[n] = w->held.addr;
+        w->pkts[n].type = w->held.pkt.type;
+        w->pkts[n].flags = w->held.pkt.flags;
+        w->pkts[n].seq_no = w->held.pkt.seq_no;
+        w->pkts[n].len = w->held.pkt.len;
+        memcpy(w->pkts[n].data, w->held.pkt.data, w->held.pkt.len);
+        n++;
+    }
+    if (n > 0) {
+        handle_batch(w, n);
+    }
+    if (w->ring != NULL && uring_submit(w->ring) == -1) {
+        stop_all(w->r, 1);
+    }
+    arm_impair(w);
+}
+
+// Everything already queued on the socket is drained at once
+static void on_socket(struct event_loop *loop, void *ctx, uint32_t events)
+{
+    struct worker *w = ctx;
+    struct receiver *r = w->r;
+    int n;
+    int dropped = 0;
+    if (r->gro) {
+        n = recv_packets_gro(w->pkts, w->addrs, MAXBATCH, w->sock, &w->gro_pool, &dropped);
+    } else {
+        n = recv_packets(w->pkts, w->addrs, MAXBATCH, w->sock, &w->pool, &dropped);
+    }
+
+    // Malformed or foreign datagrams are dropped; only the socket failing
+    // stops the receiver
+    metrics_add(&r->metrics.malformed, dropped);
+    if (n == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
             fprintf(stderr, "[receiver]: couldn't receive packet\n");
-            exit(1);
+            stop_all(r, 1);
         }
+        return;
+    }
+    impair_batch(w, n);
+}
 
-        // Check if this is the tear-down message. If so, get out of loop.
-        if (pkt.type == 4) {
-            printf("RECEIVED TEAR-DOWN PACKET\n");
-            break;
+// io_uring backend: the multishot receive has completed datagrams. The
+// ACKs for the batch go out in one submission.
+static void on_ring(struct event_loop *loop, void *ctx, uint32_t events)
+{
+    struct worker *w = ctx;
+    struct receiver *r = w->r;
+    int dropped = 0;
+    int n = recv_packets_uring(w->ring, w->pkts, w->addrs, MAXBATCH, &dropped);
+    metrics_add(&r->metrics.malformed, dropped);
+    if (n == -1 && errno != EAGAIN) {
+        fprintf(stderr, "[receiver]: couldn't receive packet\n");
+        stop_all(r, 1);
+        return;
+    }
+    if (n > 0) {
+        impair_batch(w, n);
+    }
+    if (uring_submit(w->ring) == -1) {
+        stop_all(r, 1);
+    }
+}
+
+// Once a second, closes sessions whose linger period ended or whose sender
+// went quiet for SESSION_IDLE_SEC
+static void on_reap(struct event_loop *loop, void *ctx)
+{
+    struct worker *w = ctx;
+    uint64_t now = now_usec();
+    for (int b = 0; b < SESSION_BUCKETS; ++b) {
+        struct session **link = &w->buckets[b];
+        while (*link != NULL) {
+            if ((*link)->expires <= now) {
+                end_session(w, link, false);
+            } else {
+                link = &(*link)->next;
+            }
         }
+    }
+    event_arm(loop, &w->reap_timer, now + 1000000ULL);
+}
+
+static void on_stop(struct event_loop *loop, void *ctx, uint32_t events)
+{
+    event_stop(loop);
+}
 
-        // Check if this is the next packet in the sequence. If so, adjust
-        // packet_received appropriately and copy data to the buffer
-        else if (pkt.seq_no == (packet_received + 1)) {
-            packet_received++;
-            strcpy(bufstart, pkt.data);
-            bufstart += pkt.len;
+static void *run_worker(void *arg)
+{
+    struct worker *w = arg;
+    if (event_run(&w->loop) == -1) {
+        stop_all(w->r, 1);
+    }
+    return NULL;
+}
+
+static int init_worker(struct receiver *r, struct worker *w, int id, int sock)
+{
+    w->r = r;
+    w->id = id;
+    w->sock = sock;
+
+    // io_uring does its own waiting on the socket, so it stays blocking;
+    // without a usable ring the worker falls back to plain socket calls
+    if (r->uring) {
+        w->ring = malloc(sizeof(struct uring));
+        if (w->ring == NULL || uring_init(w->ring) == -1) {
+            fprintf(stderr, "[receiver]: io_uring unavailable, using plain socket calls\n");
+            free(w->ring);
+            w->ring = NULL;
         }
+    }
+    if (w->ring == NULL && set_nonblocking(w->sock) == -1) {
+        return -1;
+    }
+    w->pkts = malloc(MAXBATCH * sizeof(struct packet_t));
+    int njobs = (r->inflaters != NULL ? r->inflaters->nthreads : 0) + 1;
+    w->jobs = malloc(njobs * sizeof(struct inflate_job));
+    if (w->pkts == NULL || w->jobs == NULL) {
+        fprintf(stderr, "[receiver]: couldn't allocate buffers\n");
+        return -1;
+    }
+    for (int i = 0; i < njobs; ++i) {
+        w->jobs[i].w = w;
+    }
+    latch_init(&w->inflated);
+    if (r->pipelined && (w->writer = malloc(sizeof(struct sink_stage))) == NULL) {
+        fprintf(stderr, "[receiver]: couldn't allocate writer\n");
+        return -1;
+    }
 
-        printf("RECEIVED PACKET %d\n", pkt.seq_no);
+    // Each worker emulates its own link, with its own RNG stream
+    if (impair_init(&w->impair, &r->impair, sizeof(struct held_packet), id) == -1) {
+        return -1;
+    }
 
-        // Send ACK
-        struct ack_t ack;
-        if (make_ack(&ack, 2, packet_received) == -1) {
-            fprintf(stderr, "[receiver]: couldn't construct ACK\n");
-            exit(1);
+    // Frames for a full receive batch plus one for the outgoing ACK
+    if (pool_init(&w->pool, MAXBATCH + 1, FRAMESIZE) == -1) {
+        fprintf(stderr, "[receiver]: couldn't create frame pool\n");
+        return -1;
+    }
+
+    // With GRO, a handful of buffers big enough for a coalesced run each.
+    // The io_uring receive takes plain datagrams only.
+    if (r->gro && w->ring == NULL && (enable_gro(w->sock) == -1
+            || pool_init(&w->gro_pool, MAXBATCH / GSO_MAX_SEGS, GRO_BUFSIZE) == -1)) {
+        fprintf(stderr, "[receiver]: couldn't set up GRO\n");
+        return -1;
+    }
+    if (w->ring != NULL && (uring_arm_recv(w->ring, w->sock) == -1 || uring_submit(w->ring) == -1)) {
+        fprintf(stderr, "[receiver]: couldn't set up io_uring\n");
+        return -1;
+    }
+
+    // With io_uring the loop watches the ring fd instead of the socket
+    int fd = w->ring != NULL ? w->ring->fd : w->sock;
+    event_cb on_ready = w->ring != NULL ? on_ring : on_socket;
+    if (event_init(&w->loop) == -1
+            || event_add(&w->loop, fd, EPOLLIN, on_ready, w) == -1
+            || event_add(&w->loop, r->stop_fd, EPOLLIN, on_stop, w) == -1
+            || event_add_timer(&w->loop, &w->reap_timer, on_reap, w) == -1
+            || event_add_timer(&w->loop, &w->impair_timer, on_impair, w) == -1
+            || event_add_timer(&w->loop, &w->ack_timer, on_ack_timer, w) == -1
+            || event_arm(&w->loop, &w->reap_timer, now_usec() + 1000000ULL) == -1) {
+        fprintf(stderr, "[receiver]: couldn't set up event loop\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Closes whatever sessions are still open when the receiver stops
+static void destroy_worker(struct worker *w)
+{
+    for (int b = 0; b < SESSION_BUCKETS; ++b) {
+        while (w->buckets[b] != NULL) {
+            end_session(w, &w->buckets[b], false);
+        }
+    }
+    if (w->writer != NULL) {
+        sink_stage_stop(w->writer);
+        free(w->writer);
+    }
+    event_destroy(&w->loop);
+    pool_destroy(&w->pool);
+    if (w->r->gro && w->ring == NULL) {
+        pool_destroy(&w->gro_pool);
+    }
+    if (w->ring != NULL) {
+        uring_destroy(w->ring);
+        free(w->ring);
+    }
+    impair_destroy(&w->impair);
+    free(w->pkts);
+    free(w->jobs);
+    latch_destroy(&w->inflated);
+    close(w->sock);
+}
+
+static void usage(char *prog)
+{
+    printf("Usage:\n");
+    printf("    %s [options] port_no [loss_rate]\n", prog);
+    printf("Options:\n");
+    printf("    -m gbn|sr    go-back-N (default) or selective repeat\n");
+    printf("    -o file      write the received data to file\n");
+    printf("    -t threads   worker threads, one SO_REUSEPORT socket each (default 1)\n");
+    printf("    -G           accept UDP GRO coalesced datagrams\n");
+    printf("    -l seconds   keep a finished session around this long for late tear-downs\n");
+    printf("                 (default %d)\n", LINGER_SEC);
+    printf("    -U           use io_uring instead of socket calls (no GRO)\n");
+    printf("    -a count     ACK every count in-order packets (default %d, 1 = every batch)\n", ACK_EVERY);
+    printf("    -A usec      longest an ACK is held back for more packets (default %d)\n", ACK_DELAY_USEC);
+    printf("    -n count     exit after this many transfers, 0 to run forever (default 1)\n");
+    printf("    -I spec      impair arriving data, e.g. loss=0.01,delay=20,jitter=5\n");
+    printf("                 (keys: loss ge delay jitter reorder dup rate limit seed)\n");
+    printf("    -w           write each worker's output on a writer thread of its own\n");
+    printf("    -k cpus      pin the threads to these CPUs in turn, e.g. 0,2,4-7 (with -w,\n");
+    printf("                 each worker, then its writer)\n");
+    printf("    -z threads   decompress packets on this many threads shared by all workers\n");
+    printf("                 (default: on each worker)\n");
+    printf("    -M file      dump metrics to file as JSON every -P seconds (default %d) and at exit\n",
+            METRICS_PERIOD_SEC);
+    printf("    -P seconds   metrics dump period\n");
+    printf("    -T file      record a binary trace of every packet and ACK to file\n");
+    printf("                 (decode it with tracedump)\n");
+    printf("loss_rate is shorthand for -I loss=loss_rate\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    enum arq_mode mode = MODE_GBN;
+    char *output_path = NULL;
+    int nworkers = 1;
+    int max_transfers = 1;
+    bool gro = false;
+    bool use_uring = false;
+    long linger = LINGER_SEC;
+    long ack_every = ACK_EVERY;
+    long ack_delay = ACK_DELAY_USEC;
+    struct impair_config impair;
+    impair_defaults(&impair);
+    char *metrics_path = NULL;
+    long metrics_period = METRICS_PERIOD_SEC;
+    char *trace_path = NULL;
+    int inflate_threads = 0;
+    bool pipelined = false;
+    int cpus[MAX_CPUS];
+    int ncpus = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:o:t:n:l:a:A:z:k:I:M:P:T:GUw")) != -1) {
+        switch (opt) {
+        case 'w':
+            pipelined = true;
+            break;
+        case 'k':
+            ncpus = parse_cpus(optarg, cpus, MAX_CPUS);
+            if (ncpus == -1) {
+                exit(1);
+            }
+            break;
+        case 'z':
+            inflate_threads = (int) strtol(optarg, NULL, 10);
+            if (inflate_threads < 1 || inflate_threads > MAX_WORK_THREADS) {
+                fprintf(stderr, "[error]: decompression threads must be between 1 and %d\n", MAX_WORK_THREADS);
+                exit(1);
+            }
+            break;
+        case 'a':
+            ack_every = strtol(optarg, NULL, 10);
+            if (ack_every < 1 || ack_every > MAXBATCH) {
+                fprintf(stderr, "[error]: ACK count must be between 1 and %d\n", MAXBATCH);
+                exit(1);
+            }
+            break;
+        case 'A':
+            // A held-back ACK must never outlast the sender's timer
+            ack_delay = strtol(optarg, NULL, 10);
+            if (ack_delay < 0 || ack_delay >= RTO_MIN_USEC) {
+                fprintf(stderr, "[error]: ACK delay must be below the minimum RTO of %d usec\n", RTO_MIN_USEC);
+                exit(1);
+            }
+            break;
+        case 'T':
+            trace_path = optarg;
+            break;
+        case 'M':
+            metrics_path = optarg;
+            break;
+        case 'P':
+            metrics_period = strtol(optarg, NULL, 10);
+            if (metrics_period < 1) {
+                fprintf(stderr, "[error]: metrics period must be at least 1 second\n");
+                exit(1);
+            }
+            break;
+        case 'I':
+            if (impair_parse(optarg, &impair) == -1) {
+                exit(1);
+            }
+            break;
+        case 'l':
+            linger = strtol(optarg, NULL, 10);
+            if (linger < 0) {
+                fprintf(stderr, "[error]: linger must not be negative\n");
+                exit(1);
+            }
+            break;
+        case 'U':
+            use_uring = true;
+            break;
+        case 'G':
+            gro = true;
+            break;
+        case 'o':
+            output_path = optarg;
+            break;
+        case 'm':
+            if (parse_mode(optarg, &mode) == -1) {
+                exit(1);
+            }
+            break;
+        case 't':
+            nworkers = strtol(optarg, NULL, 10);
+            if (nworkers < 1 || nworkers > MAX_WORKERS) {
+                fprintf(stderr, "[error]: threads must be between 1 and %d\n", MAX_WORKERS);
+                exit(1);
+            }
+            break;
+        case 'n':
+            max_transfers = strtol(optarg, NULL, 10);
+            if (max_transfers < 0) {
+                fprintf(stderr, "[error]: transfer count must not be negative\n");
+                exit(1);
+            }
+            break;
+        default:
+            usage(argv[0]);
         }
-        if (send_ack(&ack, sock, &their_addr) == -1) {
-            fprintf(stderr, "[receiver]: couldn't send ACK %d\n", ack.ack_no);
+    }
+    if (argc - optind < 1) {
+        usage(argv[0]);
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    // Parse/validate args
+    char *port = argv[1];
+    printf("port = %s\n", port);
+    long int x = strtol(argv[1], NULL, 10);
+    if (x < 0 || x > USHRT_MAX) {
+        fprintf(stderr, "[error]: port %ld is invalid\n", x);
+        exit(1);
+    }
+    if (argc == 3) {
+        impair.loss = strtof(argv[2], NULL);
+        if (impair.loss < 0.0 || impair.loss > 1.0) {
+            fprintf(stderr, "[error]: loss_rate must be between 0 and 1\n");
             exit(1);
         }
-        printf("--------SEND ACK %d\n", ack.ack_no + 1);
-        printf("\n");
     }
 
-    // Construct ACK to tear-down message and send
-    struct ack_t tear_down_ack;
-    if (make_ack(&tear_down_ack, 8, 0) == -1) {
-        fprintf(stderr, "[receiver]: couldn't construct tear-down ACK\n");
+    struct receiver *r = calloc(1, sizeof(struct receiver));
+    if (r == NULL) {
+        fprintf(stderr, "[receiver]: couldn't allocate receiver\n");
         exit(1);
     }
-    if (send_ack(&tear_down_ack, sock, &their_addr) == -1) {
-        fprintf(stderr, "[receiver]: couldn't send tear-down ACK\n");
+    r->impair = impair;
+    r->mode = mode;
+    r->output_path = output_path;
+    r->gro = gro;
+    r->uring = use_uring;
+    r->pipelined = pipelined;
+    r->linger_usec = linger * 1000000ULL;
+    r->ack_every = (int) ack_every;
+    r->ack_delay_usec = ack_delay;
+    r->max_transfers = max_transfers;
+    r->nworkers = nworkers;
+    atomic_init(&r->completed, 0);
+    atomic_init(&r->failed, 0);
+    atomic_init(&r->status, 0);
+    pthread_mutex_init(&r->transfers_lock, NULL);
+    r->stop_fd = eventfd(0, EFD_NONBLOCK);
+    if (r->stop_fd == -1) {
+        perror("[receiver]: eventfd");
         exit(1);
     }
-    printf("--------SEND TEAR-DOWN ACK\n");
 
-    // Timer for 7 seconds. Additionally, set a timeout on the socket so that
-    // we don't exceed the timeout by not receiving any packets
-    if (set_timeout(sock, 7) == -1) {
-        fprintf(stderr, "[receiver]: unable to set timeout\n");
+    // One socket per worker on the same port; the kernel hashes each sender
+    // onto one of them, so a session never moves between threads
+    int socks[MAX_WORKERS];
+    struct sockaddr addr;
+    if (get_addr_socks(&addr, socks, nworkers, NULL, port) == -1) {
+        fprintf(stderr, "[error]: unable to get socket\n");
         exit(1);
     }
-    clock_t start = clock();
-    int msec = (clock() - start) * 1000 / CLOCKS_PER_SEC;
-    while (msec < 7000) {
-        struct packet_t pkt;
-        if (recv_packet(&pkt, sock, &their_addr, &addrlen, loss_rate) == -1) {
-            break;
+    if (trace_path != NULL && trace_open(&r->trace, trace_path) == -1) {
+        exit(1);
+    }
+
+    // Each worker has at most one share of a batch queued per thread
+    if (inflate_threads > 0) {
+        r->inflaters = malloc(sizeof(struct workq));
+        if (r->inflaters == NULL || workq_init(r->inflaters, inflate_threads, nworkers * inflate_threads) == -1) {
+            fprintf(stderr, "[receiver]: couldn't start decompression threads\n");
+            exit(1);
         }
-        print_packet(pkt);
-        if (pkt.type == 4) {
-            printf("RECEIVED TEAR-DOWN PACKET\n");
-        } else {
-            printf("RECEIVED PACKET %d\n", pkt.seq_no);
+    }
+    for (int i = 0; i < nworkers; ++i) {
+        struct worker *w = &r->workers[i];
+        if (init_worker(r, w, i, socks[i]) == -1) {
+            exit(1);
         }
-        
-        // Only ACK if it's a tear-down packet
-        if (pkt.type == 4) {
-            if (send_ack(&tear_down_ack, sock, &their_addr) == -1) {
-                fprintf(stderr, "[receiver]: couldn't send tear-down ACK\n");
-                break;
-            }
-            printf("--------SEND TEAR-DOWN ACK\n");
+        w->cpu = -1;
+        w->writer_cpu = -1;
+        if (ncpus > 0 && pipelined) {
+            w->cpu = cpus[(2 * i) % ncpus];
+            w->writer_cpu = cpus[(2 * i + 1) % ncpus];
+        } else if (ncpus > 0) {
+            w->cpu = cpus[i % ncpus];
+        }
+        if (trace_path != NULL && (r->workers[i].trace = trace_add_ring(&r->trace)) == NULL) {
+            exit(1);
         }
     }
 
-    free(buf);
-    return 0;
+    // Main loop of execution - each worker runs until we get an error or
+    // enough sessions have finished their linger period. The metrics thread
+    // comes first, so the workers inherit its signal mask.
+    metrics_init(&r->metrics, "receiver");
+    if (metrics_start(&r->metrics, metrics_path, metrics_period) == -1
+            || (trace_path != NULL && trace_start(&r->trace) == -1)) {
+        exit(1);
+    }
+    for (int i = 0; i < nworkers; ++i) {
+        struct worker *w = &r->workers[i];
+        if ((w->writer != NULL && sink_stage_start(w->writer, w->writer_cpu) == -1)
+                || start_thread(&w->thread, run_worker, w, w->cpu) == -1) {
+            fprintf(stderr, "[receiver]: couldn't start worker %d\n", i);
+            exit(1);
+        }
+    }
+    unsigned long heap_allocs = 0;
+    unsigned long dropped = 0, duplicated = 0, overflowed = 0;
+    for (int i = 0; i < nworkers; ++i) {
+        pthread_join(r->workers[i].thread, NULL);
+    }
+    metrics_stop(&r->metrics);
+    if (trace_path != NULL) {
+        unsigned long trace_dropped = trace_close(&r->trace);
+        if (trace_dropped > 0) {
+            fprintf(stderr, "[receiver]: trace dropped %lu records\n", trace_dropped);
+        }
+    }
+    for (int i = 0; i < nworkers; ++i) {
+        heap_allocs += r->workers[i].pool.heap_allocs + r->workers[i].gro_pool.heap_allocs;
+        dropped += r->workers[i].impair.dropped;
+        duplicated += r->workers[i].impair.duplicated;
+        overflowed += r->workers[i].impair.overflowed;
+        destroy_worker(&r->workers[i]);
+    }
+    if (r->inflaters != NULL) {
+        workq_destroy(r->inflaters);
+        free(r->inflaters);
+    }
+
+    printf("heap allocations after startup: %lu\n", heap_allocs);
+    if (r->workers[0].impair.active) {
+        printf("impaired: %lu lost, %lu duplicated, %lu queue drops\n", dropped, duplicated, overflowed);
+    }
+    printf("packets recovered: %lu\n", metrics_get(&r->metrics.packets_recovered));
+    if (metrics_get(&r->metrics.malformed) > 0) {
+        printf("malformed packets dropped: %lu\n", metrics_get(&r->metrics.malformed));
+    }
+    printf("transfers completed: %d\n", atomic_load(&r->completed));
+    if (atomic_load(&r->failed) > 0) {
+        printf("transfers failed: %d\n", atomic_load(&r->failed));
+    }
+    printf("cpu time usec: %" PRIu64 "\n", cpu_usec());
+    int status = atomic_load(&r->status);
+    while (r->transfers != NULL) {
+        struct transfer *t = r->transfers;
+        r->transfers = t->next;
+        free(t);
+    }
+    pthread_mutex_destroy(&r->transfers_lock);
+    close(r->stop_fd);
+    free(r);
+    return status;
 }
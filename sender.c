@@ -6,20 +6,1276 @@
 #include <errno.h>
 #include <math.h>
 #include <netdb.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/random.h>
 #include "data.h"
 #include "timer.h"
 #include "net.h"
 #include "packet.h"
+#include "event.h"
+#include "cc.h"
+#include "source.h"
+#include "uring.h"
+#include "impair.h"
+#include "metrics.h"
+#include "trace.h"
+#include "pace.h"
+#include "zpipe.h"
+#include "fec.h"
+#include "spsc.h"
 
+#define MAX_RETRANSMISSIONS 10
+#define DUPACK_THRESHOLD 3
+#define MAX_STRIPES 64
+
+// Frames the producer stage builds ahead of the network stage; a power of
+// two
+#define SEND_FRAMES 256
+
+
+// Why the producer stage stopped
+enum produce_result {
+    PRODUCE_DONE,
+    PRODUCE_FULL,
+    PRODUCE_COMPRESSING
+};
+
+// Where the sender is in the transfer
+enum sender_phase {
+    PHASE_DATA,
+    PHASE_TEARDOWN,
+    PHASE_DONE
+};
+
+// All sender state. The socket is non-blocking and every action of the
+// network stage happens in a callback of the event loop: ACKs arriving,
+// the socket becoming writable again, or the retransmission timer expiring.
+struct sender {
+    struct event_loop loop;
+    struct event_timer rto_timer;
+    int sock;
+    struct sockaddr addr;
+    struct frame_pool pool;
+    int32_t chunk_size;
+    int32_t window_size;
+    enum arq_mode mode;
+    bool gso;
+
+    // io_uring backend, or NULL for plain socket calls
+    struct uring *ring;
+
+    // Pacing (-p); while 'paced' is set sends wait for pace_timer
+    struct pacer pacer;
+    struct event_timer pace_timer;
+    bool paced;
+
+    // Compression stage (-z), or NULL
+    struct zpipe *zpipe;
+
+    // Forward error correction (-F): the producer XORs every fec_k packets
+    // into fec[group % fec_ngroups] and follows them with their parity.
+    // fec_k is 0 without -F.
+    int fec_k;
+    int fec_ngroups;
+    struct fec_group *fec;
+
+    // Producer stage: describes the packets from prod_ptr on into 'frames',
+    // ahead of the network stage that sends them. With -w ('pipelined') it
+    // runs on a thread of its own until 'stopping'; otherwise the network
+    // stage runs it whenever the ring runs short. cpu and producer_cpu are
+    // the CPUs the two stages are pinned to (-k), or -1.
+    struct spsc frames;
+    bool pipelined;
+    pthread_t producer;
+    atomic_bool stopping;
+    const char *prod_ptr;
+    int64_t prod_seq;
+    int cpu;
+    int producer_cpu;
+
+    // Emulated impairment of the ACK path (-I)
+    struct impair impair;
+    struct event_timer impair_timer;
+
+    // bufptr is the pointer to the start of where to pull data from the
+    // source (g_buffer or a mapped file)
+    const char *bufptr;
+    const char *bufend;
+    int64_t base;
+    int64_t nextseqnum;
+
+    // Window ring, plus per-slot send time and whether the packet was ever
+    // resent. Karn's rule: only ACKs for packets sent exactly once produce
+    // RTT samples.
+    struct chunk_t *sentpkts;
+    uint64_t *sent_at;
+    bool *resent;
+
+    // Selective repeat only: packets the receiver has SACKed
+    bool *sacked;
+
+    // Retransmissions still to be sent, when the pacer or a full socket
+    // buffer cut a resend short; see queue_resend
+    int64_t rtx_next;
+    int64_t rtx_end;
+    uint64_t rtx_age;
+    struct rtt_estimator rtt;
+    int32_t retransmissions;
+
+    // Fast retransmit: duplicate cumulative ACKs seen for base - 1, and the
+    // count that triggers a resend (0 disables it)
+    int dupacks;
+    int dupack_threshold;
+
+    // Shared by all stripes; trace is this stripe's ring, NULL without -T
+    struct metrics *metrics;
+    struct trace_ring *trace;
+
+    // Congestion window, limited by window_size. Losses below 'recover' (the
+    // nextseqnum when the last loss was signalled) belong to the same
+    // episode and only shrink the window once.
+    struct cc cc;
+    int64_t recover;
+
+    // Striped transfers only: this stripe's header, sent as packet 0
+    bool striped;
+    uint8_t stripe_hdr[STRIPESIZE];
+    pthread_t thread;
+
+    enum sender_phase phase;
+    struct packet_t tear_down_pkt;
+    int teardown_tries;
+    bool blocked;
+    int status;
+};
+
+
+// Stops the loop, recording whether the transfer succeeded
+static void finish(struct sender *s, int status)
+{
+    s->phase = PHASE_DONE;
+    s->status = status;
+    event_stop(&s->loop);
+}
+
+// Restarts the retransmission timer for the oldest outstanding packet
+static void restart_timer(struct sender *s)
+{
+    if (event_arm(&s->loop, &s->rto_timer, now_usec() + rtt_rto(&s->rtt)) == -1) {
+        finish(s, 1);
+    }
+}
+
+// Waits for EPOLLOUT once the socket buffer is full, and stops waiting for it
+// once it drains
+static void set_blocked(struct sender *s, bool blocked)
+{
+    if (s->blocked == blocked) {
+        return;
+    }
+    s->blocked = blocked;
+
+    // With io_uring, send completions (on the ring fd) free up room
+    if (s->ring != NULL) {
+        return;
+    }
+    uint32_t events = blocked ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    if (event_mod(&s->loop, s->sock, events) == -1) {
+        finish(s, 1);
+    }
+}
+
+// Holds back further sends until the pacer lets the next packet go
+static void wait_pacer(struct sender *s)
+{
+    s->paced = true;
+    if (event_arm(&s->loop, &s->pace_timer, pacer_next(&s->pacer)) == -1) {
+        finish(s, 1);
+    }
+}
+
+// Hands a burst of at most MAXBATCH chunks to the kernel, as far as the
+// pacer allows: as GSO messages when enabled, or stamped with departure
+// times for SO_TXTIME. If the route can't segment them, GSO is dropped for
+// the rest of the transfer. When fewer than n go, the sender is left
+// waiting for the pacer or for socket space.
+static int send_burst(struct sender *s, struct chunk_t *chunks, int n)
+{
+    uint64_t now = now_usec();
+    int allowed = pacer_allow(&s->pacer, chunks, n, now);
+    if (allowed == 0) {
+        wait_pacer(s);
+        return 0;
+    }
+    int sent = -1;
+    if (s->ring != NULL) {
+        sent = send_chunks_uring(s->ring, chunks, allowed, s->sock, &s->addr);
+    } else if (s->gso) {
+        sent = send_chunks_gso(chunks, allowed, s->sock, &s->addr);
+        if (sent == -1 && (errno == EIO || errno == EINVAL)) {
+            fprintf(stderr, "[sender]: route can't do GSO, sending plain datagrams\n");
+            s->gso = false;
+        }
+    }
+    if (s->ring == NULL && !s->gso) {
+        if (s->pacer.txtime && s->pacer.rate > 0.0) {
+            uint64_t txtime[MAXBATCH];
+            pacer_stamp(&s->pacer, chunks, allowed, now, txtime);
+            sent = send_chunks_at(chunks, allowed, s->sock, &s->addr, txtime);
+        } else {
+            sent = send_chunks(chunks, allowed, s->sock, &s->addr);
+        }
+    }
+    if (sent == -1) {
+        return -1;
+    }
+    pacer_charge(&s->pacer, chunks, sent, now);
+    unsigned long bytes = 0;
+    for (int i = 0; i < sent; ++i) {
+        bytes += HEADERSIZE + chunks[i].len;
+    }
+    metrics_add(&s->metrics->packets_sent, sent);
+    metrics_add(&s->metrics->wire_bytes_sent, bytes);
+    if (sent < allowed) {
+        set_blocked(s, true);
+    } else if (sent < n) {
+        wait_pacer(s);
+    }
+    return sent;
+}
+
+// Sends queued retransmissions until none are left or the pacer or socket
+// calls a halt. Go back N resends every packet in [rtx_next, rtx_end);
+// selective repeat only those not SACKed and last sent at least rtx_age
+// microseconds ago. Returns the number of packets resent, or -1 on error,
+// which drops the rest of the queue for the timer to deal with.
+static int flush_resends(struct sender *s)
+{
+    if (s->rtx_next < s->base) {
+        s->rtx_next = s->base;
+    }
+    struct chunk_t burst[MAXBATCH];
+    int64_t seqs[MAXBATCH];
+    int total = 0;
+    while (!s->blocked && !s->paced && s->rtx_next < s->rtx_end) {
+        uint64_t now = now_usec();
+        int n = 0;
+        int64_t i;
+        for (i = s->rtx_next; i < s->rtx_end && n < MAXBATCH; ++i) {
+            int32_t slot = (int32_t) (i % s->window_size);
+            if (s->mode == MODE_SR && (s->sacked[slot] || now - s->sent_at[slot] < s->rtx_age)) {
+                continue;
+            }
+            burst[n] = s->sentpkts[slot];
+            seqs[n++] = i;
+        }
+        int sent = n > 0 ? send_burst(s, burst, n) : 0;
+        if (sent == -1) {
+            s->rtx_next = s->rtx_end;
+            return -1;
+        }
+        for (int k = 0; k < sent; ++k) {
+            int32_t slot = (int32_t) (seqs[k] % s->window_size);
+            s->sent_at[slot] = now;
+            s->resent[slot] = true;
+            TRACE(s->trace, TRACE_RESEND, seqs[k], burst[k].len);
+        }
+        metrics_add(&s->metrics->packets_retransmitted, sent);
+        total += sent;
+        s->rtx_next = sent < n ? seqs[sent] : i;
+    }
+    return total;
+}
+
+// Queues a resend of the packets in [base, limit) (in selective repeat,
+// the holes at least 'age' old) and sends what it can right away. A resend
+// still under way is extended rather than started over, unless 'restart'
+// is set. Returns the number of packets resent now, or -1 on error.
+static int queue_resend(struct sender *s, int64_t limit, uint64_t age, bool restart)
+{
+    if (restart || s->rtx_next >= s->rtx_end) {
+        s->rtx_next = s->base;
+        s->rtx_end = limit;
+        s->rtx_age = age;
+    } else {
+        if (limit > s->rtx_end) {
+            s->rtx_end = limit;
+        }
+        if (age < s->rtx_age) {
+            s->rtx_age = age;
+        }
+    }
+    return flush_resends(s);
+}
+
+// Counts and traces the parity packets among the first n of a burst that
+// went out
+static void parity_sent(struct sender *s, struct chunk_t *chunks, int n)
+{
+    int count = 0;
+    for (int i = 0; i < n; ++i) {
+        if (chunks[i].type == FEC_TYPE) {
+            TRACE(s->trace, TRACE_SEND_PARITY, chunks[i].seq_no, chunks[i].len);
+            count++;
+        }
+    }
+    metrics_add(&s->metrics->parity_sent, count);
+}
+
+// Producer stage, FEC: adds a new packet to its group. The group's last
+// packet (its fec_k-th, or the last of the data) is followed by the
+// group's parity.
+static void encode_parity(struct sender *s, struct chunk_t *pkt, const char *data, int len)
+{
+    struct fec_group *g = &s->fec[(pkt->seq_no / s->fec_k) % s->fec_ngroups];
+    if (pkt->seq_no % s->fec_k == 0) {
+        fec_reset(g, pkt->seq_no);
+    }
+    fec_add(g, pkt->seq_no, pkt->type, data, len);
+    if (pkt->seq_no % s->fec_k != s->fec_k - 1 && s->prod_ptr < s->bufend) {
+        return;
+    }
+    struct chunk_t parity;
+    make_chunk(&parity, g->first, fec_encode(g, s->fec_k), (const char *) g->data);
+    parity.type = FEC_TYPE;
+    spsc_push(&s->frames, &parity);
+}
+
+// Producer stage: describes the next packets into the frame ring, the
+// stripe header first when striping. The payload is sent straight out of
+// the source, or out of the compression stage once it has compressed the
+// block. Parity covers the data before compression. Stops when the data
+// runs out, the ring is full or the next block is still being compressed.
+static enum produce_result produce(struct sender *s)
+{
+    // A packet that ends a group takes its parity along
+    unsigned long need = s->fec_k > 0 ? 2 : 1;
+    while (s->prod_ptr < s->bufend) {
+        if (!spsc_has_room(&s->frames, need)) {
+            return PRODUCE_FULL;
+        }
+        struct chunk_t pkt;
+        const char *raw;
+        int rawlen;
+
+        // A stripe of a striped transfer starts with its stripe header
+        if (s->prod_seq == 0 && s->striped) {
+            make_chunk(&pkt, 0, STRIPESIZE, (const char *) s->stripe_hdr);
+            pkt.type = 16;
+            raw = (const char *) s->stripe_hdr;
+            rawlen = STRIPESIZE;
+        } else {
+            // Size the packet. If this is the last packet, it could potentially be smaller
+            int32_t pktlen = s->chunk_size;
+            if (s->bufend - s->prod_ptr < s->chunk_size) {
+                pktlen = s->bufend - s->prod_ptr;
+            }
+            const char *payload = s->prod_ptr;
+            int len = pktlen;
+            int flags = 0;
+            if (s->zpipe != NULL) {
+                const char *block;
+                int clen;
+                if (!zpipe_get(s->zpipe, (s->prod_ptr - s->zpipe->src) / s->chunk_size, &block, &clen)) {
+                    return PRODUCE_COMPRESSING;
+                }
+                if (clen > 0) {
+                    payload = block;
+                    len = clen;
+                    flags = FLAG_COMPRESSED;
+                }
+            }
+            make_chunk(&pkt, s->prod_seq, len, payload);
+            pkt.flags = flags;
+            raw = s->prod_ptr;
+            rawlen = pktlen;
+            s->prod_ptr += pktlen;
+        }
+        spsc_push(&s->frames, &pkt);
+        s->prod_seq++;
+        if (s->fec_k > 0) {
+            encode_parity(s, &pkt, raw, rawlen);
+        }
+    }
+    return PRODUCE_DONE;
+}
+
+// Producer thread (-w): keeps the frame ring full, sleeping while it is
+// full or the next block is being compressed, until the data runs out or
+// the network stage stops it
+static void *run_producer(void *arg)
+{
+    struct sender *s = arg;
+    while (!atomic_load(&s->stopping)) {
+        enum produce_result res = produce(s);
+        if (res == PRODUCE_DONE) {
+            break;
+        } else if (res == PRODUCE_FULL) {
+            if (spsc_park_producer(&s->frames, s->fec_k > 0 ? 2 : 1)) {
+                spsc_wait(s->frames.prod->efd);
+            }
+        } else {
+            // Woken by the compression stage, or by the network stage
+            // stopping us
+            struct pollfd pfds[2] = {{s->zpipe->efd, POLLIN, 0}, {s->frames.prod->efd, POLLIN, 0}};
+            if (poll(pfds, 2, -1) == -1 && errno != EINTR) {
+                perror("[sender]: poll");
+                break;
+            }
+            for (int i = 0; i < 2; ++i) {
+                if (pfds[i].revents & POLLIN) {
+                    spsc_wait(pfds[i].fd);
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+// Network stage: sends the frames the producer has ready until the window
+// is full, the pacer holds back or the socket buffer fills up. Data frames
+// are copied into the window ring, and each burst is a contiguous run of it
+// handed to send_burst at once. With FEC the burst is a copy of the run
+// with each group's parity frame right after the group; parity takes no
+// room in the window.
+static void fill_window(struct sender *s)
+{
+    while (!s->blocked && !s->paced) {
+        if (!s->pipelined) {
+            produce(s);
+        }
+        if (spsc_peek(&s->frames, 0) == NULL) {
+            // The producer thread is behind, and on_frames resumes once it
+            // isn't; without it the next block is still being compressed,
+            // and on_zpipe resumes
+            if (s->pipelined && !spsc_park_consumer(&s->frames)) {
+                continue;
+            }
+            break;
+        }
+        int32_t first = (int32_t) (s->nextseqnum % s->window_size);
+        int32_t room = (int32_t) (s->base + cc_window(&s->cc) - s->nextseqnum);
+        if (room < 0) {
+            room = 0;
+        }
+        if (room > s->window_size - first) {
+            room = s->window_size - first;
+        }
+        if (room > MAXBATCH) {
+            room = MAXBATCH;
+        }
+        struct chunk_t *burst = &s->sentpkts[first];
+        struct chunk_t fec_burst[MAXBATCH];
+        struct chunk_t *f;
+        int total = 0;
+        int32_t n = 0;
+        while (total < MAXBATCH && (f = spsc_peek(&s->frames, total)) != NULL) {
+            if (f->type != FEC_TYPE) {
+                if (n == room) {
+                    break;
+                }
+                s->sentpkts[first + n++] = *f;
+            }
+            if (s->fec_k > 0) {
+                fec_burst[total] = *f;
+            }
+            total++;
+        }
+
+        // The window is full
+        if (total == 0) {
+            break;
+        }
+
+        if (s->fec_k > 0) {
+            burst = fec_burst;
+        }
+        int sent = send_burst(s, burst, total);
+        if (sent == -1) {
+            fprintf(stderr, "[sender]: couldn't send packet %" PRId64 "\n", s->nextseqnum);
+            finish(s, 1);
+            return;
+        }
+        spsc_release(&s->frames, sent);
+        int chunks_sent = sent;
+        if (s->fec_k > 0) {
+            sent = 0;
+            for (int i = 0; i < chunks_sent; ++i) {
+                sent += fec_burst[i].type != FEC_TYPE;
+            }
+        }
+
+        // If our base is the same as nextseqnum, we need to arm the timer
+        bool was_idle = (s->base == s->nextseqnum);
+        uint64_t now = now_usec();
+        for (int32_t i = 0; i < sent; ++i) {
+            struct chunk_t *pkt = &s->sentpkts[first + i];
+            s->sent_at[first + i] = now;
+            s->resent[first + i] = false;
+            s->sacked[first + i] = false;
+            if (pkt->type == 1) {
+                s->bufptr += s->bufend - s->bufptr < s->chunk_size ? s->bufend - s->bufptr : s->chunk_size;
+            }
+            TRACE(s->trace, TRACE_SEND, pkt->seq_no, pkt->len);
+        }
+        s->nextseqnum += sent;
+        if (s->fec_k > 0) {
+            parity_sent(s, fec_burst, chunks_sent);
+        }
+        if (sent > 0) {
+            s->retransmissions = 0;
+            if (was_idle) {
+                restart_timer(s);
+            }
+        }
+    }
+}
+
+// Sends (or resends) the tear-down message and waits for its ACK
+static void send_teardown(struct sender *s)
+{
+    if (s->teardown_tries == MAX_RETRANSMISSIONS) {
+        fprintf(stderr, "[sender]: no tear-down ACK after %d tries\n", MAX_RETRANSMISSIONS);
+        finish(s, 1);
+        return;
+    }
+    s->teardown_tries++;
+    if (send_packet(&s->tear_down_pkt, s->sock, &s->addr, &s->pool) == -1 && errno != EAGAIN) {
+        fprintf(stderr, "[sender]: couldn't send tear-down packet\n");
+        finish(s, 1);
+        return;
+    }
+    TRACE(s->trace, TRACE_SEND_TEARDOWN, 0, 0);
+    restart_timer(s);
+}
+
+// After sending all packets and receiving all ACKs, construct tear-down
+// message (type=4 and len=0)
+static void start_teardown(struct sender *s)
+{
+    if (make_packet(&s->tear_down_pkt, 4, 0, 0, NULL) == -1) {
+        fprintf(stderr, "[sender]: couldn't construct tear-down packet\n");
+        finish(s, 1);
+        return;
+    }
+    s->phase = PHASE_TEARDOWN;
+    s->teardown_tries = 0;
+    send_teardown(s);
+}
+
+// Selective repeat: records the SACK bitmap. Returns the highest SACKed
+// packet still in the window, or -1 if there is none.
+static int64_t record_sack(struct sender *s, struct ack_t *ack)
+{
+    int64_t highest = -1;
+    for (int i = 0; i < SACK_BITS; ++i) {
+        if (!(ack->sack & ((uint64_t) 1 << i))) {
+            continue;
+        }
+        int64_t seq = ack->ack_no + 2 + i;
+        if (seq >= s->base && seq < s->nextseqnum) {
+            s->sacked[seq % s->window_size] = true;
+            highest = seq;
+        }
+    }
+    return highest;
+}
+
+// Tells congestion control about a loss, once per recovery episode
+static void signal_loss(struct sender *s)
+{
+    if (s->base <= s->recover) {
+        return;
+    }
+    s->recover = s->nextseqnum - 1;
+    cc_on_loss(&s->cc, s->nextseqnum - s->base);
+}
+
+// Another ACK for base - 1 while packets are outstanding. The receiver only
+// repeats itself when something arrived out of order, so after
+// dupack_threshold of these resend from base right away instead of waiting
+// for the timer.
+static void handle_dupack(struct sender *s)
+{
+    s->dupacks++;
+    if (s->dupack_threshold == 0 || s->dupacks != s->dupack_threshold) {
+        return;
+    }
+    int64_t limit = s->mode == MODE_SR ? s->base + 1 : s->nextseqnum;
+    if (queue_resend(s, limit, 0, false) == -1) {
+        fprintf(stderr, "[sender]: fast retransmit from %" PRId64 " failed\n", s->base);
+        return;
+    }
+    metrics_add(&s->metrics->fast_retransmits, 1);
+    TRACE(s->trace, TRACE_FAST_RETRANSMIT, s->base, 0);
+    signal_loss(s);
+    restart_timer(s);
+}
+
+// Handles one ACK. A new cumulative ACK slides the window, takes an RTT
+// sample from the newest packet it covers (unless that packet was resent)
+// and restarts the timer. In selective repeat mode the holes below the
+// highest SACKed packet are then resent; a hole is only resent again once
+// it has had about one round trip to be acknowledged.
+static void handle_ack(struct sender *s, struct ack_t *ack)
+{
+    if (s->phase == PHASE_TEARDOWN) {
+        if (ack->type == 8) {
+            TRACE(s->trace, TRACE_RECV_TEARDOWN_ACK, 0, 0);
+            event_disarm(&s->loop, &s->rto_timer);
+            finish(s, 0);
+        }
+        return;
+    }
+
+    // Only the low 32 bits of ack_no travel; the full number is the one
+    // nearest the last cumulative ACK, base - 1
+    ack->ack_no = seq_unwrap(s->base - 1, ack->ack_no);
+    TRACE(s->trace, TRACE_RECV_ACK, ack->ack_no + 1, 0);
+    metrics_add(&s->metrics->acks_received, 1);
+    int64_t highest = -1;
+    if (s->mode == MODE_SR) {
+        highest = record_sack(s, ack);
+    }
+
+    if (ack->ack_no == s->base - 1 && s->base < s->nextseqnum) {
+        handle_dupack(s);
+    } else if (ack->ack_no >= s->base && ack->ack_no < s->nextseqnum) {
+        s->dupacks = 0;
+        int32_t slot = (int32_t) (ack->ack_no % s->window_size);
+        long sample = -1;
+        if (!s->resent[slot]) {
+            sample = (long) (now_usec() - s->sent_at[slot]);
+            rtt_sample(&s->rtt, sample);
+            hist_record(&s->metrics->rtt_usec, sample);
+        } else {
+            rtt_reset_backoff(&s->rtt);
+        }
+        int32_t acked = (int32_t) (ack->ack_no + 1 - s->base);
+        s->base = ack->ack_no + 1;
+        cc_on_ack(&s->cc, acked, sample, s->nextseqnum - s->base);
+        pacer_on_ack(&s->pacer, (double) acked * (HEADERSIZE + s->chunk_size), now_usec(), s->rtt.srtt);
+        if (s->zpipe != NULL) {
+            zpipe_feed(s->zpipe, s->striped ? s->base - 1 : s->base);
+        }
+        hist_record(&s->metrics->window, s->nextseqnum - s->base);
+
+        // If we've reached the nextseqnum, there are no outstanding packets
+        // so disable timer
+        if (s->base == s->nextseqnum) {
+            event_disarm(&s->loop, &s->rto_timer);
+        } else {
+            restart_timer(s);
+        }
+    }
+
+    if (highest > s->base) {
+        uint64_t age = s->rtt.have_sample ? (uint64_t) s->rtt.srtt : (uint64_t) rtt_rto(&s->rtt);
+        int resent = queue_resend(s, highest, age, false);
+        if (resent == -1) {
+            fprintf(stderr, "[sender]: failed to resend holes below %" PRId64 "\n", highest);
+        } else if (resent > 0 || s->rtx_next < s->rtx_end) {
+            signal_loss(s);
+        }
+    }
+}
+
+// Sends queued retransmissions, then what the window allows, and starts
+// the tear-down once everything has been ACKed
+static void send_more(struct sender *s)
+{
+    if (s->phase == PHASE_DATA) {
+        if (flush_resends(s) == -1) {
+            fprintf(stderr, "[sender]: failed to resend packets from %" PRId64 "\n", s->base);
+        }
+        if (s->rtx_next >= s->rtx_end) {
+            fill_window(s);
+        }
+        if (s->bufptr == s->bufend && s->base == s->nextseqnum) {
+            start_teardown(s);
+        }
+    }
+}
+
+// Passes an arriving ACK through the impairment emulator; it is handled now
+// or, if held back, by on_impair
+static void accept_ack(struct sender *s, struct ack_t *ack)
+{
+    uint64_t now = now_usec();
+    if (impair_admit(&s->impair, ack, ACKSIZE, now)) {
+        handle_ack(s, ack);
+    }
+    uint64_t due = impair_next_due(&s->impair);
+    if (due != 0 && event_arm(&s->loop, &s->impair_timer, due) == -1) {
+        finish(s, 1);
+    }
+}
+
+// ACKs the impairment emulator held back are due
+static void on_impair(struct event_loop *loop, void *ctx)
+{
+    struct sender *s = ctx;
+    struct ack_t ack;
+    uint64_t now = now_usec();
+    while (s->phase != PHASE_DONE && impair_pop(&s->impair, &ack, now)) {
+        handle_ack(s, &ack);
+    }
+    if (s->phase == PHASE_DONE) {
+        return;
+    }
+    send_more(s);
+    if (s->ring != NULL && uring_submit(s->ring) == -1) {
+        finish(s, 1);
+        return;
+    }
+    uint64_t due = impair_next_due(&s->impair);
+    if (due != 0 && event_arm(loop, &s->impair_timer, due) == -1) {
+        finish(s, 1);
+    }
+}
+
+// The compression stage finished the block the sender was waiting for
+static void on_zpipe(struct event_loop *loop, void *ctx, uint32_t events)
+{
+    struct sender *s = ctx;
+    uint64_t count;
+    if (read(s->zpipe->efd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("[sender]: read zpipe eventfd");
+        finish(s, 1);
+        return;
+    }
+    send_more(s);
+    if (s->ring != NULL && uring_submit(s->ring) == -1) {
+        finish(s, 1);
+    }
+}
+
+// The producer thread has frames ready again
+static void on_frames(struct event_loop *loop, void *ctx, uint32_t events)
+{
+    struct sender *s = ctx;
+    uint64_t count;
+    if (read(s->frames.cons->efd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("[sender]: read frames eventfd");
+        finish(s, 1);
+        return;
+    }
+    send_more(s);
+    if (s->ring != NULL && uring_submit(s->ring) == -1) {
+        finish(s, 1);
+    }
+}
+
+// The pacer lets the next packet go
+static void on_pace(struct event_loop *loop, void *ctx)
+{
+    struct sender *s = ctx;
+    s->paced = false;
+    send_more(s);
+    if (s->ring != NULL && uring_submit(s->ring) == -1) {
+        finish(s, 1);
+    }
+}
+
+// The socket is readable (ACKs queued) and/or writable again
+static void on_socket(struct event_loop *loop, void *ctx, uint32_t events)
+{
+    struct sender *s = ctx;
+    if (events & EPOLLOUT) {
+        set_blocked(s, false);
+    }
+    if (events & (EPOLLIN | EPOLLERR)) {
+        struct ack_t ack;
+        // Datagrams that aren't ACKs of our protocol version are skipped
+        while (s->phase != PHASE_DONE) {
+            if (recv_ack(&ack, s->sock, &s->addr, &s->pool) == 0) {
+                accept_ack(s, &ack);
+            } else if (errno != EPROTO) {
+                break;
+            }
+        }
+        // ICMP errors (e.g. nobody listening yet) surface here as
+        // ECONNREFUSED; the retransmission timer takes care of them
+        if (s->phase != PHASE_DONE && errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED) {
+            perror("[sender]: recv_ack");
+            finish(s, 1);
+            return;
+        }
+    }
+    send_more(s);
+}
+
+// io_uring backend: ACKs and send completions are waiting on the ring
+static void on_ring(struct event_loop *loop, void *ctx, uint32_t events)
+{
+    struct sender *s = ctx;
+    struct ack_t ack;
+    while (s->phase != PHASE_DONE && recv_ack_uring(s->ring, &ack) != -1) {
+        accept_ack(s, &ack);
+    }
+    if (s->phase == PHASE_DONE) {
+        return;
+    }
+    if (errno != EAGAIN) {
+        perror("[sender]: recv_ack_uring");
+        finish(s, 1);
+        return;
+    }
+    if (s->ring->nfree > 0) {
+        set_blocked(s, false);
+    }
+    send_more(s);
+    if (uring_submit(s->ring) == -1) {
+        finish(s, 1);
+    }
+}
+
+// The retransmission timer expired. Go back N: resend the packets from base
+// to nextseqnum - 1 (only the unSACKed ones in selective repeat mode) and
+// back off the timer.
+static void on_timeout(struct event_loop *loop, void *ctx)
+{
+    struct sender *s = ctx;
+    rtt_backoff(&s->rtt);
+    if (s->phase == PHASE_TEARDOWN) {
+        send_teardown(s);
+        return;
+    }
+    if (s->base == s->nextseqnum) {
+        return;
+    }
+
+    // Record retransmissions
+    s->retransmissions++;
+    metrics_add(&s->metrics->timeouts, 1);
+    TRACE(s->trace, TRACE_TIMEOUT, s->base, 0);
+    s->dupacks = 0;
+    s->recover = s->nextseqnum - 1;
+    cc_on_timeout(&s->cc, s->nextseqnum - s->base);
+    if (s->retransmissions > MAX_RETRANSMISSIONS) {
+        fprintf(stderr, "[failure]: retried %d times, could not send packets\n", MAX_RETRANSMISSIONS);
+        finish(s, 1);
+        return;
+    }
+    if (queue_resend(s, s->nextseqnum, 0, true) == -1) {
+        fprintf(stderr, "[sender]: failed to resend packets %" PRId64 "-%" PRId64 "\n", s->base,
+                s->nextseqnum - 1);
+    }
+    restart_timer(s);
+}
+
+// Sets up one stripe (the whole transfer when not striping) to send
+// [data, data + len) on its own socket and event loop
+static int init_sender(struct sender *s, int sock, const char *data, size_t len,
+        const struct impair_config *impair, struct workq *compressors, int index)
+{
+    s->sock = sock;
+    s->recover = -1;
+    s->bufptr = data;
+    s->bufend = data + len;
+    s->prod_ptr = data;
+    s->phase = PHASE_DATA;
+    s->status = 1;
+
+    // io_uring does its own waiting for socket space, so the socket stays
+    // blocking; without a usable ring it falls back to plain socket calls
+    if (s->ring != NULL && uring_init(s->ring) == -1) {
+        fprintf(stderr, "[sender]: io_uring unavailable, using plain socket calls\n");
+        free(s->ring);
+        s->ring = NULL;
+    }
+    if (s->ring == NULL && set_nonblocking(s->sock) == -1) {
+        return -1;
+    }
+    if (s->gso && !gso_supported(s->sock)) {
+        fprintf(stderr, "[sender]: kernel lacks UDP_SEGMENT, sending plain datagrams\n");
+        s->gso = false;
+    }
+
+    // Departure times only go with plain datagrams
+    if (s->pacer.txtime && (s->ring != NULL || s->gso || enable_txtime(s->sock) == -1)) {
+        fprintf(stderr, "[sender]: can't use SO_TXTIME, pacing with timers\n");
+        s->pacer.txtime = false;
+    }
+
+    // Each stripe emulates its own ACK path, with its own RNG stream
+    if (impair_init(&s->impair, impair, sizeof(struct ack_t), index) == -1) {
+        return -1;
+    }
+
+    // Until the first RTT sample the timeout is TIMEOUT_SEC
+    rtt_init(&s->rtt);
+
+    s->sentpkts = malloc(s->window_size * sizeof(struct chunk_t));
+    s->sent_at = malloc(s->window_size * sizeof(uint64_t));
+    s->resent = malloc(s->window_size * sizeof(bool));
+    s->sacked = malloc(s->window_size * sizeof(bool));
+    if (s->sentpkts == NULL || s->sent_at == NULL || s->resent == NULL || s->sacked == NULL) {
+        fprintf(stderr, "[sender]: couldn't allocate window\n");
+        return -1;
+    }
+
+    // A group's parity is referenced until the window moves past the
+    // group, and the producer runs at most a ring ahead of the window, so
+    // one slot per group in the two, plus the one being filled and one being
+    // sent, are enough
+    if (s->fec_k > 0) {
+        s->fec_ngroups = (s->window_size + SEND_FRAMES) / s->fec_k + 2;
+        s->fec = malloc(s->fec_ngroups * sizeof(struct fec_group));
+        if (s->fec == NULL) {
+            fprintf(stderr, "[sender]: couldn't allocate FEC groups\n");
+            return -1;
+        }
+    }
+
+    if (spsc_init(&s->frames, SEND_FRAMES, sizeof(struct chunk_t)) == -1) {
+        return -1;
+    }
+
+    // Frames for serializing control packets and receiving ACKs. Data
+    // payloads go out of the source directly and need no frames.
+    if (pool_init(&s->pool, (s->window_size < MAXBATCH ? s->window_size : MAXBATCH) + 1, FRAMESIZE) == -1) {
+        fprintf(stderr, "[sender]: couldn't create frame pool\n");
+        return -1;
+    }
+
+    if (event_init(&s->loop) == -1
+            || event_add_timer(&s->loop, &s->rto_timer, on_timeout, s) == -1
+            || event_add_timer(&s->loop, &s->impair_timer, on_impair, s) == -1
+            || event_add_timer(&s->loop, &s->pace_timer, on_pace, s) == -1) {
+        fprintf(stderr, "[sender]: couldn't set up event loop\n");
+        return -1;
+    }
+    if (s->ring != NULL) {
+        if (event_add(&s->loop, s->ring->fd, EPOLLIN, on_ring, s) == -1
+                || uring_arm_recv(s->ring, s->sock) == -1
+                || uring_submit(s->ring) == -1) {
+            fprintf(stderr, "[sender]: couldn't set up io_uring\n");
+            return -1;
+        }
+    } else if (event_add(&s->loop, s->sock, EPOLLIN, on_socket, s) == -1) {
+        fprintf(stderr, "[sender]: couldn't set up event loop\n");
+        return -1;
+    }
+    if (s->pipelined && event_add(&s->loop, s->frames.cons->efd, EPOLLIN, on_frames, s) == -1) {
+        fprintf(stderr, "[sender]: couldn't set up event loop\n");
+        return -1;
+    }
+
+    // Start compressing the first window's worth of blocks. A producer
+    // thread waits for them itself.
+    if (compressors != NULL) {
+        s->zpipe = malloc(sizeof(struct zpipe));
+        if (s->zpipe == NULL || zpipe_init(s->zpipe, compressors, data, len, s->chunk_size, s->window_size) == -1) {
+            fprintf(stderr, "[sender]: couldn't set up compression\n");
+            free(s->zpipe);
+            s->zpipe = NULL;
+            return -1;
+        }
+        if (!s->pipelined && event_add(&s->loop, s->zpipe->efd, EPOLLIN, on_zpipe, s) == -1) {
+            fprintf(stderr, "[sender]: couldn't set up event loop\n");
+            return -1;
+        }
+        zpipe_feed(s->zpipe, 0);
+    }
+    return 0;
+}
+
+static void *run_sender(void *arg)
+{
+    struct sender *s = arg;
+    if (s->pipelined && start_thread(&s->producer, run_producer, s, s->producer_cpu) == -1) {
+        s->status = 1;
+        return NULL;
+    }
+
+    // Fill the window and let the loop take it from there
+    send_more(s);
+    if (s->phase != PHASE_DONE && event_run(&s->loop) == -1) {
+        s->status = 1;
+    }
+    if (s->pipelined) {
+        atomic_store(&s->stopping, true);
+        spsc_kick(s->frames.prod->efd);
+        pthread_join(s->producer, NULL);
+    }
+    return NULL;
+}
+
+static void destroy_sender(struct sender *s)
+{
+    event_destroy(&s->loop);
+    pool_destroy(&s->pool);
+    free(s->sentpkts);
+    free(s->sent_at);
+    free(s->resent);
+    free(s->sacked);
+    free(s->fec);
+    spsc_destroy(&s->frames);
+    impair_destroy(&s->impair);
+    if (s->zpipe != NULL) {
+        zpipe_destroy(s->zpipe);
+        free(s->zpipe);
+    }
+    if (s->ring != NULL) {
+        uring_destroy(s->ring);
+        free(s->ring);
+    }
+    close(s->sock);
+}
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len)
+{
+    const uint8_t *p = data;
+    for (size_t i = 0; i < len; ++i) {
+        h = (h ^ p[i]) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+// Names the data for -R, the same on every run: an FNV-1a hash of its
+// length, the file's modification time and its first and last chunks.
+// Hashing all of it would mean reading a multi-GB file before the first
+// packet goes out; a file changed since the last run has a new mtime.
+static uint64_t transfer_key(const struct source *src, int32_t chunk_size)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    uint64_t len = src->len;
+    size_t head = src->len < (size_t) chunk_size ? src->len : (size_t) chunk_size;
+    h = fnv1a(h, &len, sizeof(len));
+    h = fnv1a(h, &src->mtime_ns, sizeof(src->mtime_ns));
+    h = fnv1a(h, src->data, head);
+    h = fnv1a(h, src->data + src->len - head, head);
+    return h;
+}
+
+// Resume handshake (-R), before any data: asks the receiver how much of the
+// transfer its output already holds. The request is resent every
+// TIMEOUT_SEC until the resume ACK arrives, at most MAX_RETRANSMISSIONS
+// times. Returns the byte offset to resume from, or -1.
+static int64_t resume_handshake(int sock, struct sockaddr *addr, const struct resume_t *req)
+{
+    struct frame_pool pool;
+    if (pool_init(&pool, 1, FRAMESIZE) == -1) {
+        fprintf(stderr, "[sender]: couldn't create frame pool\n");
+        return -1;
+    }
+    uint8_t payload[RESUMESIZE];
+    struct packet_t pkt;
+    serialize_resume(payload, req);
+    make_packet(&pkt, RESUME_TYPE, 0, RESUMESIZE, (char *) payload);
+    pkt.type = RESUME_TYPE;
+    int64_t offset = -1;
+    if (set_timeout(sock, TIMEOUT_SEC) == -1) {
+        pool_destroy(&pool);
+        return -1;
+    }
+    for (int tries = 0; tries < MAX_RETRANSMISSIONS && offset == -1; ++tries) {
+        // Nobody listening yet shows up as ECONNREFUSED, here or on the
+        // receive; both just mean trying again
+        if (send_packet(&pkt, sock, addr, &pool) == -1 && errno != ECONNREFUSED) {
+            fprintf(stderr, "[sender]: couldn't send resume request\n");
+            break;
+        }
+        struct ack_t ack;
+        while (offset == -1) {
+            if (recv_ack(&ack, sock, addr, &pool) == 0) {
+                if (ack.type == RESUME_ACK_TYPE) {
+                    offset = (int64_t) ack.sack;
+                }
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            } else if (errno != EPROTO && errno != ECONNREFUSED && errno != EINTR) {
+                perror("[sender]: recv_ack");
+                tries = MAX_RETRANSMISSIONS;
+                break;
+            }
+        }
+    }
+    if (offset == -1) {
+        fprintf(stderr, "[sender]: no resume ACK after %d tries\n", MAX_RETRANSMISSIONS);
+    }
+    disable_timeout(sock);
+    pool_destroy(&pool);
+    return offset;
+}
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "    %s [options] server_IP server_port chunk_size window_size\n", prog);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -m gbn|sr    go-back-N (default) or selective repeat; with sr, window_size is at\n");
+    fprintf(stderr, "                 most %d, the receiver's reorder window plus the gap\n", SR_MAX_WINDOW);
+    fprintf(stderr, "    -d dupacks   duplicate ACKs that trigger a fast retransmit (default %d, 0 = off)\n",
+            DUPACK_THRESHOLD);
+    fprintf(stderr, "    -c algo      congestion control: fixed (default), reno or delay\n");
+    fprintf(stderr, "    -C file      log the congestion window over time to file as CSV\n");
+    fprintf(stderr, "    -f file      send this file instead of the built-in buffer\n");
+    fprintf(stderr, "    -G           send runs of packets as UDP GSO messages\n");
+    fprintf(stderr, "    -U           use io_uring instead of socket calls (no GSO)\n");
+    fprintf(stderr, "    -s stripes   split the data into this many byte ranges, each sent on its own\n");
+    fprintf(stderr, "                 socket and thread with its own window (default 1)\n");
+    fprintf(stderr, "    -p rate      pace sends at rate Mbit/s (split between stripes), or 'auto'\n");
+    fprintf(stderr, "                 to pace at %.2f times the estimated bottleneck bandwidth\n", PACE_GAIN);
+    fprintf(stderr, "    -x           with -p, have the kernel release packets at their departure\n");
+    fprintf(stderr, "                 times (SO_TXTIME; needs the fq qdisc, no -G or -U)\n");
+    fprintf(stderr, "    -z threads   compress each packet's data (LZ4 block format) on this many\n");
+    fprintf(stderr, "                 threads, shared by all stripes\n");
+    fprintf(stderr, "    -F group     send an XOR parity packet after every group of this many new\n");
+    fprintf(stderr, "                 packets (1-%d), so the receiver can rebuild one lost packet\n",
+            FEC_MAX_GROUP);
+    fprintf(stderr, "                 per group without a retransmission\n");
+    fprintf(stderr, "    -w           build packets on a producer thread of each stripe's own, ahead\n");
+    fprintf(stderr, "                 of the thread that sends them and handles ACKs\n");
+    fprintf(stderr, "    -k cpus      pin the threads to these CPUs in turn, e.g. 0,2,4-7 (with -w,\n");
+    fprintf(stderr, "                 each stripe's network thread, then its producer)\n");
+    fprintf(stderr, "    -R           resume: ask the receiver how much of this data it already has\n");
+    fprintf(stderr, "                 and send only the rest (no -s)\n");
+    fprintf(stderr, "    -M file      dump metrics (counters, RTT and window histograms) to file as\n");
+    fprintf(stderr, "                 JSON every -P seconds (default %d) and at exit\n", METRICS_PERIOD_SEC);
+    fprintf(stderr, "    -P seconds   metrics dump period\n");
+    fprintf(stderr, "    -T file      record a binary trace of every packet and ACK to file\n");
+    fprintf(stderr, "                 (decode it with tracedump)\n");
+    fprintf(stderr, "    -I spec      impair arriving ACKs, e.g. loss=0.01,delay=20,jitter=5\n");
+    fprintf(stderr, "                 (keys: loss ge delay jitter reorder dup rate limit seed)\n");
+    exit(1);
+}
 
 int main(int argc, char **argv)
 {
     // Verify and parse args
-    if (argc < 4) {
-        fprintf(stderr, "Usage:\n");
-        fprintf(stderr, "    %s server_IP server_port chunk_size window_size\n", argv[0]);
+    enum arq_mode mode = MODE_GBN;
+    int dupack_threshold = DUPACK_THRESHOLD;
+    char *cc_name = "fixed";
+    char *cwnd_log = NULL;
+    char *input_path = NULL;
+    int nstripes = 1;
+    bool gso = false;
+    bool use_uring = false;
+    struct impair_config impair;
+    impair_defaults(&impair);
+    char *metrics_path = NULL;
+    long metrics_period = METRICS_PERIOD_SEC;
+    char *trace_path = NULL;
+    char *pace_spec = NULL;
+    double pace_mbit = 0.0;
+    bool pace_auto = false;
+    bool txtime = false;
+    int compress_threads = 0;
+    int fec_k = 0;
+    bool resume = false;
+    bool pipelined = false;
+    int cpus[MAX_CPUS];
+    int ncpus = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:d:c:C:f:s:p:z:F:k:I:M:P:T:GURwx")) != -1) {
+        switch (opt) {
+        case 'w':
+            pipelined = true;
+            break;
+        case 'k':
+            ncpus = parse_cpus(optarg, cpus, MAX_CPUS);
+            if (ncpus == -1) {
+                exit(1);
+            }
+            break;
+        case 'R':
+            resume = true;
+            break;
+        case 'F':
+            fec_k = (int) strtol(optarg, NULL, 10);
+            if (fec_k < 1 || fec_k > FEC_MAX_GROUP) {
+                fprintf(stderr, "[error]: FEC group must be between 1 and %d packets\n", FEC_MAX_GROUP);
+                exit(1);
+            }
+            break;
+        case 'p':
+            if (pace_parse(optarg, &pace_mbit, &pace_auto) == -1) {
+                exit(1);
+            }
+            pace_spec = optarg;
+            break;
+        case 'x':
+            txtime = true;
+            break;
+        case 'z':
+            compress_threads = (int) strtol(optarg, NULL, 10);
+            if (compress_threads < 1 || compress_threads > MAX_WORK_THREADS) {
+                fprintf(stderr, "[error]: compression threads must be between 1 and %d\n", MAX_WORK_THREADS);
+                exit(1);
+            }
+            break;
+        case 'T':
+            trace_path = optarg;
+            break;
+        case 'M':
+            metrics_path = optarg;
+            break;
+        case 'P':
+            metrics_period = strtol(optarg, NULL, 10);
+            if (metrics_period < 1) {
+                fprintf(stderr, "[error]: metrics period must be at least 1 second\n");
+                exit(1);
+            }
+            break;
+        case 'I':
+            if (impair_parse(optarg, &impair) == -1) {
+                exit(1);
+            }
+            break;
+        case 'U':
+            use_uring = true;
+            break;
+        case 'G':
+            gso = true;
+            break;
+        case 's':
+            nstripes = (int) strtol(optarg, NULL, 10);
+            if (nstripes < 1 || nstripes > MAX_STRIPES) {
+                fprintf(stderr, "[error]: stripes must be between 1 and %d\n", MAX_STRIPES);
+                exit(1);
+            }
+            break;
+        case 'f':
+            input_path = optarg;
+            break;
+        case 'c':
+            cc_name = optarg;
+            break;
+        case 'C':
+            cwnd_log = optarg;
+            break;
+        case 'd':
+            dupack_threshold = (int) strtol(optarg, NULL, 10);
+            if (dupack_threshold < 0) {
+                fprintf(stderr, "[error]: dupacks must not be negative\n");
+                exit(1);
+            }
+            break;
+        case 'm':
+            if (parse_mode(optarg, &mode) == -1) {
+                exit(1);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind < 4) {
+        usage(argv[0]);
+    }
+
+    // Stripes would each need an offset of their own
+    if (resume && nstripes > 1) {
+        fprintf(stderr, "[error]: -R can't be combined with -s\n");
         exit(1);
     }
+    argv += optind - 1;
     char *serverip = argv[1];
     long int x = strtol(argv[2], NULL, 10);
     if (x < 0 || x > USHRT_MAX) {
@@ -33,193 +1289,250 @@ int main(int argc, char **argv)
         exit(1);
     }
     int32_t chunk_size = (int32_t) c;
+
+    // A parity packet carries its own header on top of a full chunk
+    if (fec_k > 0 && chunk_size > MAXBUFSIZE - FEC_HDRSIZE) {
+        fprintf(stderr, "[error]: with -F, chunk_size can be at most %d\n", MAXBUFSIZE - FEC_HDRSIZE);
+        exit(1);
+    }
     long int w = strtol(argv[4], NULL, 10);
+    if (w < 1 || w > INT_MAX / 2) {
+        fprintf(stderr, "[error]: window_size %ld is invalid\n", w);
+        exit(1);
+    }
     int32_t window_size = (int32_t) w;
 
+    // The receiver holds SACK_BITS packets past a gap and drops the rest, so
+    // a bigger selective repeat window would resend all of it on every loss
+    if (mode == MODE_SR && window_size > SR_MAX_WINDOW) {
+        fprintf(stderr, "[warning]: window_size %d is more than selective repeat can use, using %d\n",
+                window_size, SR_MAX_WINDOW);
+        window_size = SR_MAX_WINDOW;
+    }
+
     printf("server_IP   = %s\n", serverip);
     printf("server_port = %s\n", server_port);
     printf("chunk_size  = %d\n", chunk_size);
     printf("window_size = %d\n", window_size);
-
-    // Get network information
-    struct sockaddr addr;
-    int sock;
-    if (get_addr_sock(&addr, &sock, serverip, server_port) == -1) {
-        fprintf(stderr, "[sender]: couldn't get socket or addrinfo\n");
-        exit(1);
+    printf("mode        = %s\n", mode == MODE_SR ? "sr" : "gbn");
+    printf("cc          = %s\n", cc_name);
+    if (pace_spec != NULL) {
+        printf("pacing      = %s%s\n", pace_spec, pace_auto ? "" : " Mbit/s");
+    }
+    if (compress_threads > 0) {
+        printf("compression = %d threads\n", compress_threads);
+    }
+    if (fec_k > 0) {
+        printf("fec         = 1 parity per %d packets\n", fec_k);
+    }
+    if (pipelined) {
+        printf("pipeline    = producer thread per stripe\n");
     }
 
-    // Set initial timeout
-    if (set_timeout(sock, TIMEOUT_SEC) == -1) {
+    FILE *log = NULL;
+    if (cwnd_log != NULL && (log = fopen(cwnd_log, "w")) == NULL) {
+        perror("[sender]: fopen cwnd log");
         exit(1);
     }
 
-    // Variables controlling window size. bufptr is the pointer to the start
-    // of where to pull data from g_buffer
-    char *bufptr = g_buffer;
-    int32_t base = 0;
-    int32_t nextseqnum = 0;
-    int32_t num_packets = (int32_t) ceil((strlen(g_buffer) + 1) / chunk_size);
-    int32_t last_ack = 0;
-    int32_t retransmissions = 0;
-    int32_t timedout = false;
-    struct packet_t *sentpkts = malloc(window_size * sizeof(struct packet_t));
-
-    // Send out window_size packets initially
-    for (int i = 0; i < window_size; ++i) {
-        // Make a new packet
-        int init_pktlen = chunk_size;
-        struct packet_t pkt;
-        int ret = make_packet(&pkt, 1, nextseqnum, init_pktlen, bufptr);
-        if (ret == -1) {
-            fprintf(stderr, "[sender]: couldn't make packet %d\n", nextseqnum);
-            goto cleanup_and_exit;
-        }
-
-        // If succesfully sent, cache the packet in the array of packets which
-        // represents our window.
-        if (send_packet(&pkt, sock, &addr) == -1) {
-            fprintf(stderr, "[sender]: couldn't send packet %d\n", nextseqnum);
-            goto cleanup_and_exit;
-        }
-        printf("SEND PACKET %d\n", pkt.seq_no);
-        sentpkts[nextseqnum % window_size] = pkt;
-        nextseqnum++;
-        bufptr += chunk_size;
-    }
-
-    // Main loop for sender activity
-    while (*bufptr != '\0') {
-        // If there was a timeout, resend the packets from base to nextseqnum - 1
-        if (timedout) {
-            for (int i = base; i < nextseqnum; ++i) {
-                struct packet_t oldpkt = sentpkts[i % window_size];
-                if (send_packet(&oldpkt, sock, &addr) == -1) {
-                    fprintf(stderr, "[sender]: failed to resend packet %d\n", oldpkt.seq_no);
-                    break;
-                }
-                printf("SEND PACKET %d\n", oldpkt.seq_no);
-            }
+    // Without -f the compiled-in g_buffer is sent, including its terminator
+    struct source src;
+    if (input_path != NULL) {
+        if (source_open_file(&src, input_path) == -1) {
+            exit(1);
+        }
+    } else {
+        source_open_buffer(&src, g_buffer, strlen(g_buffer) + 1);
+    }
+    printf("input_size  = %zu\n", src.len);
 
-            // Reset state variables and record retransmissions
-            timedout = false;
-            retransmissions++;
-            if (retransmissions > 10) {
-                fprintf(stderr, "[failure]: retried 10 times, could not send packets\n");
-                goto cleanup_and_exit;
-            }
+    // Stripes are whole numbers of chunks, so only the last one ends in a
+    // short packet. Small inputs get fewer stripes than asked for.
+    size_t nchunks = (src.len + chunk_size - 1) / chunk_size;
+    if (nchunks < (size_t) nstripes) {
+        nstripes = nchunks > 0 ? (int) nchunks : 1;
+    }
+    size_t stripe_chunks = (nchunks + nstripes - 1) / nstripes;
+    if (stripe_chunks > 0) {
+        nstripes = (int) ((nchunks + stripe_chunks - 1) / stripe_chunks);
+    }
+    size_t stripe_len = stripe_chunks * chunk_size;
+    uint64_t transfer_id = 0;
+    if (nstripes > 1) {
+        if (getrandom(&transfer_id, sizeof(transfer_id), 0) != sizeof(transfer_id)) {
+            transfer_id = now_usec() ^ ((uint64_t) getpid() << 32);
         }
+        printf("stripes     = %d\n", nstripes);
+        printf("transfer_id = %016" PRIx64 "\n", transfer_id);
+    }
 
-        // Can send a new packet because there's room in the window. Make a new packet
-        // and send it.
-        else if (nextseqnum < base + window_size) {
-            retransmissions = 0;
-            // Size the packet. If this is the last packet, it could potentially be smaller
-            size_t pktlen = chunk_size;
-            if (strlen(bufptr) < chunk_size) {
-                pktlen = strlen(bufptr) + 1;
-            }
+    // Get network information: one socket per stripe, so each stripe is a
+    // separate peer (and session) to the receiver
+    int socks[MAX_STRIPES];
+    struct sockaddr addr;
+    if (get_addr_socks(&addr, socks, nstripes, serverip, server_port) == -1) {
+        fprintf(stderr, "[sender]: couldn't get socket or addrinfo\n");
+        exit(1);
+    }
 
-            // Make a new packet
-            struct packet_t pkt;
-            int ret = make_packet(&pkt, 1, nextseqnum, pktlen, bufptr);
-            if (ret == -1) {
-                fprintf(stderr, "[sender]: couldn't make packet %d\n", nextseqnum);
-                break;
-            }
+    // A resumed transfer sends the data from the receiver's offset on, as
+    // if that were all there is
+    size_t resume_offset = 0;
+    if (resume) {
+        struct resume_t req = {transfer_key(&src, chunk_size), src.len, (uint32_t) chunk_size};
+        int64_t offset = resume_handshake(socks[0], &addr, &req);
+        if (offset == -1) {
+            exit(1);
+        }
+        if ((uint64_t) offset > src.len || (offset % chunk_size != 0 && (uint64_t) offset != src.len)) {
+            fprintf(stderr, "[sender]: receiver sent a bad resume offset %" PRId64 "\n", offset);
+            exit(1);
+        }
+        resume_offset = (size_t) offset;
+        printf("resume_key  = %016" PRIx64 "\n", req.key);
+        printf("resume_from = %zu\n", resume_offset);
+    }
 
-            // If succesfully sent, cache the packet in the array of packets which
-            // represents our window.
-            if (send_packet(&pkt, sock, &addr) == -1) {
-                fprintf(stderr, "[sender]: couldn't send packet %d\n", nextseqnum);
-                break;
-            }
-            printf("SEND PACKET %d\n", pkt.seq_no);
-            sentpkts[nextseqnum % window_size] = pkt;
+    struct sender *senders = calloc(nstripes, sizeof(struct sender));
+    struct metrics *metrics = malloc(sizeof(struct metrics));
+    if (senders == NULL || metrics == NULL) {
+        fprintf(stderr, "[sender]: couldn't allocate stripes\n");
+        exit(1);
+    }
+    struct trace trace;
+    if (trace_path != NULL && trace_open(&trace, trace_path) == -1) {
+        exit(1);
+    }
 
-            // Increment bufptr so that it points to the start of the next data to send
-            bufptr += pktlen;
+    // One pool of compression threads for all stripes, with queue room for
+    // every block slot so submitting never waits
+    struct workq compressors;
+    if (compress_threads > 0
+            && workq_init(&compressors, compress_threads, nstripes * (window_size + ZPIPE_AHEAD)) == -1) {
+        exit(1);
+    }
 
-            // If our base is the same as nextseqnum, we need to arm the timer
-            if (base == nextseqnum) {
-                if (set_timeout(sock, TIMEOUT_SEC) == -1) {
-                    fprintf(stderr, "[sender]: couldn't set timeout\n");
-                    goto cleanup_and_exit;
-                }
-            }
-            nextseqnum++;
+    // What the stripes send between them: all of the file, less what a
+    // resume skipped
+    size_t bytes_sent = 0;
+    for (int i = 0; i < nstripes; ++i) {
+        struct sender *s = &senders[i];
+        s->addr = addr;
+        s->chunk_size = chunk_size;
+        s->window_size = window_size;
+        s->mode = mode;
+        s->dupack_threshold = dupack_threshold;
+        s->fec_k = fec_k;
+        s->pipelined = pipelined;
+        s->cpu = -1;
+        s->producer_cpu = -1;
+        if (ncpus > 0 && pipelined) {
+            s->cpu = cpus[(2 * i) % ncpus];
+            s->producer_cpu = cpus[(2 * i + 1) % ncpus];
+        } else if (ncpus > 0) {
+            s->cpu = cpus[i % ncpus];
         }
-
-        // Receive an ACK and check if we can stop the timer. Update base and
-        // nextseqnum accordingly
-        struct ack_t ack;
-        if (recv_ack(&ack, sock, &addr) != -1) {
-            base = ack.ack_no + 1;
-            last_ack = ack.ack_no;
-
-            // If we've reached the nextseqnum, there are no outstanding packets
-            // so disable timer
-            if (base == nextseqnum) {
-                if (disable_timeout(sock) == -1) {
-                    goto cleanup_and_exit;
-                }
-            }
-            printf("--------RECEIVED ACK %d\n", ack.ack_no + 1);
-        } else {
-            if (errno == EAGAIN) {
-                timedout = true;
-            } else {
-                fprintf(stderr, "[sender]: couldn't receive ACK\n");
-                goto cleanup_and_exit;
-            }
+        s->metrics = metrics;
+        if (trace_path != NULL && (s->trace = trace_add_ring(&trace)) == NULL) {
+            exit(1);
+        }
+        s->gso = gso;
+        pacer_init(&s->pacer, pace_mbit / nstripes, pace_auto, HEADERSIZE + chunk_size);
+        s->pacer.txtime = txtime && pace_spec != NULL;
+        if (use_uring && (s->ring = malloc(sizeof(struct uring))) == NULL) {
+            fprintf(stderr, "[sender]: couldn't allocate io_uring\n");
+            exit(1);
         }
-    }
 
-    // Need to wait to see if we got all ACKs
-    while (last_ack < num_packets) {
-        struct ack_t ack;
-        if (recv_ack(&ack, sock, &addr) == -1) {
-            fprintf(stderr, "[sender]: couldn't receive remaining ACKs\n");
-            goto cleanup_and_exit;
+        // Only the first stripe logs its congestion window
+        if (cc_init(&s->cc, cc_name, window_size, i == 0 ? log : NULL) == -1) {
+            exit(1);
+        }
+        size_t offset = resume_offset + i * stripe_len;
+        size_t len = src.len - offset < stripe_len ? src.len - offset : stripe_len;
+        bytes_sent += len;
+        if (nstripes > 1) {
+            struct stripe_t stripe = {transfer_id, offset, src.len, i, nstripes};
+            serialize_stripe(s->stripe_hdr, &stripe);
+            s->striped = true;
+        }
+        if (init_sender(s, socks[i], src.data + offset, len, &impair,
+                    compress_threads > 0 ? &compressors : NULL, i) == -1) {
+            exit(1);
         }
-        printf("--------RECEIVED ACK %d\n\n", ack.ack_no);
-        last_ack = ack.ack_no;
     }
 
-    // After sending all packets and receiving all ACKs, construct tear-down
-    // message (type=8 and len=0)
-    struct packet_t tear_down_pkt;
-    printf("Sending tear-down packet\n");
-    if (make_packet(&tear_down_pkt, 4, 0, 0, NULL) == -1) {
-        fprintf(stderr, "[sender]: couldn't construct tear-down packet\n");
-        goto cleanup_and_exit;
+    // Every stripe runs its own event loop on its own thread. The metrics
+    // thread comes first, so the stripes inherit its signal mask.
+    metrics_init(metrics, "sender");
+    if (metrics_start(metrics, metrics_path, metrics_period) == -1
+            || (trace_path != NULL && trace_start(&trace) == -1)) {
+        exit(1);
     }
-
-    // Set timeout on socket (just to make sure it's still set for the
-    // final transmissions)
-    if (set_timeout(sock, TIMEOUT_SEC) == -1) {
-        goto cleanup_and_exit;
+    uint64_t start = now_usec();
+    for (int i = 0; i < nstripes; ++i) {
+        if (start_thread(&senders[i].thread, run_sender, &senders[i], senders[i].cpu) == -1) {
+            fprintf(stderr, "[sender]: couldn't start stripe %d\n", i);
+            exit(1);
+        }
     }
-    
-    // Retransmit this packet 10 times, unless it gets an ACK of type=8
-    for (int i = 0; i < 10; ++i) {
-        if (send_packet(&tear_down_pkt, sock, &addr) == -1) {
-            fprintf(stderr, "[sender]: couldn't send tear-down packet\n");
-            goto cleanup_and_exit;
+    int status = 0;
+    unsigned long heap_allocs = 0;
+    unsigned long acks_dropped = 0, acks_duplicated = 0;
+    unsigned long blocks = 0, compressed = 0, raw_bytes = 0, compressed_bytes = 0;
+    for (int i = 0; i < nstripes; ++i) {
+        pthread_join(senders[i].thread, NULL);
+        if (senders[i].status != 0) {
+            status = senders[i].status;
         }
-        printf("SEND TEAR-DOWN PACKET\n");
-        struct ack_t tear_down_ack;
-        if (recv_ack(&tear_down_ack, sock, &addr) == -1) {
-            fprintf(stderr, "[sender]: couldn't receive tear-down ack\n");
-            goto cleanup_and_exit;
+        heap_allocs += senders[i].pool.heap_allocs;
+        acks_dropped += senders[i].impair.dropped + senders[i].impair.overflowed;
+        acks_duplicated += senders[i].impair.duplicated;
+        if (senders[i].zpipe != NULL) {
+            struct zpipe *z = senders[i].zpipe;
+            blocks += z->nblocks;
+            compressed += atomic_load(&z->compressed);
+            raw_bytes += atomic_load(&z->bytes_in);
+            compressed_bytes += atomic_load(&z->bytes_out);
         }
-        printf("-------- RECEIVED TEAR-DOWN ACK\n");
-        if (tear_down_ack.type == 8) {
-            break;
+        destroy_sender(&senders[i]);
+    }
+    uint64_t elapsed = now_usec() - start;
+    if (compress_threads > 0) {
+        workq_destroy(&compressors);
+    }
+    metrics_stop(metrics);
+    if (trace_path != NULL) {
+        unsigned long trace_dropped = trace_close(&trace);
+        if (trace_dropped > 0) {
+            fprintf(stderr, "[sender]: trace dropped %lu records\n", trace_dropped);
         }
     }
 
-    cleanup_and_exit:
-        free(sentpkts);
-        exit(1);
+    printf("fast retransmits: %lu\n", metrics_get(&metrics->fast_retransmits));
+    printf("timeout retransmits: %lu\n", metrics_get(&metrics->timeouts));
+    printf("heap allocations after startup: %lu\n", heap_allocs);
+    printf("packets sent: %lu\n", metrics_get(&metrics->packets_sent));
+    printf("packets resent: %lu\n", metrics_get(&metrics->packets_retransmitted));
+    if (fec_k > 0) {
+        printf("parity packets sent: %lu\n", metrics_get(&metrics->parity_sent));
+    }
+    if (senders[0].impair.active) {
+        printf("impaired: %lu ACKs lost, %lu duplicated\n", acks_dropped, acks_duplicated);
+    }
+    if (compress_threads > 0) {
+        printf("compressed: %lu of %lu blocks, %lu -> %lu bytes\n", compressed, blocks, raw_bytes,
+                compressed_bytes);
+    }
+    printf("bytes sent: %zu\n", bytes_sent);
+    printf("wire bytes sent: %lu\n", metrics_get(&metrics->wire_bytes_sent));
+    printf("transfer time usec: %" PRIu64 "\n", elapsed);
+    printf("cpu time usec: %" PRIu64 "\n", cpu_usec());
+    free(senders);
+    free(metrics);
+    if (log != NULL) {
+        fclose(log);
+    }
+    source_close(&src);
+    return status;
 }
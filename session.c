@@ -0,0 +1,493 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include "session.h"
+#include "data.h"
+
+
+// Formats a peer address as ip:port
+void session_name(struct sockaddr *peer, char *buf, size_t len)
+{
+    struct sockaddr_in *in = (struct sockaddr_in *) peer;
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &in->sin_addr, ip, sizeof(ip));
+    snprintf(buf, len, "%s:%u", ip, ntohs(in->sin_port));
+}
+
+bool session_match(struct session *ss, struct sockaddr *peer)
+{
+    struct sockaddr_in *a = (struct sockaddr_in *) &ss->peer;
+    struct sockaddr_in *b = (struct sockaddr_in *) peer;
+    return a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr;
+}
+
+// Sets up a session for a new peer. Data goes to a file named after
+// output_path when it is not NULL, otherwise to a buffer the size of
+// g_buffer. With exact_path the file is output_path itself; otherwise the
+// peer address (or transfer id of a striped transfer) is appended.
+struct session *session_create(struct sockaddr *peer, enum arq_mode mode, const char *output_path, bool exact_path)
+{
+    struct session *ss = calloc(1, sizeof(struct session));
+    if (ss == NULL) {
+        fprintf(stderr, "[session_create]: couldn't allocate session\n");
+        return NULL;
+    }
+    ss->peer = *peer;
+    ss->mode = mode;
+    ss->packet_received = -1;
+    ss->output_path = output_path;
+    ss->exact_path = exact_path;
+    ss->out_fd = -1;
+    if (mode == MODE_SR) {
+        ss->reorder = malloc(SACK_BITS * sizeof(struct packet_t));
+        ss->held = calloc(SACK_BITS, sizeof(bool));
+        if (ss->reorder == NULL || ss->held == NULL) {
+            fprintf(stderr, "[session_create]: couldn't allocate reorder window\n");
+            goto fail;
+        }
+    }
+    if (output_path == NULL) {
+        ss->buf = malloc((strlen(g_buffer) + 1) * sizeof(char));
+        if (ss->buf == NULL) {
+            fprintf(stderr, "[session_create]: couldn't allocate buffer\n");
+            goto fail;
+        }
+        ss->bufstart = ss->buf;
+        ss->bufend = ss->buf + strlen(g_buffer) + 1;
+    }
+    return ss;
+
+    fail:
+        free(ss->reorder);
+        free(ss->held);
+        free(ss);
+        return NULL;
+}
+
+// Name of the output file. Unless it is output_path itself, a striped
+// transfer's is named after the transfer id and a resumable one's after the
+// resume key, so later senders of the same transfer find it; any other
+// after the peer address.
+static void output_name(struct session *ss, char *path, size_t len)
+{
+    if (ss->exact_path) {
+        snprintf(path, len, "%s", ss->output_path);
+    } else if (ss->striped) {
+        snprintf(path, len, "%s.%016" PRIx64, ss->output_path, ss->stripe.transfer_id);
+    } else if (ss->resumable) {
+        snprintf(path, len, "%s.%016" PRIx64, ss->output_path, ss->resume.key);
+    } else {
+        char peer[64];
+        session_name(&ss->peer, peer, sizeof(peer));
+        *strrchr(peer, ':') = '-';
+        snprintf(path, len, "%s.%s", ss->output_path, peer);
+    }
+}
+
+// Opens the output for the first in-order packet. Stripes of one transfer
+// all open the same file without truncating it, size it to the whole
+// transfer and write their own byte range. A resumed transfer keeps what
+// the file has and writes from the offset it resumes at.
+static int open_output(struct session *ss)
+{
+    ss->opened = true;
+    off_t offset = ss->striped ? (off_t) ss->stripe.offset : (off_t) ss->resume_offset;
+    if (ss->output_path == NULL) {
+        ss->bufstart = ss->buf + (offset < ss->bufend - ss->buf ? offset : ss->bufend - ss->buf);
+        return 0;
+    }
+
+    char name[PATH_MAX];
+    output_name(ss, name, sizeof(name));
+    ss->out_fd = open(name, O_WRONLY | O_CREAT | (offset == 0 && !ss->striped ? O_TRUNC : 0), 0644);
+    if (ss->out_fd == -1) {
+        perror("[session]: open output file");
+        return -1;
+    }
+    if (ss->striped) {
+        struct stat st;
+        if (fstat(ss->out_fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+            fprintf(stderr, "[session]: striped transfers need a regular output file\n");
+            return -1;
+        }
+        if (ftruncate(ss->out_fd, (off_t) ss->stripe.total) == -1) {
+            perror("[session]: ftruncate output file");
+            return -1;
+        }
+    }
+    return sink_init(&ss->sink, ss->out_fd, offset, ss->writer);
+}
+
+// First packet of a stripe: records where the stripe goes instead of
+// delivering any data
+static int open_stripe(struct session *ss, struct packet_t *pkt)
+{
+    if (deserialize_stripe((uint8_t *) pkt->data, pkt->len, &ss->stripe) == -1) {
+        return -1;
+    }
+    ss->striped = true;
+    return 0;
+}
+
+// Resumable transfers: records in the checkpoint how far the output is
+// durable, which is as far as the sink has written once that is synced. A
+// checkpoint further along for the same transfer (saved by a session of an
+// earlier sender of it that only now closes) is left alone.
+static int save_progress(struct session *ss)
+{
+    uint64_t offset = ss->resume_offset + ss->sink.written;
+    if (ss->ckpt_path == NULL || ss->out_fd == -1 || offset == ss->checkpointed) {
+        return 0;
+    }
+    if (fdatasync(ss->out_fd) == -1) {
+        perror("[session]: fdatasync output file");
+        return -1;
+    }
+    ss->checkpointed = offset;
+    struct checkpoint ck;
+    if (checkpoint_load(ss->ckpt_path, &ck) == 0 && ck.key == ss->resume.key && ck.offset >= offset) {
+        return 0;
+    }
+    ck.key = ss->resume.key;
+    ck.total = ss->resume.total;
+    ck.chunk_size = ss->resume.chunk_size;
+    ck.offset = offset;
+    return checkpoint_save(ss->ckpt_path, &ck);
+}
+
+// Appends an in-order packet to the output sink, or to the buffer when no
+// output file was given
+static int deliver(struct session *ss, struct packet_t *pkt)
+{
+    if (!ss->opened) {
+        if (pkt->type == 16 && pkt->seq_no == 0) {
+            if (open_stripe(ss, pkt) == -1 || open_output(ss) == -1) {
+                return -1;
+            }
+            ss->packet_received++;
+            return 0;
+        }
+        if (open_output(ss) == -1) {
+            return -1;
+        }
+    }
+    if (ss->out_fd != -1) {
+        if (sink_write(&ss->sink, pkt->data, pkt->len) == -1) {
+            return -1;
+        }
+        if (ss->ckpt_path != NULL && ss->resume_offset + ss->sink.written >= ss->checkpointed + CHECKPOINT_BYTES
+                && save_progress(ss) == -1) {
+            return -1;
+        }
+    } else {
+        if (pkt->len > ss->bufend - ss->bufstart) {
+            fprintf(stderr, "[session]: transfer larger than the buffer, use -o\n");
+            return -1;
+        }
+        memcpy(ss->bufstart, pkt->data, pkt->len);
+        ss->bufstart += pkt->len;
+    }
+    ss->packet_received++;
+    ss->bytes_received += pkt->len;
+    return 0;
+}
+
+// Selective repeat: delivers the packet if it is next in sequence, followed
+// by whatever it unblocks from the reorder window. Packets that fit in the
+// window ahead of a gap are held instead of dropped.
+static int reorder_packet(struct session *ss, struct packet_t *pkt)
+{
+    int64_t expected = ss->packet_received + 1;
+    if (pkt->seq_no == expected) {
+        if (deliver(ss, pkt) == -1) {
+            return -1;
+        }
+        int slot = (int) ((ss->packet_received + 1) % SACK_BITS);
+        while (ss->held[slot] && ss->reorder[slot].seq_no == ss->packet_received + 1) {
+            ss->held[slot] = false;
+            if (deliver(ss, &ss->reorder[slot]) == -1) {
+                return -1;
+            }
+            slot = (int) ((ss->packet_received + 1) % SACK_BITS);
+        }
+    } else if (pkt->seq_no > expected && pkt->seq_no <= expected + SACK_BITS) {
+        int slot = (int) (pkt->seq_no % SACK_BITS);
+        ss->reorder[slot] = *pkt;
+        ss->held[slot] = true;
+    }
+    return 0;
+}
+
+// FEC: the group packet seq belongs to, started afresh if its slot holds an
+// older one. NULL if the slot has moved on to a newer group, or (without
+// 'create') doesn't hold this one.
+static struct fec_group *fec_group_of(struct session *ss, int64_t seq, bool create)
+{
+    int64_t first = seq - seq % ss->fec_k;
+    struct fec_group *g = &ss->fec[(seq / ss->fec_k) % ss->fec_ngroups];
+    if (g->first != first) {
+        if (!create || g->first > first) {
+            return NULL;
+        }
+        fec_reset(g, first);
+    }
+    return g;
+}
+
+// FEC: whether a packet beyond the gap at 'expected' should leave the gap
+// unreported for now. That is while the gap's group has had no parity yet
+// and lost only the one packet so far, so the parity may still fill it.
+static bool fec_pending(struct session *ss, struct packet_t *pkt, int64_t expected)
+{
+    if (ss->fec == NULL || pkt->seq_no <= expected || pkt->seq_no / ss->fec_k != expected / ss->fec_k) {
+        return false;
+    }
+    struct fec_group *g = fec_group_of(ss, expected, false);
+    return g != NULL && !g->parity && pkt->seq_no - g->first + 1 - g->nhave <= 1;
+}
+
+// Takes a data packet, received or rebuilt. Check if this is the next
+// packet in the sequence. If so, adjust packet_received appropriately and
+// deliver the data. Either way the session owes its peer an ACK. A plain
+// in-order data packet may wait for a later ACK; a gap, a duplicate, the
+// stripe header or a packet that filled a hole is acknowledged right away,
+// so the sender learns of losses without delay. With FEC a gap the parity
+// may still fill isn't acknowledged at all yet.
+static int accept_data(struct session *ss, struct packet_t *pkt)
+{
+    int64_t expected = ss->packet_received + 1;
+    int ret = 0;
+    if (ss->mode == MODE_SR || ss->fec != NULL) {
+        ret = reorder_packet(ss, pkt);
+    } else if (pkt->seq_no == expected) {
+        ret = deliver(ss, pkt);
+    }
+    if (pkt->type == 1 && pkt->seq_no == expected && ss->packet_received == expected) {
+        ss->unacked++;
+    } else if (fec_pending(ss, pkt, expected)) {
+        return ret;
+    } else {
+        ss->ack_now = true;
+    }
+    ss->need_ack = true;
+    return ret;
+}
+
+// FEC: once the parity and all but one packet of a group are in, rebuilds
+// that one and takes it as if it had arrived
+static int recover(struct session *ss, struct fec_group *g)
+{
+    struct packet_t *pkt = ss->fec_pkt;
+    if (!fec_recover(g, pkt) || pkt->seq_no <= ss->packet_received) {
+        return 0;
+    }
+    ss->recovered++;
+    ss->last_recovered = pkt->seq_no;
+    ss->ack_now = true;
+    return accept_data(ss, pkt);
+}
+
+// Handles a data packet. With FEC it also goes into its group's XOR, if it
+// is one the reorder window can still use.
+int session_data(struct session *ss, struct packet_t *pkt)
+{
+    struct fec_group *g = NULL;
+    if (ss->fec != NULL && pkt->seq_no > ss->packet_received
+            && pkt->seq_no <= ss->packet_received + 1 + SACK_BITS) {
+        g = fec_group_of(ss, pkt->seq_no, true);
+        if (g != NULL) {
+            fec_add(g, pkt->seq_no, pkt->type, pkt->data, pkt->len);
+        }
+    }
+    if (accept_data(ss, pkt) == -1) {
+        return -1;
+    }
+    return g != NULL ? recover(ss, g) : 0;
+}
+
+// FEC starts with the first parity packet, which tells the group size. Go
+// back N sessions get a reorder window too, so packets after a loss can
+// wait for the parity instead of being dropped.
+static int enable_fec(struct session *ss, int k)
+{
+    ss->fec_k = k;
+    ss->fec_ngroups = SACK_BITS / k + 2;
+    ss->fec = malloc(ss->fec_ngroups * sizeof(struct fec_group));
+    ss->fec_pkt = malloc(sizeof(struct packet_t));
+    if (ss->reorder == NULL) {
+        ss->reorder = malloc(SACK_BITS * sizeof(struct packet_t));
+        ss->held = calloc(SACK_BITS, sizeof(bool));
+    }
+    if (ss->fec == NULL || ss->fec_pkt == NULL || ss->reorder == NULL || ss->held == NULL) {
+        fprintf(stderr, "[session]: couldn't allocate FEC groups\n");
+        return -1;
+    }
+    for (int i = 0; i < ss->fec_ngroups; ++i) {
+        fec_reset(&ss->fec[i], -1);
+    }
+    return 0;
+}
+
+// Handles a parity packet: adds it to its group and rebuilds the group's
+// missing packet if only one is. A gap in the group that is still there
+// afterwards won't be filled by FEC, so the sender hears of it now.
+// Malformed parity, or parity for groups out of reach, is ignored.
+int session_parity(struct session *ss, struct packet_t *pkt)
+{
+    int k, count;
+    if (fec_parse(pkt->data, pkt->len, &k, &count) == -1) {
+        return 0;
+    }
+    if (ss->fec == NULL && enable_fec(ss, k) == -1) {
+        return -1;
+    }
+    int64_t expected = ss->packet_received + 1;
+    if (k != ss->fec_k || pkt->seq_no % k != 0 || pkt->seq_no + count <= expected
+            || pkt->seq_no > expected + SACK_BITS) {
+        return 0;
+    }
+    struct fec_group *g = fec_group_of(ss, pkt->seq_no, true);
+    if (g == NULL || !fec_add_parity(g, pkt->data, pkt->len)) {
+        return 0;
+    }
+    if (recover(ss, g) == -1) {
+        return -1;
+    }
+    if (expected >= g->first && expected < g->first + g->count && ss->packet_received < expected) {
+        ss->ack_now = true;
+        ss->need_ack = true;
+    }
+    return 0;
+}
+
+// Answers a resume request, which comes before any data. The transfer
+// resumes where the checkpoint next to its output says the output is
+// durable, rounded down to a whole chunk, provided the checkpoint is for
+// the same transfer and the file still holds that much. Otherwise, or
+// without an output file, it starts over. A repeated request (the answer
+// was lost) gets the same answer.
+int session_resume(struct session *ss, const struct resume_t *req)
+{
+    if (ss->resumable || ss->opened) {
+        return 0;
+    }
+    ss->resumable = true;
+    ss->resume = *req;
+    if (ss->output_path == NULL) {
+        return 0;
+    }
+    char name[PATH_MAX];
+    output_name(ss, name, sizeof(name));
+    ss->ckpt_path = malloc(strlen(name) + sizeof(CHECKPOINT_SUFFIX));
+    if (ss->ckpt_path == NULL) {
+        fprintf(stderr, "[session_resume]: couldn't allocate checkpoint path\n");
+        return -1;
+    }
+    sprintf(ss->ckpt_path, "%s%s", name, CHECKPOINT_SUFFIX);
+
+    // Only regular files can be synced and resumed into
+    struct stat st;
+    if (stat(name, &st) == -1) {
+        return 0;
+    }
+    if (!S_ISREG(st.st_mode)) {
+        free(ss->ckpt_path);
+        ss->ckpt_path = NULL;
+        return 0;
+    }
+    struct checkpoint ck;
+    if (checkpoint_load(ss->ckpt_path, &ck) == 0 && ck.key == req->key && ck.total == req->total
+            && ck.chunk_size == req->chunk_size && (uint64_t) st.st_size >= ck.offset) {
+        ss->resume_offset = ck.offset == ck.total ? ck.offset : ck.offset - ck.offset % ck.chunk_size;
+    }
+    ss->checkpointed = ss->resume_offset;
+    return 0;
+}
+
+// First tear-down message: everything has arrived, so get it to the file
+// before the tear-down ACK says so. A resumable transfer's checkpoint then
+// records it as complete, so a sender that tries again has nothing to send.
+int session_teardown(struct session *ss)
+{
+    if (ss->torn_down) {
+        return 0;
+    }
+    ss->torn_down = true;
+
+    // An empty transfer still leaves an (empty) output file
+    if (!ss->opened && open_output(ss) == -1) {
+        return -1;
+    }
+    if (ss->out_fd != -1 && (sink_flush(&ss->sink) == -1 || save_progress(ss) == -1)) {
+        return -1;
+    }
+    return 0;
+}
+
+// Bitmap of held packets; bit i is packet packet_received + 2 + i
+static uint64_t sack_bitmap(struct session *ss)
+{
+    uint64_t sack = 0;
+    for (int i = 0; i < SACK_BITS; ++i) {
+        int64_t seq = ss->packet_received + 2 + i;
+        int slot = (int) (seq % SACK_BITS);
+        if (ss->held[slot] && ss->reorder[slot].seq_no == seq) {
+            sack |= (uint64_t) 1 << i;
+        }
+    }
+    return sack;
+}
+
+// Builds the cumulative ACK (plus SACK bitmap in selective repeat mode)
+void session_make_ack(struct session *ss, struct ack_t *ack)
+{
+    make_ack(ack, 2, ss->packet_received);
+    if (ss->mode == MODE_SR) {
+        ack->sack = sack_bitmap(ss);
+    }
+    ss->need_ack = false;
+    ss->unacked = 0;
+    ss->ack_now = false;
+}
+
+// Flushes and closes the output, reports the transfer and frees the session
+int session_close(struct session *ss)
+{
+    int ret = 0;
+    char name[96];
+    session_name(&ss->peer, name, sizeof(name));
+    if (ss->striped) {
+        size_t used = strlen(name);
+        snprintf(name + used, sizeof(name) - used, " (stripe %u/%u of %016" PRIx64 ")",
+                ss->stripe.index + 1, ss->stripe.count, ss->stripe.transfer_id);
+    }
+    printf("session %s: bytes received: %" PRIu64 "%s\n", name, ss->bytes_received,
+            ss->torn_down ? "" : " (incomplete)");
+    if (ss->out_fd != -1) {
+        // What an unfinished resumable transfer got so far need not be sent
+        // again
+        if (sink_flush(&ss->sink) == -1 || save_progress(ss) == -1) {
+            ret = -1;
+        }
+        printf("session %s: sink peak buffered bytes: %zu\n", name, ss->sink.peak);
+        sink_destroy(&ss->sink);
+        if (close(ss->out_fd) == -1) {
+            perror("[session_close]: close output file");
+            ret = -1;
+        }
+    }
+    free(ss->buf);
+    free(ss->reorder);
+    free(ss->held);
+    free(ss->fec);
+    free(ss->fec_pkt);
+    free(ss->ckpt_path);
+    free(ss);
+    return ret;
+}
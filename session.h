@@ -0,0 +1,89 @@
+#include <sys/socket.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include "packet.h"
+#include "sink.h"
+#include "fec.h"
+#include "checkpoint.h"
+
+#pragma once
+
+
+// Receive-side state of one transfer, keyed on the sender's address
+struct session {
+    struct session *next;
+    struct sockaddr peer;
+    enum arq_mode mode;
+
+    // Last packet received
+    int64_t packet_received;
+
+    // Selective repeat (or FEC): out-of-order packets waiting for the gap
+    // below them to fill, indexed by seq_no % SACK_BITS
+    struct packet_t *reorder;
+    bool *held;
+
+    // Forward error correction, from the first parity packet on: the
+    // sender's group size, the groups around the reorder window indexed by
+    // group number % fec_ngroups, and where packets are rebuilt. recovered
+    // counts those, last_recovered is the latest.
+    int fec_k;
+    int fec_ngroups;
+    struct fec_group *fec;
+    struct packet_t *fec_pkt;
+    uint64_t recovered;
+    int64_t last_recovered;
+
+    // Set by the first packet of a stripe of a striped transfer
+    bool striped;
+    struct stripe_t stripe;
+
+    // Set by a resume request (the sender's -R): the transfer it names and
+    // the byte offset it resumes from. With an output file, progress is
+    // recorded in the checkpoint at ckpt_path, last at 'checkpointed'.
+    bool resumable;
+    struct resume_t resume;
+    uint64_t resume_offset;
+    char *ckpt_path;
+    uint64_t checkpointed;
+
+    // Where data goes: a streaming sink on the output file if one was given,
+    // otherwise a buffer the size of g_buffer. The file is opened on the
+    // first in-order packet, once it is known whether this is a stripe.
+    const char *output_path;
+    bool exact_path;
+    bool opened;
+    int out_fd;
+    struct sink sink;
+    struct sink_stage *writer;
+    char *buf;
+    char *bufstart;
+    char *bufend;
+    uint64_t bytes_received;
+
+    bool torn_down;
+    bool need_ack;
+    uint64_t expires;
+
+    // Delayed ACKs: in-order packets not acknowledged yet, and whether the
+    // next ACK must go out right away (after a gap or a duplicate)
+    int unacked;
+    bool ack_now;
+
+    // Owned by the receiver: whether the session is in the current batch,
+    // and its place among the sessions waiting for the delayed-ACK timer
+    bool touched;
+    bool ack_pending;
+    struct session *ack_prev;
+    struct session *ack_next;
+};
+
+struct session *session_create(struct sockaddr *peer, enum arq_mode mode, const char *output_path, bool exact_path);
+int session_data(struct session *ss, struct packet_t *pkt);
+int session_parity(struct session *ss, struct packet_t *pkt);
+int session_resume(struct session *ss, const struct resume_t *req);
+int session_teardown(struct session *ss);
+void session_make_ack(struct session *ss, struct ack_t *ack);
+int session_close(struct session *ss);
+void session_name(struct sockaddr *peer, char *buf, size_t len);
+bool session_match(struct session *ss, struct sockaddr *peer);
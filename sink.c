@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include "sink.h"
+#include "workq.h"
+
+
+// Sets up a sink writing to fd starting at 'offset', on the writer stage's
+// thread if there is one. Pipes and other non-seekable fds are written
+// sequentially and ignore the offset.
+int sink_init(struct sink *sk, int fd, off_t offset, struct sink_stage *stage)
+{
+    if (sk == NULL) {
+        fprintf(stderr, "[sink_init]: sk was NULL\n");
+        return -1;
+    }
+    memset(sk, 0, sizeof(*sk));
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("[sink_init]: fstat");
+        return -1;
+    }
+    sk->fd = fd;
+    sk->seekable = S_ISREG(st.st_mode) || S_ISBLK(st.st_mode);
+    sk->offset = offset;
+    sk->stage = stage;
+    for (int i = 0; i < SINK_NBUFS; ++i) {
+        sk->bufs[i] = malloc(SINK_BUFSIZE);
+        if (sk->bufs[i] == NULL) {
+            fprintf(stderr, "[sink_init]: couldn't allocate buffers\n");
+            sink_destroy(sk);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Takes in the writes the writer has finished, for any sink of the stage
+static void reap(struct sink_stage *st)
+{
+    struct sink_io io;
+    while (spsc_pop(&st->done, &io)) {
+        struct sink *sk = io.sk;
+        st->pending--;
+        sk->inflight--;
+        sk->busy[io.buf] = false;
+        sk->used[io.buf] = 0;
+        sk->held -= io.len;
+        if (io.err != 0) {
+            fprintf(stderr, "[sink]: write: %s\n", strerror(io.err));
+            sk->failed = true;
+        } else if (!sk->failed) {
+            sk->written += io.len;
+        }
+    }
+}
+
+// Waits for at least one more write to finish. Something must be pending.
+static void reap_wait(struct sink_stage *st)
+{
+    int pending = st->pending;
+    for (;;) {
+        reap(st);
+        if (st->pending < pending) {
+            return;
+        }
+        if (spsc_park_consumer(&st->done)) {
+            spsc_wait(st->done.cons->efd);
+        }
+    }
+}
+
+// Hands buffer i to the writer, waiting for room in its queue first
+static void submit(struct sink *sk, int i)
+{
+    struct sink_stage *st = sk->stage;
+    reap(st);
+    while (st->pending == SINK_QUEUE) {
+        reap_wait(st);
+    }
+    struct sink_io io = {sk, i, sk->offset, sk->used[i], 0};
+    spsc_push(&st->reqs, &io);
+    st->pending++;
+    sk->busy[i] = true;
+    sk->inflight++;
+    sk->offset += sk->used[i];
+}
+
+// Hands the full current buffer to the writer and moves on to the next
+// one, once the writer is done with that
+static int next_buffer(struct sink *sk)
+{
+    submit(sk, sk->cur);
+    sk->cur = (sk->cur + 1) % SINK_NBUFS;
+    while (sk->busy[sk->cur]) {
+        reap_wait(sk->stage);
+    }
+    return sk->failed ? -1 : 0;
+}
+
+// Copies data into the ring, flushing it whenever every buffer is full
+// (handing over each buffer as it fills, with a writer stage)
+int sink_write(struct sink *sk, const char *data, size_t len)
+{
+    while (len > 0) {
+        if (sk->used[sk->cur] == SINK_BUFSIZE) {
+            if (sk->stage != NULL) {
+                if (next_buffer(sk) == -1) {
+                    return -1;
+                }
+            } else if (sk->cur == SINK_NBUFS - 1) {
+                if (sink_flush(sk) == -1) {
+                    return -1;
+                }
+            } else {
+                sk->cur++;
+            }
+        }
+        size_t n = SINK_BUFSIZE - sk->used[sk->cur];
+        if (n > len) {
+            n = len;
+        }
+        memcpy(sk->bufs[sk->cur] + sk->used[sk->cur], data, n);
+        sk->used[sk->cur] += n;
+        sk->held += n;
+        data += n;
+        len -= n;
+    }
+    if (sk->held > sk->peak) {
+        sk->peak = sk->held;
+    }
+    return 0;
+}
+
+// Writes out everything held in the ring with as few syscalls as possible.
+// With a writer stage, hands over the current buffer and waits until the
+// writer is done with all of them.
+int sink_flush(struct sink *sk)
+{
+    if (sk->stage != NULL) {
+        if (sk->used[sk->cur] > 0) {
+            submit(sk, sk->cur);
+            sk->cur = (sk->cur + 1) % SINK_NBUFS;
+        }
+        while (sk->inflight > 0) {
+            reap_wait(sk->stage);
+        }
+        return sk->failed ? -1 : 0;
+    }
+
+    struct iovec iov[SINK_NBUFS];
+    int cnt = 0;
+    for (int i = 0; i <= sk->cur; ++i) {
+        if (sk->used[i] > 0) {
+            iov[cnt].iov_base = sk->bufs[i];
+            iov[cnt].iov_len = sk->used[i];
+            cnt++;
+        }
+    }
+    int first = 0;
+    while (first < cnt) {
+        ssize_t ret;
+        if (sk->seekable) {
+            ret = pwritev(sk->fd, iov + first, cnt - first, sk->offset);
+        } else {
+            ret = writev(sk->fd, iov + first, cnt - first);
+        }
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("[sink_flush]: write");
+            return -1;
+        }
+        sk->offset += ret;
+        sk->written += ret;
+
+        // Skip over what was written, trimming a partially written iovec
+        while (first < cnt && (size_t) ret >= iov[first].iov_len) {
+            ret -= iov[first].iov_len;
+            first++;
+        }
+        if (first < cnt) {
+            iov[first].iov_base = (char *) iov[first].iov_base + ret;
+            iov[first].iov_len -= ret;
+        }
+    }
+    for (int i = 0; i < SINK_NBUFS; ++i) {
+        sk->used[i] = 0;
+    }
+    sk->cur = 0;
+    sk->held = 0;
+    return 0;
+}
+
+void sink_destroy(struct sink *sk)
+{
+    for (int i = 0; i < SINK_NBUFS; ++i) {
+        free(sk->bufs[i]);
+        sk->bufs[i] = NULL;
+    }
+}
+
+// Writes all of buf at offset (or at the end, for pipes). Returns 0, or the
+// errno of the write that failed.
+static int write_all(struct sink *sk, const char *buf, size_t len, off_t offset)
+{
+    while (len > 0) {
+        ssize_t ret;
+        if (sk->seekable) {
+            ret = pwrite(sk->fd, buf, len, offset);
+        } else {
+            ret = write(sk->fd, buf, len);
+        }
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        buf += ret;
+        len -= ret;
+        offset += ret;
+    }
+    return 0;
+}
+
+// Writer thread: writes buffers in the order they come and hands them
+// back, sleeping while there are none, until stopped with nothing left
+static void *run_writer(void *arg)
+{
+    struct sink_stage *st = arg;
+    for (;;) {
+        struct sink_io io;
+        if (spsc_pop(&st->reqs, &io)) {
+            io.err = write_all(io.sk, io.sk->bufs[io.buf], io.len, io.offset);
+            spsc_push(&st->done, &io);
+        } else if (atomic_load(&st->stopping)) {
+            break;
+        } else if (spsc_park_consumer(&st->reqs)) {
+            spsc_wait(st->reqs.cons->efd);
+        }
+    }
+    return NULL;
+}
+
+// Starts a writer thread, pinned to cpu unless it is -1
+int sink_stage_start(struct sink_stage *st, int cpu)
+{
+    st->pending = 0;
+    atomic_init(&st->stopping, false);
+    if (spsc_init(&st->reqs, SINK_QUEUE, sizeof(struct sink_io)) == -1) {
+        return -1;
+    }
+    if (spsc_init(&st->done, SINK_QUEUE, sizeof(struct sink_io)) == -1) {
+        spsc_destroy(&st->reqs);
+        return -1;
+    }
+    if (start_thread(&st->thread, run_writer, st, cpu) == -1) {
+        spsc_destroy(&st->reqs);
+        spsc_destroy(&st->done);
+        return -1;
+    }
+    return 0;
+}
+
+// Lets the writer finish what it has, then stops it. The sinks using it
+// must have been flushed.
+void sink_stage_stop(struct sink_stage *st)
+{
+    atomic_store(&st->stopping, true);
+    spsc_kick(st->reqs.cons->efd);
+    pthread_join(st->thread, NULL);
+    spsc_destroy(&st->reqs);
+    spsc_destroy(&st->done);
+}
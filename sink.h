@@ -0,0 +1,70 @@
+#include <sys/types.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "spsc.h"
+
+#pragma once
+
+#define SINK_BUFSIZE (64 * 1024)
+#define SINK_NBUFS 8
+
+// Writes a writer stage can have outstanding; a power of two
+#define SINK_QUEUE 64
+
+
+struct sink_stage;
+
+// Streaming output for in-order data. Writes land in a small ring of fixed
+// buffers that is flushed with one pwritev (writev for pipes) when full, so
+// memory use stays at SINK_NBUFS * SINK_BUFSIZE whatever the transfer size.
+// With a writer stage, each buffer is handed to the writer thread as soon
+// as it is full instead, and the ring fills the next one meanwhile.
+struct sink {
+    int fd;
+    bool seekable;
+    off_t offset;
+    char *bufs[SINK_NBUFS];
+    size_t used[SINK_NBUFS];
+    int cur;
+    size_t held;
+    size_t peak;
+    uint64_t written;
+
+    // Writer stage, or NULL to write on the caller's thread. Buffers the
+    // writer has are busy; offset is where the next one handed over goes,
+    // while 'written' only counts what has landed, in order.
+    struct sink_stage *stage;
+    bool busy[SINK_NBUFS];
+    int inflight;
+    bool failed;
+};
+
+// One buffer for the writer, and how writing it went (an errno, or 0)
+struct sink_io {
+    struct sink *sk;
+    int buf;
+    off_t offset;
+    size_t len;
+    int err;
+};
+
+// A writer thread that takes the sinks of one thread (a receiver worker)
+// off it: buffers go over one SPSC ring and come back over the other. No
+// more than SINK_QUEUE are ever out, so neither ring fills up.
+struct sink_stage {
+    struct spsc reqs;
+    struct spsc done;
+    int pending;
+    pthread_t thread;
+    atomic_bool stopping;
+};
+
+int sink_init(struct sink *sk, int fd, off_t offset, struct sink_stage *stage);
+int sink_write(struct sink *sk, const char *data, size_t len);
+int sink_flush(struct sink *sk);
+void sink_destroy(struct sink *sk);
+int sink_stage_start(struct sink_stage *st, int cpu);
+void sink_stage_stop(struct sink_stage *st);
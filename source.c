@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "source.h"
+
+
+// Uses an in-memory buffer as the source
+int source_open_buffer(struct source *src, const char *buf, size_t len)
+{
+    if (src == NULL || buf == NULL) {
+        fprintf(stderr, "[source_open_buffer]: src or buf was NULL\n");
+        return -1;
+    }
+    src->data = buf;
+    src->len = len;
+    src->mapped = false;
+    src->mtime_ns = 0;
+    return 0;
+}
+
+// Maps the file at 'path' read-only. Pages are faulted in as the sender
+// reaches them, so files of any size can be sent without reading them in.
+int source_open_file(struct source *src, const char *path)
+{
+    if (src == NULL || path == NULL) {
+        fprintf(stderr, "[source_open_file]: src or path was NULL\n");
+        return -1;
+    }
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("[source_open_file]: open");
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        perror("[source_open_file]: fstat");
+        close(fd);
+        return -1;
+    }
+    src->len = (size_t) st.st_size;
+    src->mapped = false;
+    src->mtime_ns = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    src->data = NULL;
+    if (src->len == 0) {
+        // Nothing to map; an empty transfer goes straight to tear-down
+        static const char empty[1];
+        src->data = empty;
+        close(fd);
+        return 0;
+    }
+    void *map = mmap(NULL, src->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("[source_open_file]: mmap");
+        return -1;
+    }
+    madvise(map, src->len, MADV_SEQUENTIAL);
+    src->data = map;
+    src->mapped = true;
+    return 0;
+}
+
+void source_close(struct source *src)
+{
+    if (src != NULL && src->mapped) {
+        munmap((void *) src->data, src->len);
+        src->mapped = false;
+    }
+}
@@ -0,0 +1,20 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+#pragma once
+
+
+// Data to transfer: either the compiled-in g_buffer or a memory-mapped file.
+// The sender chunks it by offset, so nothing is copied into the heap.
+// mtime_ns is the file's modification time (0 for the buffer).
+struct source {
+    const char *data;
+    size_t len;
+    bool mapped;
+    int64_t mtime_ns;
+};
+
+int source_open_buffer(struct source *src, const char *buf, size_t len);
+int source_open_file(struct source *src, const char *path);
+void source_close(struct source *src);
@@ -0,0 +1,187 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <sys/eventfd.h>
+#include "spsc.h"
+
+
+// Sets up an empty ring of cap elements of elem_size bytes. cap must be a
+// power of two.
+int spsc_init(struct spsc *q, unsigned long cap, size_t elem_size)
+{
+    if (cap == 0 || (cap & (cap - 1)) != 0) {
+        fprintf(stderr, "[spsc_init]: capacity %lu is not a power of two\n", cap);
+        return -1;
+    }
+    q->prod = aligned_alloc(CACHE_LINE, 2 * sizeof(struct spsc_end));
+    q->slots = malloc(cap * elem_size);
+    if (q->prod == NULL || q->slots == NULL) {
+        fprintf(stderr, "[spsc_init]: couldn't allocate ring\n");
+        free(q->prod);
+        free(q->slots);
+        return -1;
+    }
+    q->cons = q->prod + 1;
+    q->mask = cap - 1;
+    q->elem_size = elem_size;
+    struct spsc_end *ends[2] = {q->prod, q->cons};
+    for (int i = 0; i < 2; ++i) {
+        atomic_init(&ends[i]->pos, 0);
+        ends[i]->other = 0;
+        atomic_init(&ends[i]->waiting, false);
+        ends[i]->efd = eventfd(0, EFD_NONBLOCK);
+        if (ends[i]->efd == -1) {
+            perror("[spsc_init]: eventfd");
+            if (i == 1) {
+                close(ends[0]->efd);
+            }
+            free(q->prod);
+            free(q->slots);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// After moving its own position: wakes the other end if it parked. The
+// fence pairs with the one in park, so either this end sees the flag or
+// the parking end sees the new position.
+static void wake(struct spsc_end *other)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&other->waiting, memory_order_relaxed)
+            && atomic_exchange(&other->waiting, false)) {
+        spsc_kick(other->efd);
+    }
+}
+
+// Producer: whether n slots are free, looking at the consumer's position
+// only if the cached one says they aren't
+bool spsc_has_room(struct spsc *q, unsigned long n)
+{
+    unsigned long head = atomic_load_explicit(&q->prod->pos, memory_order_relaxed);
+    if (q->mask + 1 - (head - q->prod->other) < n) {
+        q->prod->other = atomic_load_explicit(&q->cons->pos, memory_order_acquire);
+    }
+    return q->mask + 1 - (head - q->prod->other) >= n;
+}
+
+// Producer: copies elem into the ring. Returns false if it is full.
+bool spsc_push(struct spsc *q, const void *elem)
+{
+    if (!spsc_has_room(q, 1)) {
+        return false;
+    }
+    unsigned long head = atomic_load_explicit(&q->prod->pos, memory_order_relaxed);
+    memcpy(q->slots + (head & q->mask) * q->elem_size, elem, q->elem_size);
+    atomic_store_explicit(&q->prod->pos, head + 1, memory_order_release);
+    wake(q->cons);
+    return true;
+}
+
+// Consumer: the i-th element not yet released, or NULL if there are no
+// more than i. It stays in place until released.
+void *spsc_peek(struct spsc *q, unsigned long i)
+{
+    unsigned long tail = atomic_load_explicit(&q->cons->pos, memory_order_relaxed);
+    if (q->cons->other - tail <= i) {
+        q->cons->other = atomic_load_explicit(&q->prod->pos, memory_order_acquire);
+        if (q->cons->other - tail <= i) {
+            return NULL;
+        }
+    }
+    return q->slots + ((tail + i) & q->mask) * q->elem_size;
+}
+
+// Consumer: hands the first n elements' slots back to the producer
+void spsc_release(struct spsc *q, unsigned long n)
+{
+    if (n == 0) {
+        return;
+    }
+    unsigned long tail = atomic_load_explicit(&q->cons->pos, memory_order_relaxed);
+    atomic_store_explicit(&q->cons->pos, tail + n, memory_order_release);
+    wake(q->prod);
+}
+
+// Consumer: takes the oldest element into elem. Returns false if the ring
+// is empty.
+bool spsc_pop(struct spsc *q, void *elem)
+{
+    void *slot = spsc_peek(q, 0);
+    if (slot == NULL) {
+        return false;
+    }
+    memcpy(elem, slot, q->elem_size);
+    spsc_release(q, 1);
+    return true;
+}
+
+// Announces that 'self' is about to sleep; the caller then looks again.
+// If the other end moved in the meantime, the caller takes the
+// announcement back with unpark instead of waiting.
+static void park(struct spsc_end *self)
+{
+    atomic_store(&self->waiting, true);
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+static void unpark(struct spsc_end *self)
+{
+    atomic_store(&self->waiting, false);
+}
+
+// Producer found fewer than n free slots: true if it should wait on
+// prod->efd
+bool spsc_park_producer(struct spsc *q, unsigned long n)
+{
+    park(q->prod);
+    if (spsc_has_room(q, n)) {
+        unpark(q->prod);
+        return false;
+    }
+    return true;
+}
+
+// Consumer found the ring empty: true if it should wait on cons->efd
+bool spsc_park_consumer(struct spsc *q)
+{
+    park(q->cons);
+    if (spsc_peek(q, 0) != NULL) {
+        unpark(q->cons);
+        return false;
+    }
+    return true;
+}
+
+// Blocks until efd is signalled, and clears it
+void spsc_wait(int efd)
+{
+    struct pollfd pfd = {efd, POLLIN, 0};
+    while (poll(&pfd, 1, -1) == -1 && errno == EINTR) {
+    }
+    uint64_t count;
+    if (read(efd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("[spsc_wait]: read eventfd");
+    }
+}
+
+void spsc_kick(int efd)
+{
+    uint64_t one = 1;
+    if (write(efd, &one, sizeof(one)) == -1) {
+        perror("[spsc_kick]: write eventfd");
+    }
+}
+
+void spsc_destroy(struct spsc *q)
+{
+    close(q->prod->efd);
+    close(q->cons->efd);
+    free(q->prod);
+    free(q->slots);
+}
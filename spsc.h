@@ -0,0 +1,44 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#pragma once
+
+#define CACHE_LINE 64
+
+
+// One end of a ring, on a cache line of its own: its position (the next
+// slot it fills or takes), its last look at the other end's, and whether it
+// is parked, waiting for the other end to signal efd.
+struct spsc_end {
+    _Alignas(CACHE_LINE) atomic_ulong pos;
+    unsigned long other;
+    atomic_bool waiting;
+    int efd;
+};
+
+// Lock-free single-producer, single-consumer ring of fixed-size elements.
+// Positions only grow and index the slots modulo the (power of two)
+// capacity. Each end writes only its own cache line, and reads the other's
+// only when its cached copy makes the ring look full (or empty). An end
+// that runs out of work parks; the other end then signals its efd after
+// its next push (or pop).
+struct spsc {
+    struct spsc_end *prod;
+    struct spsc_end *cons;
+    unsigned long mask;
+    size_t elem_size;
+    char *slots;
+};
+
+int spsc_init(struct spsc *q, unsigned long cap, size_t elem_size);
+bool spsc_push(struct spsc *q, const void *elem);
+bool spsc_has_room(struct spsc *q, unsigned long n);
+void *spsc_peek(struct spsc *q, unsigned long i);
+void spsc_release(struct spsc *q, unsigned long n);
+bool spsc_pop(struct spsc *q, void *elem);
+bool spsc_park_producer(struct spsc *q, unsigned long n);
+bool spsc_park_consumer(struct spsc *q);
+void spsc_wait(int efd);
+void spsc_kick(int efd);
+void spsc_destroy(struct spsc *q);
@@ -1,15 +1,24 @@
 #include <stdio.h>
+#include <time.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include "timer.h"
 
 
 // Sets timeout value for socket 'sock' for 'timeout_val'
 // (in seconds)
 int set_timeout(int sock, int timeout_val)
+{
+    return set_timeout_usec(sock, timeout_val * 1000000L);
+}
+
+// Sets timeout value for socket 'sock' for 'timeout_usec' microseconds
+int set_timeout_usec(int sock, long timeout_usec)
 {
     struct timeval timeout;
-    timeout.tv_sec = timeout_val;
-    timeout.tv_usec = 0;
+    timeout.tv_sec = timeout_usec / 1000000L;
+    timeout.tv_usec = timeout_usec % 1000000L;
     int ret = setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
     if (ret == -1) {
         fprintf(stderr, "[set_timeout]: couldn't set timeout for sock\n");
@@ -29,3 +38,86 @@ int disable_timeout(int sock)
         return 0;
     }
 }
+
+// Monotonic clock in microseconds
+uint64_t now_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// User plus system CPU time used by the process so far, all threads included
+uint64_t cpu_usec(void)
+{
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == -1) {
+        return 0;
+    }
+    return (uint64_t) (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000ULL
+            + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+// Starts with the conservative TIMEOUT_SEC until the first RTT sample
+void rtt_init(struct rtt_estimator *est)
+{
+    est->srtt = 0;
+    est->rttvar = 0;
+    est->rto = TIMEOUT_SEC * 1000000L;
+    est->backoff = 0;
+    est->have_sample = false;
+}
+
+// Feeds one RTT measurement into the estimator. Callers must follow Karn's
+// rule and never sample a packet that was retransmitted.
+void rtt_sample(struct rtt_estimator *est, long sample_usec)
+{
+    if (sample_usec < 1) {
+        sample_usec = 1;
+    }
+    if (!est->have_sample) {
+        est->srtt = sample_usec;
+        est->rttvar = sample_usec / 2;
+        est->have_sample = true;
+    } else {
+        long err = sample_usec - est->srtt;
+        if (err < 0) {
+            err = -err;
+        }
+        // rttvar = 3/4 rttvar + 1/4 |err|, srtt = 7/8 srtt + 1/8 sample
+        est->rttvar += (err - est->rttvar) / 4;
+        est->srtt += (sample_usec - est->srtt) / 8;
+    }
+    est->rto = est->srtt + 4 * est->rttvar;
+    est->backoff = 0;
+    if (est->rto < RTO_MIN_USEC) {
+        est->rto = RTO_MIN_USEC;
+    } else if (est->rto > RTO_MAX_USEC) {
+        est->rto = RTO_MAX_USEC;
+    }
+}
+
+// Doubles the timeout after an expiry
+void rtt_backoff(struct rtt_estimator *est)
+{
+    if (est->rto < RTO_MAX_USEC) {
+        est->backoff++;
+    }
+}
+
+// Forward progress without a usable sample (the ACK covered a resent
+// packet) still shows the path works, so drop the backoff
+void rtt_reset_backoff(struct rtt_estimator *est)
+{
+    est->backoff = 0;
+}
+
+// Current timeout including exponential backoff
+long rtt_rto(struct rtt_estimator *est)
+{
+    long rto = est->rto;
+    for (int i = 0; i < est->backoff && rto < RTO_MAX_USEC; ++i) {
+        rto *= 2;
+    }
+    return (rto > RTO_MAX_USEC) ? RTO_MAX_USEC : rto;
+}
@@ -1,12 +1,34 @@
 #include <time.h>
+#include <stdbool.h>
+#include <inttypes.h>
 
 #pragma once
 
-#define TIMEOUT_SEC 3
+// Initial retransmission timeout before any RTT sample (RFC 6298)
+#define TIMEOUT_SEC 1
+#define RTO_MIN_USEC 1000
+#define RTO_MAX_USEC (60 * 1000000L)
 
 
+// Retransmission timeout estimator (RFC 6298). Times are in microseconds.
+struct rtt_estimator {
+    long srtt;
+    long rttvar;
+    long rto;
+    int backoff;
+    bool have_sample;
+};
+
 int set_timeout(int sock, int timeout_val);
+int set_timeout_usec(int sock, long timeout_usec);
 int disable_timeout(int sock);
+uint64_t now_usec(void);
+uint64_t cpu_usec(void);
+void rtt_init(struct rtt_estimator *est);
+void rtt_sample(struct rtt_estimator *est, long sample_usec);
+void rtt_backoff(struct rtt_estimator *est);
+void rtt_reset_backoff(struct rtt_estimator *est);
+long rtt_rto(struct rtt_estimator *est);
 
 /*
 int create_timer(timer_t *timerid, int sig);
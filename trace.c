@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "trace.h"
+#include "timer.h"
+
+
+static const char *event_names[TRACE_EVENTS] = {
+    [TRACE_SEND] = "SEND PACKET",
+    [TRACE_RESEND] = "RESEND PACKET",
+    [TRACE_SEND_TEARDOWN] = "SEND TEAR-DOWN PACKET",
+    [TRACE_RECV_ACK] = "RECEIVED ACK",
+    [TRACE_RECV_TEARDOWN_ACK] = "RECEIVED TEAR-DOWN ACK",
+    [TRACE_TIMEOUT] = "TIMEOUT",
+    [TRACE_FAST_RETRANSMIT] = "FAST RETRANSMIT",
+    [TRACE_RECV] = "RECEIVED PACKET",
+    [TRACE_RECV_LATE] = "RECEIVED PACKET AFTER TEAR-DOWN",
+    [TRACE_SEND_ACK] = "SEND ACK",
+    [TRACE_RECV_TEARDOWN] = "RECEIVED TEAR-DOWN PACKET",
+    [TRACE_SEND_TEARDOWN_ACK] = "SEND TEAR-DOWN ACK",
+    [TRACE_SEND_PARITY] = "SEND PARITY",
+    [TRACE_RECV_PARITY] = "RECEIVED PARITY",
+    [TRACE_RECOVER] = "RECOVERED PACKET",
+    [TRACE_RECV_RESUME] = "RECEIVED RESUME REQUEST",
+    [TRACE_SEND_RESUME_ACK] = "SEND RESUME ACK",
+};
+
+const char *trace_event_name(int event)
+{
+    if (event <= 0 || event >= TRACE_EVENTS) {
+        return "UNKNOWN";
+    }
+    return event_names[event];
+}
+
+// Creates the trace file and writes its header
+int trace_open(struct trace *t, const char *path)
+{
+    memset(t, 0, sizeof(*t));
+    atomic_init(&t->stop, false);
+    t->out = fopen(path, "wb");
+    if (t->out == NULL) {
+        perror("[trace_open]: fopen");
+        return -1;
+    }
+    struct trace_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.version = TRACE_VERSION;
+    hdr.record_size = sizeof(struct trace_record);
+    hdr.start_usec = now_usec();
+    if (fwrite(&hdr, sizeof(hdr), 1, t->out) != 1) {
+        perror("[trace_open]: fwrite");
+        fclose(t->out);
+        return -1;
+    }
+    return 0;
+}
+
+// Gives a thread a ring of its own. All rings are added before trace_start.
+struct trace_ring *trace_add_ring(struct trace *t)
+{
+    if (t->nrings == TRACE_MAX_RINGS) {
+        fprintf(stderr, "[trace_add_ring]: too many threads\n");
+        return NULL;
+    }
+    struct trace_ring *ring = aligned_alloc(64, sizeof(struct trace_ring));
+    if (ring == NULL) {
+        fprintf(stderr, "[trace_add_ring]: couldn't allocate ring\n");
+        return NULL;
+    }
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->dropped, 0);
+    ring->thread = (uint16_t) t->nrings;
+    t->rings[t->nrings++] = ring;
+    return ring;
+}
+
+void trace_emit(struct trace_ring *ring, int event, int64_t seq, uint32_t len)
+{
+    unsigned long head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == TRACE_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    struct trace_record *rec = &ring->records[head & (TRACE_RING_SIZE - 1)];
+    rec->time_usec = now_usec();
+    rec->seq = seq;
+    rec->len = len;
+    rec->event = (uint16_t) event;
+    rec->thread = ring->thread;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// Writes out whatever the rings hold, in at most two runs per ring
+static void drain(struct trace *t)
+{
+    for (int i = 0; i < t->nrings; ++i) {
+        struct trace_ring *ring = t->rings[i];
+        unsigned long tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        unsigned long head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        while (tail != head) {
+            unsigned long first = tail & (TRACE_RING_SIZE - 1);
+            unsigned long count = head - tail;
+            if (count > TRACE_RING_SIZE - first) {
+                count = TRACE_RING_SIZE - first;
+            }
+            if (fwrite(&ring->records[first], sizeof(struct trace_record), count, t->out) != count) {
+                perror("[trace]: fwrite");
+            }
+            tail += count;
+            atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        }
+    }
+    fflush(t->out);
+}
+
+static void *run_flush(void *arg)
+{
+    struct trace *t = arg;
+    struct timespec period = {0, TRACE_FLUSH_USEC * 1000L};
+    while (!atomic_load(&t->stop)) {
+        nanosleep(&period, NULL);
+        drain(t);
+    }
+    return NULL;
+}
+
+// Starts the thread that moves records from the rings to the file
+int trace_start(struct trace *t)
+{
+    if (pthread_create(&t->thread, NULL, run_flush, t) != 0) {
+        fprintf(stderr, "[trace_start]: couldn't start flush thread\n");
+        return -1;
+    }
+    t->running = true;
+    return 0;
+}
+
+// Stops the flush thread once the traced threads are done, writes the rest
+// and closes the file. Returns the number of records dropped.
+unsigned long trace_close(struct trace *t)
+{
+    if (t->running) {
+        atomic_store(&t->stop, true);
+        pthread_join(t->thread, NULL);
+        t->running = false;
+    }
+    drain(t);
+    fclose(t->out);
+    unsigned long dropped = 0;
+    for (int i = 0; i < t->nrings; ++i) {
+        dropped += atomic_load(&t->rings[i]->dropped);
+        free(t->rings[i]);
+    }
+    return dropped;
+}
@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <pthread.h>
+
+#pragma once
+
+#define TRACE_MAGIC "GBNTRACE"
+#define TRACE_VERSION 1
+// Records per thread; a power of two. Records that find the ring full are
+// dropped (and counted) rather than stall the transfer.
+#define TRACE_RING_SIZE 65536
+#define TRACE_MAX_RINGS 128
+#define TRACE_FLUSH_USEC 10000
+
+// Records an event if tracing is on. With ring NULL (no -T) the arguments
+// are never evaluated and nothing is called.
+#define TRACE(ring, event, seq, len) do { \
+    if ((ring) != NULL) { \
+        trace_emit((ring), (event), (seq), (len)); \
+    } \
+} while (0)
+
+
+enum trace_event {
+    TRACE_SEND = 1,
+    TRACE_RESEND,
+    TRACE_SEND_TEARDOWN,
+    TRACE_RECV_ACK,
+    TRACE_RECV_TEARDOWN_ACK,
+    TRACE_TIMEOUT,
+    TRACE_FAST_RETRANSMIT,
+    TRACE_RECV,
+    TRACE_RECV_LATE,
+    TRACE_SEND_ACK,
+    TRACE_RECV_TEARDOWN,
+    TRACE_SEND_TEARDOWN_ACK,
+    TRACE_SEND_PARITY,
+    TRACE_RECV_PARITY,
+    TRACE_RECOVER,
+    TRACE_RECV_RESUME,
+    TRACE_SEND_RESUME_ACK,
+    TRACE_EVENTS
+};
+
+// One traced event, written to the file as is (host byte order). seq is the
+// packet's sequence number, or for ACKs the next packet expected (for
+// resume ACKs the offset resumed from).
+struct trace_record {
+    uint64_t time_usec;
+    int64_t seq;
+    uint32_t len;
+    uint16_t event;
+    uint16_t thread;
+};
+
+// Start of a trace file, followed by records. Records of different threads
+// are interleaved in flush order, not time order.
+struct trace_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t start_usec;
+};
+
+// Single-producer/single-consumer ring of one thread's records. The owning
+// thread advances head, the flush thread advances tail.
+struct trace_ring {
+    _Alignas(64) atomic_ulong head;
+    _Alignas(64) atomic_ulong tail;
+    atomic_ulong dropped;
+    uint16_t thread;
+    struct trace_record records[TRACE_RING_SIZE];
+};
+
+// A trace file and the rings of the threads writing to it
+struct trace {
+    FILE *out;
+    struct trace_ring *rings[TRACE_MAX_RINGS];
+    int nrings;
+    pthread_t thread;
+    bool running;
+    atomic_bool stop;
+};
+
+int trace_open(struct trace *t, const char *path);
+struct trace_ring *trace_add_ring(struct trace *t);
+int trace_start(struct trace *t);
+void trace_emit(struct trace_ring *ring, int event, int64_t seq, uint32_t len);
+unsigned long trace_close(struct trace *t);
+const char *trace_event_name(int event);
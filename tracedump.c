@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include "trace.h"
+
+
+static void usage(char *prog)
+{
+    fprintf(stderr, "Usage:\n");
+    fprintf(stderr, "    %s [options] trace_file\n", prog);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -t msec      print a timeline: event counts per interval of msec\n");
+    fprintf(stderr, "                 instead of one line per event\n");
+    exit(1);
+}
+
+// Time order, ties broken by thread
+static bool before(const struct trace_record *x, const struct trace_record *y)
+{
+    if (x->time_usec != y->time_usec) {
+        return x->time_usec < y->time_usec;
+    }
+    return x->thread < y->thread;
+}
+
+// Stable merge sort, so events of one thread within the same microsecond
+// keep their program (file) order
+static void sort_records(struct trace_record *recs, struct trace_record *tmp, size_t n)
+{
+    if (n < 2) {
+        return;
+    }
+    size_t half = n / 2;
+    sort_records(recs, tmp, half);
+    sort_records(recs + half, tmp, n - half);
+    size_t i = 0, j = half, k = 0;
+    while (i < half && j < n) {
+        tmp[k++] = before(&recs[j], &recs[i]) ? recs[j++] : recs[i++];
+    }
+    while (i < half) {
+        tmp[k++] = recs[i++];
+    }
+    memcpy(recs, tmp, k * sizeof(struct trace_record));
+}
+
+// Reads all records of a trace file, sorted by time
+static struct trace_record *load(const char *path, struct trace_header *hdr, size_t *count)
+{
+    FILE *in = fopen(path, "rb");
+    if (in == NULL) {
+        perror("[tracedump]: fopen");
+        return NULL;
+    }
+    if (fread(hdr, sizeof(*hdr), 1, in) != 1 || memcmp(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic)) != 0) {
+        fprintf(stderr, "[tracedump]: %s is not a trace file\n", path);
+        fclose(in);
+        return NULL;
+    }
+    if (hdr->version != TRACE_VERSION || hdr->record_size != sizeof(struct trace_record)) {
+        fprintf(stderr, "[tracedump]: unsupported trace version %u\n", hdr->version);
+        fclose(in);
+        return NULL;
+    }
+    size_t cap = 4096;
+    size_t n = 0;
+    struct trace_record *recs = malloc(cap * sizeof(struct trace_record));
+    while (recs != NULL) {
+        n += fread(recs + n, sizeof(struct trace_record), cap - n, in);
+        if (n < cap) {
+            break;
+        }
+        cap *= 2;
+        struct trace_record *more = realloc(recs, cap * sizeof(struct trace_record));
+        if (more == NULL) {
+            free(recs);
+        }
+        recs = more;
+    }
+    fclose(in);
+    if (recs == NULL) {
+        fprintf(stderr, "[tracedump]: out of memory\n");
+        return NULL;
+    }
+
+    struct trace_record *tmp = malloc((n > 0 ? n : 1) * sizeof(struct trace_record));
+    if (tmp == NULL) {
+        fprintf(stderr, "[tracedump]: out of memory\n");
+        free(recs);
+        return NULL;
+    }
+    sort_records(recs, tmp, n);
+    free(tmp);
+    *count = n;
+    return recs;
+}
+
+static void print_events(struct trace_header *hdr, struct trace_record *recs, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        struct trace_record *r = &recs[i];
+        printf("%12.3f ms  t%-3u %s", (r->time_usec - hdr->start_usec) / 1000.0, r->thread,
+                trace_event_name(r->event));
+        if (r->event != TRACE_SEND_TEARDOWN && r->event != TRACE_RECV_TEARDOWN
+                && r->event != TRACE_RECV_TEARDOWN_ACK && r->event != TRACE_SEND_TEARDOWN_ACK) {
+            printf(" %" PRId64, r->seq);
+        }
+        if (r->len > 0) {
+            printf(" (%u bytes)", r->len);
+        }
+        printf("\n");
+    }
+}
+
+// One row per interval with the number of each kind of event in it. Only
+// the kinds that occur get a column.
+static void print_timeline(struct trace_header *hdr, struct trace_record *recs, size_t n, uint64_t interval)
+{
+    bool seen[TRACE_EVENTS] = {false};
+    for (size_t i = 0; i < n; ++i) {
+        if (recs[i].event < TRACE_EVENTS) {
+            seen[recs[i].event] = true;
+        }
+    }
+    printf("time_ms");
+    for (int e = 1; e < TRACE_EVENTS; ++e) {
+        if (seen[e]) {
+            printf(",%s", trace_event_name(e));
+        }
+    }
+    printf("\n");
+
+    size_t i = 0;
+    while (i < n) {
+        uint64_t start = (recs[i].time_usec - hdr->start_usec) / interval * interval;
+        unsigned long counts[TRACE_EVENTS] = {0};
+        while (i < n && recs[i].time_usec - hdr->start_usec < start + interval) {
+            if (recs[i].event < TRACE_EVENTS) {
+                counts[recs[i].event]++;
+            }
+            i++;
+        }
+        printf("%.3f", start / 1000.0);
+        for (int e = 1; e < TRACE_EVENTS; ++e) {
+            if (seen[e]) {
+                printf(",%lu", counts[e]);
+            }
+        }
+        printf("\n");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    double interval_ms = 0.0;
+    int opt;
+    while ((opt = getopt(argc, argv, "t:")) != -1) {
+        switch (opt) {
+        case 't':
+            interval_ms = strtod(optarg, NULL);
+            if (interval_ms <= 0.0) {
+                fprintf(stderr, "[error]: interval must be positive\n");
+                exit(1);
+            }
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1) {
+        usage(argv[0]);
+    }
+    struct trace_header hdr;
+    size_t n;
+    struct trace_record *recs = load(argv[optind], &hdr, &n);
+    if (recs == NULL) {
+        exit(1);
+    }
+    uint64_t interval = (uint64_t) (interval_ms * 1000.0);
+    if (interval > 0) {
+        print_timeline(&hdr, recs, n, interval);
+    } else {
+        print_events(&hdr, recs, n);
+    }
+    free(recs);
+    return 0;
+}
@@ -0,0 +1,295 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "uring.h"
+
+#define RECV_TAG UINT64_MAX
+
+
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+// Sets up the rings, the provided buffer ring and the send slots. Fails
+// (so callers can fall back to plain socket calls) on kernels without
+// io_uring, single-mmap rings or provided buffer rings (Linux 5.19+).
+int uring_init(struct uring *ring)
+{
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+
+    // Completions are only needed when the loop comes back for them, so
+    // don't interrupt the thread to post them (Linux 5.19+)
+    p.flags = IORING_SETUP_COOP_TASKRUN;
+    ring->fd = sys_setup(URING_ENTRIES, &p);
+    if (ring->fd == -1 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        ring->fd = sys_setup(URING_ENTRIES, &p);
+    }
+    if (ring->fd == -1) {
+        perror("[uring_init]: io_uring_setup");
+        return -1;
+    }
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        fprintf(stderr, "[uring_init]: kernel lacks IORING_FEAT_SINGLE_MMAP\n");
+        goto fail;
+    }
+
+    // SQ and CQ rings share one mapping; the SQEs have their own
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_len = sq_len > cq_len ? sq_len : cq_len;
+    ring->ring_mem = mmap(NULL, ring->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring->fd, IORING_OFF_SQ_RING);
+    if (ring->ring_mem == MAP_FAILED) {
+        ring->ring_mem = NULL;
+        perror("[uring_init]: mmap rings");
+        goto fail;
+    }
+    ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        perror("[uring_init]: mmap sqes");
+        goto fail;
+    }
+    uint8_t *base = ring->ring_mem;
+    ring->sq_head = (unsigned *) (base + p.sq_off.head);
+    ring->sq_tail = (unsigned *) (base + p.sq_off.tail);
+    ring->sq_mask = *(unsigned *) (base + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned *) (base + p.sq_off.array);
+    ring->cq_head = (unsigned *) (base + p.cq_off.head);
+    ring->cq_tail = (unsigned *) (base + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *) (base + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) (base + p.cq_off.cqes);
+
+    // Provided buffer ring, registered with the kernel so the multishot
+    // receive picks buffers itself
+    ring->buf_size = sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr) + FRAMESIZE;
+    ring->br_len = URING_BUFS * sizeof(struct io_uring_buf);
+    ring->br = mmap(NULL, ring->br_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->br == MAP_FAILED) {
+        ring->br = NULL;
+        perror("[uring_init]: mmap buffer ring");
+        goto fail;
+    }
+    ring->bufs = malloc(URING_BUFS * ring->buf_size);
+    ring->sends = malloc(p.sq_entries * sizeof(struct uring_send));
+    ring->free_sends = malloc(p.sq_entries * sizeof(int));
+    if (ring->bufs == NULL || ring->sends == NULL || ring->free_sends == NULL) {
+        fprintf(stderr, "[uring_init]: couldn't allocate buffers\n");
+        goto fail;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) ring->br;
+    reg.ring_entries = URING_BUFS;
+    reg.bgid = URING_BGID;
+    if (sys_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        perror("[uring_init]: register buffer ring");
+        goto fail;
+    }
+    for (int i = 0; i < URING_BUFS; ++i) {
+        uring_put_buf(ring, i);
+    }
+
+    // Leave one SQE for re-arming the receive
+    ring->nfree = p.sq_entries - 1;
+    for (int i = 0; i < ring->nfree; ++i) {
+        ring->free_sends[i] = i;
+    }
+    return 0;
+
+    fail:
+        uring_destroy(ring);
+        return -1;
+}
+
+void uring_destroy(struct uring *ring)
+{
+    if (ring->fd != -1) {
+        close(ring->fd);
+    }
+    if (ring->ring_mem != NULL) {
+        munmap(ring->ring_mem, ring->ring_len);
+    }
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if (ring->br != NULL) {
+        munmap(ring->br, ring->br_len);
+    }
+    free(ring->bufs);
+    free(ring->sends);
+    free(ring->free_sends);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+static struct io_uring_sqe *get_sqe(struct uring *ring)
+{
+    unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring->sq_tail;
+    if (tail - head > ring->sq_mask) {
+        return NULL;
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->pending++;
+    return sqe;
+}
+
+// Starts a multishot recvmsg on sock: one submission that keeps producing a
+// completion per datagram until it runs out of buffers
+int uring_arm_recv(struct uring *ring, int sock)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (sqe == NULL) {
+        fprintf(stderr, "[uring_arm_recv]: submission queue full\n");
+        return -1;
+    }
+    memset(&ring->recv_msg, 0, sizeof(ring->recv_msg));
+    ring->recv_msg.msg_namelen = sizeof(struct sockaddr);
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = sock;
+    sqe->addr = (uint64_t) (uintptr_t) &ring->recv_msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = RECV_TAG;
+    ring->recv_sock = sock;
+    ring->recv_armed = true;
+    return 0;
+}
+
+// Takes a free send slot, or returns NULL when every slot is in flight
+struct uring_send *uring_get_send(struct uring *ring)
+{
+    if (ring->nfree == 0) {
+        return NULL;
+    }
+    return &ring->sends[ring->free_sends[--ring->nfree]];
+}
+
+// Queues a sendmsg of the slot's msg on sock. It goes to the kernel with the next
+// uring_submit.
+int uring_queue_send(struct uring *ring, struct uring_send *send, int sock)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (sqe == NULL) {
+        fprintf(stderr, "[uring_queue_send]: submission queue full\n");
+        ring->free_sends[ring->nfree++] = send - ring->sends;
+        return -1;
+    }
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = sock;
+    sqe->addr = (uint64_t) (uintptr_t) &send->msg;
+    sqe->len = 1;
+    sqe->user_data = (uint64_t) (send - ring->sends);
+    return 0;
+}
+
+// Hands everything queued to the kernel in one io_uring_enter, re-arming
+// the receive first if it stopped
+int uring_submit(struct uring *ring)
+{
+    if (!ring->recv_armed && uring_arm_recv(ring, ring->recv_sock) == -1) {
+        return -1;
+    }
+    while (ring->pending > 0) {
+        int ret = sys_enter(ring->fd, ring->pending, 0, 0);
+        if (ret == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("[uring_submit]: io_uring_enter");
+            return -1;
+        }
+        ring->pending -= ret;
+    }
+    return 0;
+}
+
+// Returns a provided buffer to the kernel
+void uring_put_buf(struct uring *ring, int bid)
+{
+    uint16_t tail = ring->br->tail;
+    struct io_uring_buf *buf = &ring->br->bufs[tail & (URING_BUFS - 1)];
+    buf->addr = (uint64_t) (uintptr_t) (ring->bufs + (size_t) bid * ring->buf_size);
+    buf->len = ring->buf_size;
+    buf->bid = bid;
+    __atomic_store_n(&ring->br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Walks the completion queue to the next received datagram. Send
+// completions on the way just free their slots. Returns 1 with the payload
+// in a provided buffer that the caller hands back with uring_put_buf, 0 when
+// the queue is empty, or -1 on error.
+int uring_next_recv(struct uring *ring, uint8_t **data, size_t *len, struct sockaddr *from, int *bid)
+{
+    for (;;) {
+        unsigned head = *ring->cq_head;
+        if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+        struct io_uring_cqe cqe = ring->cqes[head & ring->cq_mask];
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        if (cqe.user_data != RECV_TAG) {
+            ring->free_sends[ring->nfree++] = (int) cqe.user_data;
+            if (cqe.res < 0 && cqe.res != -ECONNREFUSED) {
+                fprintf(stderr, "[uring_next_recv]: sendmsg: %s\n", strerror(-cqe.res));
+            }
+            continue;
+        }
+
+        // The multishot receive ends on errors and when the buffers run
+        // out; uring_submit starts it again
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            ring->recv_armed = false;
+        }
+        if (cqe.res < 0) {
+            if (cqe.res != -ENOBUFS && cqe.res != -ECONNREFUSED) {
+                fprintf(stderr, "[uring_next_recv]: recvmsg: %s\n", strerror(-cqe.res));
+                errno = -cqe.res;
+                return -1;
+            }
+            continue;
+        }
+        if (!(cqe.flags & IORING_CQE_F_BUFFER)) {
+            continue;
+        }
+        *bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        uint8_t *buf = ring->bufs + (size_t) *bid * ring->buf_size;
+        struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *) buf;
+        uint8_t *name = buf + sizeof(*out);
+        if (from != NULL) {
+            memset(from, 0, sizeof(*from));
+            memcpy(from, name, out->namelen < sizeof(*from) ? out->namelen : sizeof(*from));
+        }
+        *data = name + ring->recv_msg.msg_namelen + ring->recv_msg.msg_controllen;
+        *len = out->payloadlen;
+        return 1;
+    }
+}
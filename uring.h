@@ -0,0 +1,67 @@
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <linux/io_uring.h>
+#include "packet.h"
+
+#pragma once
+
+#define URING_ENTRIES 256
+#define URING_BUFS 256
+#define URING_BGID 1
+
+
+// Everything the kernel reads for one in-flight sendmsg. It has to stay
+// put until the send completes, so sends take a slot and give it back on
+// completion.
+struct uring_send {
+    struct msghdr msg;
+    struct iovec iov[2];
+    struct sockaddr addr;
+    uint8_t hdr[ACKSIZE];
+};
+
+// Minimal io_uring on raw syscalls: one multishot recvmsg fed from a ring
+// of provided buffers, and sendmsg submissions out of a fixed set of send
+// slots. The ring fd becomes readable when completions are waiting, so it
+// sits in the event loop like a socket.
+struct uring {
+    int fd;
+    void *ring_mem;
+    size_t ring_len;
+    struct io_uring_sqe *sqes;
+    size_t sqes_len;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *sq_array;
+    unsigned pending;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    // Provided buffers for the multishot receive. Each one holds an
+    // io_uring_recvmsg_out, the source address and a frame.
+    struct io_uring_buf_ring *br;
+    size_t br_len;
+    uint8_t *bufs;
+    size_t buf_size;
+    struct msghdr recv_msg;
+    int recv_sock;
+    bool recv_armed;
+
+    struct uring_send *sends;
+    int *free_sends;
+    int nfree;
+};
+
+int uring_init(struct uring *ring);
+void uring_destroy(struct uring *ring);
+int uring_arm_recv(struct uring *ring, int sock);
+struct uring_send *uring_get_send(struct uring *ring);
+int uring_queue_send(struct uring *ring, struct uring_send *send, int sock);
+int uring_submit(struct uring *ring);
+int uring_next_recv(struct uring *ring, uint8_t **data, size_t *len, struct sockaddr *from, int *bid);
+void uring_put_buf(struct uring *ring, int bid);
@@ -0,0 +1,193 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include "workq.h"
+
+
+static void *run_worker(void *arg)
+{
+    struct workq *q = arg;
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        while (q->count == 0 && !q->stopping) {
+            pthread_cond_wait(&q->nonempty, &q->lock);
+        }
+        if (q->count == 0) {
+            break;
+        }
+        struct work w = q->jobs[q->head];
+        q->head = (q->head + 1) % q->cap;
+        q->count--;
+        pthread_cond_signal(&q->nonfull);
+        pthread_mutex_unlock(&q->lock);
+        w.fn(w.arg);
+        pthread_mutex_lock(&q->lock);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+// Starts nthreads threads with room for cap queued jobs
+int workq_init(struct workq *q, int nthreads, int cap)
+{
+    if (nthreads < 1 || nthreads > MAX_WORK_THREADS || cap < 1) {
+        fprintf(stderr, "[workq_init]: bad thread count %d or queue size %d\n", nthreads, cap);
+        return -1;
+    }
+    q->jobs = malloc(cap * sizeof(struct work));
+    if (q->jobs == NULL) {
+        fprintf(stderr, "[workq_init]: couldn't allocate queue\n");
+        return -1;
+    }
+    q->cap = cap;
+    q->head = 0;
+    q->count = 0;
+    q->stopping = false;
+    q->nthreads = 0;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->nonempty, NULL);
+    pthread_cond_init(&q->nonfull, NULL);
+    for (int i = 0; i < nthreads; ++i) {
+        if (pthread_create(&q->threads[i], NULL, run_worker, q) != 0) {
+            fprintf(stderr, "[workq_init]: couldn't start thread %d\n", i);
+            workq_destroy(q);
+            return -1;
+        }
+        q->nthreads++;
+    }
+    return 0;
+}
+
+// Queues a job, waiting for room if the queue is full
+void workq_submit(struct workq *q, work_fn fn, void *arg)
+{
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->cap) {
+        pthread_cond_wait(&q->nonfull, &q->lock);
+    }
+    q->jobs[(q->head + q->count) % q->cap] = (struct work) {fn, arg};
+    q->count++;
+    pthread_cond_signal(&q->nonempty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Runs what is still queued, then stops and joins the threads
+void workq_destroy(struct workq *q)
+{
+    pthread_mutex_lock(&q->lock);
+    q->stopping = true;
+    pthread_cond_broadcast(&q->nonempty);
+    pthread_mutex_unlock(&q->lock);
+    for (int i = 0; i < q->nthreads; ++i) {
+        pthread_join(q->threads[i], NULL);
+    }
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->nonempty);
+    pthread_cond_destroy(&q->nonfull);
+    free(q->jobs);
+}
+
+void latch_init(struct latch *l)
+{
+    pthread_mutex_init(&l->lock, NULL);
+    pthread_cond_init(&l->done, NULL);
+    l->pending = 0;
+}
+
+// n more jobs are about to be submitted
+void latch_add(struct latch *l, int n)
+{
+    pthread_mutex_lock(&l->lock);
+    l->pending += n;
+    pthread_mutex_unlock(&l->lock);
+}
+
+// One job of the batch finished
+void latch_done(struct latch *l)
+{
+    pthread_mutex_lock(&l->lock);
+    if (--l->pending == 0) {
+        pthread_cond_broadcast(&l->done);
+    }
+    pthread_mutex_unlock(&l->lock);
+}
+
+void latch_wait(struct latch *l)
+{
+    pthread_mutex_lock(&l->lock);
+    while (l->pending > 0) {
+        pthread_cond_wait(&l->done, &l->lock);
+    }
+    pthread_mutex_unlock(&l->lock);
+}
+
+void latch_destroy(struct latch *l)
+{
+    pthread_mutex_destroy(&l->lock);
+    pthread_cond_destroy(&l->done);
+}
+
+// Parses a CPU list such as "0,2,4-7" (-k) into cpus, in the order given.
+// Returns the number of CPUs, or -1 if the list is malformed or longer
+// than max.
+int parse_cpus(const char *spec, int *cpus, int max)
+{
+    int n = 0;
+    const char *p = spec;
+    for (;;) {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p) {
+            break;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p) {
+                break;
+            }
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE) {
+            break;
+        }
+        for (long cpu = first; cpu <= last; ++cpu) {
+            if (n == max) {
+                fprintf(stderr, "[parse_cpus]: more than %d CPUs in %s\n", max, spec);
+                return -1;
+            }
+            cpus[n++] = (int) cpu;
+        }
+        if (*end == '\0') {
+            return n;
+        } else if (*end != ',') {
+            break;
+        }
+        p = end + 1;
+    }
+    fprintf(stderr, "[parse_cpus]: bad CPU list %s\n", spec);
+    return -1;
+}
+
+// Starts a thread, pinned to 'cpu' unless it is -1
+int start_thread(pthread_t *thread, void *(*fn)(void *), void *arg, int cpu)
+{
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (cpu != -1) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+    }
+    int ret = pthread_create(thread, &attr, fn, arg);
+    pthread_attr_destroy(&attr);
+    if (ret != 0 && cpu != -1) {
+        fprintf(stderr, "[start_thread]: couldn't start thread on CPU %d\n", cpu);
+        return -1;
+    } else if (ret != 0) {
+        fprintf(stderr, "[start_thread]: couldn't start thread\n");
+        return -1;
+    }
+    return 0;
+}
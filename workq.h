@@ -0,0 +1,49 @@
+#include <stdbool.h>
+#include <pthread.h>
+
+#pragma once
+
+#define MAX_WORK_THREADS 64
+#define MAX_CPUS 256
+
+
+typedef void (*work_fn)(void *arg);
+
+struct work {
+    work_fn fn;
+    void *arg;
+};
+
+// A fixed pool of threads running jobs from a bounded FIFO queue. Jobs run
+// in any order and on any thread; whoever submits them tracks completion.
+struct workq {
+    pthread_mutex_t lock;
+    pthread_cond_t nonempty;
+    pthread_cond_t nonfull;
+    struct work *jobs;
+    int cap;
+    int head;
+    int count;
+    bool stopping;
+    pthread_t threads[MAX_WORK_THREADS];
+    int nthreads;
+};
+
+// Counts the outstanding jobs of one batch, so its submitter can wait for
+// all of them
+struct latch {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    int pending;
+};
+
+int workq_init(struct workq *q, int nthreads, int cap);
+void workq_submit(struct workq *q, work_fn fn, void *arg);
+void workq_destroy(struct workq *q);
+void latch_init(struct latch *l);
+void latch_add(struct latch *l, int n);
+void latch_done(struct latch *l);
+void latch_wait(struct latch *l);
+void latch_destroy(struct latch *l);
+int parse_cpus(const char *spec, int *cpus, int max);
+int start_thread(pthread_t *thread, void *(*fn)(void *), void *arg, int cpu);
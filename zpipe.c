@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "zpipe.h"
+#include "lz.h"
+
+
+// Worker side: compresses one block into its slot and wakes the sender if
+// it is waiting for exactly this block
+static void compress_block(void *arg)
+{
+    struct zblock *blk = arg;
+    struct zpipe *z = blk->z;
+    size_t offset = (size_t) blk->index * z->block_size;
+    int len = z->len - offset < (size_t) z->block_size ? (int) (z->len - offset) : z->block_size;
+
+    // Only blocks that shrink are worth sending compressed
+    blk->len = lz_compress(z->src + offset, len, blk->data, len - 1);
+    if (blk->len > 0) {
+        atomic_fetch_add_explicit(&z->compressed, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&z->bytes_out, blk->len, memory_order_relaxed);
+    } else {
+        atomic_fetch_add_explicit(&z->bytes_out, len, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&z->bytes_in, len, memory_order_relaxed);
+
+    atomic_store(&blk->ready, blk->index + 1);
+    if (atomic_load(&z->waiting) == blk->index) {
+        uint64_t one = 1;
+        if (write(z->efd, &one, sizeof(one)) == -1) {
+            perror("[zpipe]: write eventfd");
+        }
+    }
+    latch_done(&z->inflight);
+}
+
+// Sets up compression of [src, src + len) in blocks of block_size, with
+// enough slots for a window of that many blocks plus ZPIPE_AHEAD
+int zpipe_init(struct zpipe *z, struct workq *q, const char *src, size_t len, int32_t block_size, int32_t window)
+{
+    if (block_size > LZ_MAX_BLOCK) {
+        fprintf(stderr, "[zpipe_init]: blocks can be at most %d bytes\n", LZ_MAX_BLOCK);
+        return -1;
+    }
+    z->q = q;
+    z->src = src;
+    z->len = len;
+    z->block_size = block_size;
+    z->nblocks = (int64_t) ((len + block_size - 1) / block_size);
+    z->nslots = window + ZPIPE_AHEAD;
+    z->submitted = 0;
+    atomic_init(&z->waiting, -1);
+    atomic_init(&z->compressed, 0);
+    atomic_init(&z->bytes_in, 0);
+    atomic_init(&z->bytes_out, 0);
+    z->slots = calloc(z->nslots, sizeof(struct zblock));
+    z->buf = malloc((size_t) z->nslots * block_size);
+    if (z->slots == NULL || z->buf == NULL) {
+        fprintf(stderr, "[zpipe_init]: couldn't allocate %d blocks\n", z->nslots);
+        free(z->slots);
+        free(z->buf);
+        return -1;
+    }
+    for (int32_t i = 0; i < z->nslots; ++i) {
+        z->slots[i].z = z;
+        z->slots[i].data = z->buf + (size_t) i * block_size;
+        atomic_init(&z->slots[i].ready, 0);
+    }
+    z->efd = eventfd(0, EFD_NONBLOCK);
+    if (z->efd == -1) {
+        perror("[zpipe_init]: eventfd");
+        free(z->slots);
+        free(z->buf);
+        return -1;
+    }
+    latch_init(&z->inflight);
+    return 0;
+}
+
+// Hands the workers every block whose slot is free, now that the first
+// 'released' blocks have been acknowledged
+void zpipe_feed(struct zpipe *z, int64_t released)
+{
+    while (z->submitted < z->nblocks && z->submitted < released + z->nslots) {
+        struct zblock *blk = &z->slots[z->submitted % z->nslots];
+        blk->index = z->submitted++;
+        latch_add(&z->inflight, 1);
+        workq_submit(z->q, compress_block, blk);
+    }
+}
+
+// Returns the compressed block (len 0: send it uncompressed), or false if it
+// isn't ready yet, in which case efd becomes readable once it is
+bool zpipe_get(struct zpipe *z, int64_t block, const char **data, int *len)
+{
+    struct zblock *blk = &z->slots[block % z->nslots];
+    if (atomic_load(&blk->ready) != block + 1) {
+        // Announce the wait, then look again: either the worker sees the
+        // announcement or we see its result
+        atomic_store(&z->waiting, block);
+        if (atomic_load(&blk->ready) != block + 1) {
+            return false;
+        }
+        atomic_store(&z->waiting, -1);
+    }
+    *data = blk->data;
+    *len = blk->len;
+    return true;
+}
+
+// Waits for the blocks still being compressed, then frees everything
+void zpipe_destroy(struct zpipe *z)
+{
+    latch_wait(&z->inflight);
+    latch_destroy(&z->inflight);
+    close(z->efd);
+    free(z->slots);
+    free(z->buf);
+}
@@ -0,0 +1,55 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include "workq.h"
+
+#pragma once
+
+// Blocks compressed ahead of the next one the sender will send, on top of
+// one per window slot
+#define ZPIPE_AHEAD 256
+
+
+struct zpipe;
+
+// One compressed block, reused every nslots blocks. ready is the block
+// index plus one once the block is in data; len is its compressed size, or
+// 0 if it didn't shrink and goes out uncompressed.
+struct zblock {
+    struct zpipe *z;
+    int64_t index;
+    atomic_llong ready;
+    int len;
+    char *data;
+};
+
+// The sender's compression stage. The input is cut into block_size blocks
+// (one per packet) that a shared worker pool compresses in any order into a
+// ring of slots, which the sender reads back in order. A slot is only
+// reused once the block in it has been acknowledged, since a retransmit
+// needs it again. When the sender finds the next block not ready it waits
+// on efd, which the worker that finishes that block writes to.
+struct zpipe {
+    struct workq *q;
+    const char *src;
+    size_t len;
+    int32_t block_size;
+    int64_t nblocks;
+    struct zblock *slots;
+    char *buf;
+    int32_t nslots;
+    int64_t submitted;
+    atomic_llong waiting;
+    int efd;
+    struct latch inflight;
+
+    atomic_ulong compressed;
+    atomic_ulong bytes_in;
+    atomic_ulong bytes_out;
+};
+
+int zpipe_init(struct zpipe *z, struct workq *q, const char *src, size_t len, int32_t block_size, int32_t window);
+void zpipe_feed(struct zpipe *z, int64_t released);
+bool zpipe_get(struct zpipe *z, int64_t block, const char **data, int *len);
+void zpipe_destroy(struct zpipe *z);